@@ -1,6 +1,8 @@
 #ifndef IIMAGE_MANAGER_H 
 #define IIMAGE_MANAGER_H 
 
+#include <stddef.h>
+
 /**
  * @brief The image handler to be userd by the manager.
  */
@@ -11,13 +13,130 @@ typedef struct ImageHandler *ImageHandlerPtr;
  * Possible return values are:
  * - IMAGE_OPERATION_OK:                    Operation was successful.
  * - IMAGE_OPERATION_ERROR:                 Generic error.
+ * - IMAGE_OPERATION_CANCELLED:             Operation was cancelled.
  */
 typedef enum
 {
     IMAGE_OPERATION_OK = 0,
-    IMAGE_OPERATION_ERROR
+    IMAGE_OPERATION_ERROR,
+    IMAGE_OPERATION_CANCELLED
 } ImageOperationResult;
 
+/**
+ * @brief An image import running in background.
+ */
+typedef struct ImageImportOperation *ImageImportOperationPtr;
+
+/**
+ * @brief Function called when a background import finishes. It's called
+ * from one of the handler's worker threads.
+ *
+ * @param[in] operation the finished operation.
+ * @param[in] result result of the import.
+ * @param[in] part_number part number of the imported image, NULL on error.
+ * Owned by the handler and valid until it's destroyed, even after the
+ * operation is released.
+ * @param[in] user_data user data given to import_image_async.
+ */
+typedef void (*ImageImportCallback)(
+    ImageImportOperationPtr operation,
+    ImageOperationResult result,
+    const char *part_number,
+    void *user_data);
+
+/**
+ * @brief Result of one of the files imported by import_images.
+ * - result:            result of the import.
+ * - part_number:       part number of the imported image, NULL on error.
+ *                      Owned by the handler and valid until it's destroyed.
+ */
+typedef struct
+{
+    ImageOperationResult result;
+    const char *part_number;
+} ImageImportResult;
+
+/**
+ * @brief Options used to create an image handler.
+ * Use init_handler_config to fill it with default values before changing
+ * any option.
+ * - root_dir:          image directory of the handler. Handlers with
+ *                      different directories are independent and may be
+ *                      used in parallel. A directory may be shared by
+ *                      several handlers, in the same process or in
+ *                      different ones, which see each other's changes.
+ *                      If NULL, $HOME/pes/images
+ *                      is used. The directory is created if its parent
+ *                      exists. The string is only used while the handler
+ *                      is created.
+ * - allow_hardlink:    when not zero, images on the same filesystem as the
+ *                      image directory are imported by hard linking them
+ *                      instead of copying. The imported image shares its
+ *                      contents with the original file, so only enable this
+ *                      if original files are never modified after import.
+ * - scan_threads:      number of threads used to verify images found in the
+ *                      image directory when the handler is created. If 0,
+ *                      one thread per CPU core is used.
+ * - lazy_verification: when not zero, images named as import_image names
+ *                      them (<PN>_<size>.bin) are listed when the handler
+ *                      is created, but only verified when their path is
+ *                      requested or verify_pending_images is called.
+ * - import_threads:    number of threads running background imports. If 0,
+ *                      one thread per CPU core is used.
+ * - subset_cache_size: maximum memory, in bytes, used to keep compatibility
+ *                      documents already generated for a PN list, so they
+ *                      are returned again without being generated. The
+ *                      cache is emptied when a compatibility file is
+ *                      imported. If 0, nothing is cached.
+ * - compatibility_journal_size: size, in bytes, the compatibility journal
+ *                      may reach before it's compacted in the background.
+ *                      Compatibility changes are appended to the journal,
+ *                      the compatibility file is only written again when
+ *                      the journal is compacted. If 0, the journal is
+ *                      compacted after every change.
+ * - watch_directory:   when not zero, the image directory is watched with
+ *                      inotify while the handler exists. Images added to
+ *                      it by other means than import_image are verified
+ *                      and listed, images removed from it are dropped from
+ *                      the list, and the compatibility file is loaded
+ *                      again when it's replaced. Changes are handled by a
+ *                      thread of the handler, shortly after they are made.
+ */
+typedef struct
+{
+    const char *root_dir;
+    int allow_hardlink;
+    int scan_threads;
+    int lazy_verification;
+    int import_threads;
+    int subset_cache_size;
+    int compatibility_journal_size;
+    int watch_directory;
+} ImageHandlerConfig;
+
+/**
+ * Fill a handler configuration with default values.
+ *
+ * @param[out] config configuration to be initialized.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult init_handler_config(
+    ImageHandlerConfig *config);
+
+/**
+ * Create and initialize a new image handler with the given options. Every
+ * call creates a new handler, which must be destroyed with destroy_handler.
+ *
+ * @param[out] handler a handler for the image manager.
+ * @param[in] config handler options. If NULL, default values are used.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult create_handler_with_config(
+    ImageHandlerPtr *handler,
+    const ImageHandlerConfig *config);
+
 /**
  * Create and initialize a new image handler.
  *
@@ -29,7 +148,8 @@ ImageOperationResult create_handler(
     ImageHandlerPtr *handler);
 
 /**
- * Destroy a image handler.
+ * Destroy a image handler. Background imports still running are finished
+ * first.
  *
  * @param[in] handler a handler for the image manager.
  * @return COMMUNICATION_OPERATION_OK if success.
@@ -43,7 +163,9 @@ ImageOperationResult destroy_handler(
  *
  * @param[in] handler a handler for the image manager.
  * @param[in] path image path to be imported.
- * @param[out] part_number part number of the imported image.
+ * @param[out] part_number part number of the imported image. It's owned by
+ * the handler and valid until the handler is destroyed, "00000000" for a
+ * compatibility file.
  * @return IMAGE_OPERATION_OK if success.
  * @return IMAGE_OPERATION_ERROR otherwise.
  */
@@ -53,6 +175,101 @@ ImageOperationResult import_image (
     char** part_number
     );
 
+/**
+ * Import several images to local directory. Reading, checking and writing
+ * of different images overlap, and all compatibility files in the list are
+ * merged at once.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @param[in] paths paths of the images to be imported.
+ * @param[in] count number of paths.
+ * @param[out] results result of each import, in the same order as paths.
+ * @return IMAGE_OPERATION_OK if all images were imported.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult import_images(
+    ImageHandlerPtr handler,
+    const char **paths,
+    int count,
+    ImageImportResult *results);
+
+/**
+ * Import image to local directory in background.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @param[in] path image path to be imported.
+ * @param[in] callback function called when the import finishes. May be NULL.
+ * @param[in] user_data data passed to callback.
+ * @param[out] operation the import operation, must be released with
+ * release_import. May be NULL if the operation is not needed.
+ * @return IMAGE_OPERATION_OK if the import was started.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult import_image_async (
+    ImageHandlerPtr handler,
+    const char* path,
+    ImageImportCallback callback,
+    void *user_data,
+    ImageImportOperationPtr *operation
+    );
+
+/**
+ * Get the progress of a background import.
+ *
+ * @param[in] operation the import operation.
+ * @param[out] bytes_done bytes of the image already verified.
+ * @param[out] bytes_total size of the image.
+ * @param[out] done not zero if the import finished.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult get_import_progress (
+    ImageImportOperationPtr operation,
+    unsigned long long *bytes_done,
+    unsigned long long *bytes_total,
+    int *done
+    );
+
+/**
+ * Wait for a background import to finish.
+ *
+ * @param[in] operation the import operation.
+ * @param[out] result result of the import.
+ * @param[out] part_number part number of the imported image. Owned by the
+ * handler and valid until it's destroyed. May be NULL.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult wait_import (
+    ImageImportOperationPtr operation,
+    ImageOperationResult *result,
+    const char **part_number
+    );
+
+/**
+ * Cancel a background import. An import that is cancelled before it
+ * finishes results in IMAGE_OPERATION_CANCELLED and leaves no image behind.
+ *
+ * @param[in] operation the import operation.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult cancel_import (
+    ImageImportOperationPtr operation
+    );
+
+/**
+ * Release a background import operation. The import itself is not
+ * cancelled.
+ *
+ * @param[in] operation the import operation.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult release_import (
+    ImageImportOperationPtr *operation
+    );
+
 /**
  * Remove image from local directory.
  * 
@@ -67,11 +284,17 @@ ImageOperationResult remove_image (
     );
 
 /**
- * Get part number of all imported images.
+ * Get part number of all imported images. The list is kept by the handler
+ * and only built again when images were imported or removed since it was
+ * last returned, so calling it again while nothing changed is cheap.
  * 
  * @param[in] handler a handler for the image manager.
- * @param[out] part_numbers list of imported part numbers. Memory will be
- * allocated and must be freed by the caller.
+ * @param[out] part_numbers list of imported part numbers, NULL if there is
+ * none. It's owned by the handler and must not be changed or freed. The part
+ * numbers in it stay valid until the handler is destroyed. The list itself
+ * is replaced when get_images is called after the image list changed, and
+ * the one replaced is kept only until it's replaced again: it's freed once
+ * get_images returned two newer lists, or when the handler is destroyed.
  * @param[out] list_size number of entries in the list.
  * @return IMAGE_OPERATION_OK if success.
  * @return IMAGE_OPERATION_ERROR otherwise.
@@ -83,11 +306,28 @@ ImageOperationResult get_images (
     );
 
 /**
- * Get path of image with given part number.
+ * Get the generation of the image list. It changes every time an image is
+ * imported or removed, so the list only needs to be read again with
+ * get_images when the generation changed.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @param[out] generation current generation of the image list.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult get_images_generation (
+    ImageHandlerPtr handler,
+    unsigned long long *generation
+    );
+
+/**
+ * Get path of image with given part number. If the image was not verified
+ * yet, it is verified before its path is returned.
  * 
  * @param[in] handler a handler for the image manager.
  * @param[in] part_number part number of the image.
- * @param[out] path path of the image.
+ * @param[out] path path of the image. It's owned by the handler and valid
+ * until the image is removed or replaced, or the handler is destroyed.
  * @return IMAGE_OPERATION_OK if success.
  * @return IMAGE_OPERATION_ERROR otherwise.
  */
@@ -97,13 +337,29 @@ ImageOperationResult get_image_path (
     char** path
     );
 
+/**
+ * Verify all images that were listed but not verified yet, see
+ * lazy_verification in ImageHandlerConfig. Invalid images are removed from
+ * the image list.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult verify_pending_images (
+    ImageHandlerPtr handler
+    );
+
 /**
  * Get compatibility file path.
  * 
  * @param[in] handler a handler for the image manager.
  * @param[in] part_numbers list of part numbers to get compatibility file.
  * @param[in] list_size size of the list of part numbers.
- * @param[out] path path to the compatibility file.
+ * @param[out] path path to the compatibility file, in a hidden directory of
+ * the handler in the image directory. It's owned by the handler. Only the
+ * last 16 different files returned are kept: the path and the file are valid
+ * until 16 other files were returned after it, or the handler is destroyed.
  * @return IMAGE_OPERATION_OK if success.
  * @return IMAGE_OPERATION_ERROR otherwise.
  */
@@ -114,4 +370,76 @@ ImageOperationResult get_compatibility_path (
     char** path
     );
 
+/**
+ * Get compatibility file content, without writing it to disk.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @param[in] part_numbers list of part numbers to get compatibility file.
+ * @param[in] list_size size of the list of part numbers.
+ * @param[out] buffer compatibility file content, followed by a null
+ * character. Must be freed with free().
+ * @param[out] size size of the content, without the null character.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult get_compatibility_buffer (
+    ImageHandlerPtr handler,
+    char** part_numbers,
+    int list_size,
+    char** buffer,
+    size_t* size
+    );
+
+/**
+ * Write compatibility file content to a file descriptor.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @param[in] part_numbers list of part numbers to get compatibility file.
+ * @param[in] list_size size of the list of part numbers.
+ * @param[in] fd file descriptor the content is written to, at its current
+ * position.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult write_compatibility (
+    ImageHandlerPtr handler,
+    char** part_numbers,
+    int list_size,
+    int fd
+    );
+
+/**
+ * Get part number of the softwares compatible with an LRU, that is, with an
+ * LRU entry with the given name or part number in the compatibility file.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @param[in] lru LRU name or part number.
+ * @param[out] part_numbers list of software part numbers, in compatibility
+ * file order. The list and its part numbers are a single block of memory that
+ * must be freed with free(). NULL if the list is empty. Unlike the other
+ * strings returned, it's not kept by the handler: each LRU has its own list,
+ * and keeping every list asked for would grow the handler without limit.
+ * @param[out] list_size number of entries in the list.
+ * @return IMAGE_OPERATION_OK if success, even if no software is compatible.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult get_compatible_softwares (
+    ImageHandlerPtr handler,
+    const char* lru,
+    char** part_numbers[],
+    int *list_size
+    );
+
+/**
+ * Write the compatibility changes kept in the journal to the compatibility
+ * file, so the file in the image directory has every imported entry.
+ *
+ * @param[in] handler a handler for the image manager.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult compact_compatibility (
+    ImageHandlerPtr handler
+    );
+
 #endif // IIMAGE_MANAGER_H 
\ No newline at end of file
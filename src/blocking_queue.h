@@ -0,0 +1,49 @@
+#ifndef BLOCKING_QUEUE_H
+#define BLOCKING_QUEUE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+
+/**
+ * @brief A queue shared by threads. Readers wait until an item is available.
+ */
+template <typename T>
+class BlockingQueue
+{
+public:
+    /**
+     * Add an item to the end of the queue and wake up one waiting reader.
+     *
+     * @param[in] item item to be added.
+     */
+    void push(const T &item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push(item);
+        }
+        itemAvailable.notify_one();
+    }
+
+    /**
+     * Remove the first item of the queue, waiting for one if it's empty.
+     *
+     * @return the removed item.
+     */
+    T pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        itemAvailable.wait(lock, [this] { return !items.empty(); });
+        T item = items.front();
+        items.pop();
+        return item;
+    }
+
+private:
+    std::queue<T> items;
+    std::mutex mutex;
+    std::condition_variable itemAvailable;
+};
+
+#endif // BLOCKING_QUEUE_H
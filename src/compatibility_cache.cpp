@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <vector>
+
+#include "compatibility_cache.h"
+
+// Memory used by a cached document besides the key and the content
+#define CACHE_ENTRY_OVERHEAD 128
+
+CompatibilityCache::CompatibilityCache() : size(0), capacity(0)
+{
+}
+
+void CompatibilityCache::set_capacity(size_t newCapacity)
+{
+    capacity = newCapacity;
+    while (size > capacity && !entries.empty())
+    {
+        erase(--entries.end());
+    }
+}
+
+std::string CompatibilityCache::make_key(const char *const *partNumbers, int count)
+{
+    std::vector<std::string> sorted;
+    sorted.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        if (partNumbers[i] != NULL)
+        {
+            sorted.push_back(partNumbers[i]);
+        }
+    }
+
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    // Part numbers are C strings, so they can't have a null character
+    std::string key;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        key.append(sorted[i]);
+        key.push_back('\0');
+    }
+    return key;
+}
+
+std::shared_ptr<const std::string> CompatibilityCache::find(const std::string &key)
+{
+    std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it = index.find(key);
+    if (it == index.end())
+    {
+        return std::shared_ptr<const std::string>();
+    }
+
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+void CompatibilityCache::insert(const std::string &key, const std::shared_ptr<const std::string> &content)
+{
+    std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it = index.find(key);
+    if (it != index.end())
+    {
+        erase(it->second);
+    }
+
+    size_t entrySize = 2 * key.size() + content->size() + CACHE_ENTRY_OVERHEAD;
+    if (entrySize > capacity)
+    {
+        return;
+    }
+
+    while (size + entrySize > capacity && !entries.empty())
+    {
+        erase(--entries.end());
+    }
+
+    entries.push_front(Entry(key, content));
+    index[key] = entries.begin();
+    size += entrySize;
+}
+
+void CompatibilityCache::clear()
+{
+    entries.clear();
+    index.clear();
+    size = 0;
+}
+
+void CompatibilityCache::erase(std::list<Entry>::iterator it)
+{
+    size -= 2 * it->first.size() + it->second->size() + CACHE_ENTRY_OVERHEAD;
+    index.erase(it->first);
+    entries.erase(it);
+}
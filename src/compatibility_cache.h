@@ -0,0 +1,70 @@
+#ifndef COMPATIBILITY_CACHE_H
+#define COMPATIBILITY_CACHE_H
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * @brief Compatibility documents already generated, indexed by the set of
+ * part numbers they were generated for. The least recently used documents
+ * are dropped when the cache is full. Not thread safe.
+ */
+class CompatibilityCache
+{
+public:
+    CompatibilityCache();
+
+    /**
+     * Set the maximum size of the cache, dropping documents if needed.
+     *
+     * @param[in] capacity maximum size in bytes. If 0, nothing is cached.
+     */
+    void set_capacity(size_t capacity);
+
+    /**
+     * Build the cache key of a part number list. Lists with the same part
+     * numbers, in any order or repeated, have the same key.
+     *
+     * @param[in] partNumbers part numbers. NULL items are ignored.
+     * @param[in] count size of the part number list.
+     * @return the key.
+     */
+    static std::string make_key(const char *const *partNumbers, int count);
+
+    /**
+     * Find a document and mark it as the most recently used.
+     *
+     * @param[in] key key of the document.
+     * @return the document, or NULL if not found.
+     */
+    std::shared_ptr<const std::string> find(const std::string &key);
+
+    /**
+     * Add a document, replacing any document with the same key.
+     *
+     * @param[in] key key of the document.
+     * @param[in] content the document.
+     */
+    void insert(const std::string &key, const std::shared_ptr<const std::string> &content);
+
+    /**
+     * Drop all documents.
+     */
+    void clear();
+
+private:
+    typedef std::pair<std::string, std::shared_ptr<const std::string>> Entry;
+
+    void erase(std::list<Entry>::iterator it);
+
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t size;
+    size_t capacity;
+};
+
+#endif // COMPATIBILITY_CACHE_H
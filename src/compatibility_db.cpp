@@ -0,0 +1,826 @@
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+
+#include "compatibility_db.h"
+#include "compatibility_journal.h"
+#include "compatibility_reader.h"
+
+// Store built by a compaction, until the new compatibility file is installed
+#define COMPACTION_STORE_SUFFIX ".new"
+
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+// Occurrences of each part number in the files being read. Only the last
+// entry of a part number is kept, as if the entries were imported one by one.
+typedef std::unordered_map<std::string, uint32_t> PartNumberCount;
+
+static bool is_last_occurrence(PartNumberCount &counts, const std::string &partNumber)
+{
+    PartNumberCount::iterator it = counts.find(partNumber);
+    if (it == counts.end() || it->second == 0)
+    {
+        return false;
+    }
+    return --it->second == 0;
+}
+
+static void print_document_start(tinyxml2::XMLPrinter &printer, const char *declaration, const char *rootName)
+{
+    if (declaration[0] != '\0')
+    {
+        printer.PushDeclaration(declaration);
+    }
+    printer.OpenElement(rootName);
+}
+
+/**
+ * Open a hidden temporary file next to the compatibility file. It's synced
+ * by close_compatibility_file and then renamed, so the compatibility file is
+ * never left half written.
+ */
+static FILE *open_compatibility_file(const std::string &path, std::string &tmpPath)
+{
+    size_t slash = path.find_last_of('/');
+    tmpPath = path.substr(0, slash + 1) + std::string(".") + path.substr(slash + 1) + std::string("_XXXXXX");
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL)
+    {
+        close(fd);
+        unlink(tmpPath.c_str());
+    }
+    return fp;
+}
+
+static ImageOperationResult close_compatibility_file(FILE *fp, const std::string &tmpPath, bool error)
+{
+    error = error || fflush(fp) != 0 || ferror(fp) != 0 || fsync(fileno(fp)) != 0;
+    if (fclose(fp) != 0 || error)
+    {
+        unlink(tmpPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    return IMAGE_OPERATION_OK;
+}
+
+/**
+ * Copy a part of a file, from its current position.
+ */
+static bool copy_bytes(FILE *in, FILE *out, uint64_t count)
+{
+    char buffer[COPY_BUFFER_SIZE];
+    while (count > 0)
+    {
+        size_t size = (count < sizeof(buffer)) ? count : sizeof(buffer);
+        if (fread(buffer, 1, size, in) != size || fwrite(buffer, 1, size, out) != size)
+        {
+            return false;
+        }
+        count -= size;
+    }
+    return true;
+}
+
+/**
+ * Copy everything left in a file.
+ */
+static bool copy_rest(FILE *in, FILE *out)
+{
+    char buffer[COPY_BUFFER_SIZE];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        if (fwrite(buffer, 1, size, out) != size)
+        {
+            return false;
+        }
+    }
+    return ferror(in) == 0;
+}
+
+/**
+ * Write an entry added to a compatibility file on a line of its own, as it
+ * was in the file it was imported from.
+ */
+static bool write_software(FILE *out, const CompatibilitySoftware &software)
+{
+    return !software.xml.empty() &&
+           fputc('\n', out) != EOF &&
+           fwrite(software.xml.data(), 1, software.xml.size(), out) == software.xml.size();
+}
+
+/**
+ * Copy a compatibility file without the entries of some part numbers, and
+ * with new entries at the end of the root element. Everything else is
+ * copied as it is, so what the compatibility data does not define, like
+ * other attributes, elements and comments, is kept. The file is read twice,
+ * first to find the entries left out.
+ *
+ * @param[in] in compatibility file.
+ * @param[in] out new compatibility file.
+ * @param[in] changed part numbers of the entries left out.
+ * @param[in] append function writing the new entries with write_software.
+ * @return true if success.
+ */
+static bool copy_compatibility_file(
+    FILE *in,
+    FILE *out,
+    const std::unordered_set<std::string> &changed,
+    const std::function<bool()> &append)
+{
+    // Entries left out, with the whitespace before them
+    std::vector<std::pair<uint64_t, uint64_t>> skipped;
+    CompatibilityFileInfo info;
+    rewind(in);
+    if (read_compatibility_file(in, info, [&changed, &skipped](const CompatibilitySoftware &software) {
+            if (changed.count(software.partNumber) > 0)
+            {
+                skipped.push_back(std::make_pair(software.offset - software.spaceBefore, software.offset + software.xml.size()));
+            }
+        }) != IMAGE_OPERATION_OK)
+    {
+        return false;
+    }
+
+    rewind(in);
+    uint64_t position = 0;
+    for (size_t i = 0; i < skipped.size(); i++)
+    {
+        if (!copy_bytes(in, out, skipped[i].first - position) || fseeko(in, skipped[i].second, SEEK_SET) != 0)
+        {
+            return false;
+        }
+        position = skipped[i].second;
+    }
+
+    // New entries go before the whitespace before the end of the root
+    // element, an empty root element is written with an end tag
+    uint64_t end = info.rootSelfClosing ? info.rootEnd : info.rootEnd - info.rootEndSpace;
+    if (!copy_bytes(in, out, end - position))
+    {
+        return false;
+    }
+
+    if (info.rootSelfClosing)
+    {
+        return fputc('>', out) != EOF && append() && fprintf(out, "\n</%s>", info.rootName.c_str()) > 0 &&
+               fseeko(in, 2, SEEK_CUR) == 0 && copy_rest(in, out);
+    }
+    return append() && copy_rest(in, out);
+}
+
+static bool is_live(const CompatibilityDatabase &database, const std::string &partNumber)
+{
+    std::unordered_map<std::string, size_t>::const_iterator it = database.journalIndex.find(partNumber);
+    if (it != database.journalIndex.end())
+    {
+        return it->second != JOURNAL_REMOVED;
+    }
+
+    uint32_t index = 0;
+    return database.store.find(partNumber.c_str(), index);
+}
+
+/**
+ * Apply a change to the entries in memory. Like an import, an entry that is
+ * changed again is replaced by a new one at the end.
+ */
+static void apply_journal_record(
+    CompatibilityDatabase &database,
+    CompatibilityJournalOperation operation,
+    const CompatibilitySoftware &software)
+{
+    bool live = is_live(database, software.partNumber);
+
+    std::unordered_map<std::string, size_t>::iterator it = database.journalIndex.find(software.partNumber);
+    if (it != database.journalIndex.end() && it->second != JOURNAL_REMOVED)
+    {
+        // Replaced entries are never read again
+        database.journalSoftwares[it->second] = CompatibilitySoftware();
+    }
+
+    if (operation == JOURNAL_UPSERT)
+    {
+        size_t position = database.journalSoftwares.size();
+        for (size_t i = 0; i < software.lrus.size(); i++)
+        {
+            const CompatibilityLru &lru = software.lrus[i];
+            if (!lru.name.empty())
+            {
+                database.journalLruIndex[lru.name].push_back(position);
+            }
+            if (!lru.partNumber.empty() && lru.partNumber != lru.name)
+            {
+                database.journalLruIndex[lru.partNumber].push_back(position);
+            }
+        }
+
+        database.journalIndex[software.partNumber] = position;
+        database.journalSoftwares.push_back(software);
+        database.softwareCount += live ? 0 : 1;
+    }
+    else
+    {
+        database.journalIndex[software.partNumber] = JOURNAL_REMOVED;
+        database.softwareCount -= live ? 1 : 0;
+    }
+}
+
+/**
+ * Write the store of a compatibility file. The file is read twice, first to
+ * find repeated part numbers.
+ */
+static ImageOperationResult write_store(const std::string &xmlPath, const std::string &storePath, const struct stat &source)
+{
+    CompatibilityFileInfo info;
+    PartNumberCount counts;
+    if (read_compatibility_file(xmlPath, info, [&counts](const CompatibilitySoftware &software) {
+            counts[software.partNumber]++;
+        }) != IMAGE_OPERATION_OK ||
+        info.missingPartNumber)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    CompatibilityStoreBuilder builder;
+    if (read_compatibility_file(xmlPath, info, [&counts, &builder](const CompatibilitySoftware &software) {
+            if (is_last_occurrence(counts, software.partNumber))
+            {
+                builder.add(software);
+            }
+        }) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    return builder.write(storePath, info.declaration, info.rootName, source);
+}
+
+/**
+ * Build the store from the compatibility file.
+ */
+static ImageOperationResult build_store(CompatibilityDatabase &database, const struct stat &source)
+{
+    if (write_store(database.xmlPath, database.storePath, source) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    return database.store.open(database.storePath, database.xmlPath, source);
+}
+
+ImageOperationResult load_compatibility_database(
+    const std::string &xmlPath,
+    const std::string &storePath,
+    const std::string &journalPath,
+    CompatibilityDatabase &database)
+{
+    database.valid = false;
+    database.xmlPath = xmlPath;
+    database.storePath = storePath;
+    database.journalPath = journalPath;
+    database.store.close();
+    database.journalSoftwares.clear();
+    database.journalIndex.clear();
+    database.journalLruIndex.clear();
+    database.journalSize = 0;
+    database.softwareCount = 0;
+
+    struct stat st;
+    if (stat(xmlPath.c_str(), &st) != 0 || st.st_size == 0)
+    {
+        // No compatibility file imported yet
+        database.valid = true;
+        return IMAGE_OPERATION_OK;
+    }
+
+    // The store is built again if it's missing or out of date
+    if (database.store.open(storePath, xmlPath, st) != IMAGE_OPERATION_OK &&
+        build_store(database, st) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // Changes made since the compatibility file was written, or before it
+    // was replaced
+    database.source = st;
+    database.softwareCount = database.store.size();
+    read_compatibility_journal(journalPath, st, [&database](CompatibilityJournalOperation operation, const CompatibilitySoftware &software) {
+        apply_journal_record(database, operation, software);
+    }, database.journalSize);
+
+    database.valid = true;
+    return IMAGE_OPERATION_OK;
+}
+
+static ImageOperationResult reload_compatibility_database(CompatibilityDatabase &database)
+{
+    std::string xmlPath = database.xmlPath;
+    std::string storePath = database.storePath;
+    std::string journalPath = database.journalPath;
+    return load_compatibility_database(xmlPath, storePath, journalPath, database);
+}
+
+bool compatibility_file_changed(const CompatibilityDatabase &database)
+{
+    struct stat st;
+    bool exists = (stat(database.xmlPath.c_str(), &st) == 0 && st.st_size > 0);
+    if (!database.valid || database.store.root_name()[0] == '\0')
+    {
+        return !database.valid || exists;
+    }
+
+    return !exists ||
+           st.st_size != database.source.st_size ||
+           st.st_mtim.tv_sec != database.source.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != database.source.st_mtim.tv_nsec ||
+           st.st_ino != database.source.st_ino;
+}
+
+ImageOperationResult refresh_compatibility_database(CompatibilityDatabase &database)
+{
+    if (compatibility_file_changed(database) || database.store.root_name()[0] == '\0')
+    {
+        return reload_compatibility_database(database);
+    }
+
+    // Same compatibility file, only the journal changed
+    database.journalSoftwares.clear();
+    database.journalIndex.clear();
+    database.journalLruIndex.clear();
+    database.softwareCount = database.store.size();
+    read_compatibility_journal(database.journalPath, database.source, [&database](CompatibilityJournalOperation operation, const CompatibilitySoftware &software) {
+        apply_journal_record(database, operation, software);
+    }, database.journalSize);
+    return IMAGE_OPERATION_OK;
+}
+
+/**
+ * Write the first compatibility file: a copy of the first file being
+ * imported, with the entries of the other ones.
+ */
+static ImageOperationResult write_first_compatibility_file(
+    const CompatibilityDatabase &database,
+    const std::vector<std::string> &paths,
+    const std::vector<ImageOperationResult> &results,
+    PartNumberCount &updates)
+{
+    size_t first = 0;
+    while (results[first] != IMAGE_OPERATION_OK)
+    {
+        first++;
+    }
+
+    FILE *in = fopen(paths[first].c_str(), "rb");
+    if (in == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    std::string tmpPath;
+    FILE *fp = open_compatibility_file(database.xmlPath, tmpPath);
+    if (fp == NULL)
+    {
+        fclose(in);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    std::unordered_set<std::string> changed;
+    for (PartNumberCount::const_iterator it = updates.begin(); it != updates.end(); ++it)
+    {
+        changed.insert(it->first);
+    }
+
+    bool error = !copy_compatibility_file(in, fp, changed, [&]() {
+        bool written = true;
+        for (size_t i = first + 1; i < paths.size() && written; i++)
+        {
+            if (results[i] != IMAGE_OPERATION_OK)
+            {
+                continue;
+            }
+
+            CompatibilityFileInfo info;
+            written = read_compatibility_file(paths[i], info, [&updates, &written, fp](const CompatibilitySoftware &update) {
+                          if (written && is_last_occurrence(updates, update.partNumber))
+                          {
+                              written = write_software(fp, update);
+                          }
+                      }) == IMAGE_OPERATION_OK &&
+                      written;
+        }
+        return written;
+    });
+    fclose(in);
+
+    if (close_compatibility_file(fp, tmpPath, error) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (rename(tmpPath.c_str(), database.xmlPath.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // If the store can't be written, it's built again from the
+    // compatibility file when the database is loaded
+    struct stat st;
+    if (stat(database.xmlPath.c_str(), &st) == 0)
+    {
+        write_store(database.xmlPath, database.storePath, st);
+    }
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult write_compatibility_merge(
+    const CompatibilityDatabase &database,
+    const std::vector<std::string> &paths,
+    std::vector<ImageOperationResult> &results,
+    CompatibilityMerge &merge)
+{
+    results.assign(paths.size(), IMAGE_OPERATION_ERROR);
+    merge.rewritten = false;
+    merge.softwares.clear();
+    merge.journalSize = database.journalSize;
+
+    // Check every file before changing anything. Only the part numbers of
+    // the entries imported after the first file are kept, the first file is
+    // copied if there is no compatibility file yet.
+    PartNumberCount updates;
+    bool imported = false;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        CompatibilityFileInfo info;
+        std::vector<std::string> partNumbers;
+        if (read_compatibility_file(paths[i], info, [&partNumbers](const CompatibilitySoftware &software) {
+                partNumbers.push_back(software.partNumber);
+            }) != IMAGE_OPERATION_OK ||
+            info.missingPartNumber || info.softwareCount == 0)
+        {
+            continue;
+        }
+
+        for (size_t j = 0; j < partNumbers.size() && imported; j++)
+        {
+            updates[partNumbers[j]]++;
+        }
+
+        imported = true;
+        results[i] = IMAGE_OPERATION_OK;
+    }
+
+    if (!imported)
+    {
+        return IMAGE_OPERATION_OK;
+    }
+
+    ImageOperationResult result = IMAGE_OPERATION_ERROR;
+    if (database.valid && database.store.root_name()[0] == '\0')
+    {
+        result = write_first_compatibility_file(database, paths, results, updates);
+        merge.rewritten = (result == IMAGE_OPERATION_OK);
+    }
+    else if (database.valid)
+    {
+        // The entries are only appended to the journal, and kept to be
+        // applied to the database
+        CompatibilityJournalWriter journal;
+        bool error = (journal.open(database.journalPath, database.journalSize, database.source) != IMAGE_OPERATION_OK);
+        for (size_t i = 0; i < paths.size() && !error; i++)
+        {
+            if (results[i] != IMAGE_OPERATION_OK)
+            {
+                continue;
+            }
+
+            CompatibilityFileInfo info;
+            error = read_compatibility_file(paths[i], info, [&merge, &journal](const CompatibilitySoftware &update) {
+                        journal.append(JOURNAL_UPSERT, update);
+                        merge.softwares.push_back(update);
+                    }) != IMAGE_OPERATION_OK;
+        }
+
+        result = error ? IMAGE_OPERATION_ERROR : journal.commit(merge.journalSize);
+        if (result != IMAGE_OPERATION_OK)
+        {
+            journal.rollback();
+            merge.softwares.clear();
+            merge.journalSize = database.journalSize;
+        }
+    }
+
+    if (result != IMAGE_OPERATION_OK)
+    {
+        results.assign(paths.size(), IMAGE_OPERATION_ERROR);
+    }
+    return result;
+}
+
+ImageOperationResult apply_compatibility_merge(
+    CompatibilityDatabase &database,
+    const CompatibilityMerge &merge)
+{
+    // A new compatibility file has its store, and a new journal
+    if (merge.rewritten)
+    {
+        return reload_compatibility_database(database);
+    }
+
+    for (size_t i = 0; i < merge.softwares.size(); i++)
+    {
+        apply_journal_record(database, JOURNAL_UPSERT, merge.softwares[i]);
+    }
+    database.journalSize = merge.journalSize;
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult remove_compatibility_software(
+    CompatibilityDatabase &database,
+    const std::string &partNumber)
+{
+    if (!database.valid)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (!is_live(database, partNumber))
+    {
+        return IMAGE_OPERATION_OK;
+    }
+
+    CompatibilitySoftware software;
+    software.partNumber = partNumber;
+
+    CompatibilityJournalWriter journal;
+    if (journal.open(database.journalPath, database.journalSize, database.source) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    journal.append(JOURNAL_REMOVE, software);
+    if (journal.commit(database.journalSize) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    apply_journal_record(database, JOURNAL_REMOVE, software);
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult start_compatibility_compaction(
+    const CompatibilityDatabase &database,
+    CompatibilityCompaction &compaction)
+{
+    if (!database.valid || database.journalIndex.empty())
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // The compatibility file is copied from the version the database has,
+    // even if it's replaced while the compaction is written
+    compaction.xmlFile = fopen(database.xmlPath.c_str(), "rb");
+    struct stat st;
+    if (compaction.xmlFile == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+    if (fstat(fileno(compaction.xmlFile), &st) != 0 ||
+        st.st_ino != database.source.st_ino ||
+        st.st_size != database.source.st_size ||
+        st.st_mtim.tv_sec != database.source.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != database.source.st_mtim.tv_nsec)
+    {
+        fclose(compaction.xmlFile);
+        compaction.xmlFile = NULL;
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    compaction.xmlPath = database.xmlPath;
+    compaction.storePath = database.storePath;
+    compaction.journalEnd = database.journalSize;
+
+    compaction.changed.clear();
+    std::unordered_map<std::string, size_t>::const_iterator it;
+    for (it = database.journalIndex.begin(); it != database.journalIndex.end(); ++it)
+    {
+        compaction.changed.insert(it->first);
+    }
+
+    compaction.softwares.clear();
+    for (size_t i = 0; i < database.journalSoftwares.size(); i++)
+    {
+        it = database.journalIndex.find(database.journalSoftwares[i].partNumber);
+        if (it != database.journalIndex.end() && it->second == i)
+        {
+            compaction.softwares.push_back(database.journalSoftwares[i]);
+        }
+    }
+
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult write_compatibility_compaction(CompatibilityCompaction &compaction)
+{
+    FILE *fp = open_compatibility_file(compaction.xmlPath, compaction.xmlTmpPath);
+    if (fp == NULL)
+    {
+        fclose(compaction.xmlFile);
+        compaction.xmlFile = NULL;
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // Entries not changed are copied as they are, changed ones go to the end
+    bool error = !copy_compatibility_file(compaction.xmlFile, fp, compaction.changed, [&compaction, fp]() {
+        for (size_t i = 0; i < compaction.softwares.size(); i++)
+        {
+            if (!write_software(fp, compaction.softwares[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+    fclose(compaction.xmlFile);
+    compaction.xmlFile = NULL;
+
+    if (close_compatibility_file(fp, compaction.xmlTmpPath, error) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // Renaming the file keeps its status, so the store is built for the
+    // file it will become
+    std::string newStorePath = compaction.storePath + std::string(COMPACTION_STORE_SUFFIX);
+    if (stat(compaction.xmlTmpPath.c_str(), &compaction.source) != 0 ||
+        write_store(compaction.xmlTmpPath, newStorePath, compaction.source) != IMAGE_OPERATION_OK)
+    {
+        unlink(compaction.xmlTmpPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult finish_compatibility_compaction(
+    CompatibilityDatabase &database,
+    CompatibilityCompaction &compaction)
+{
+    std::string newStorePath = compaction.storePath + std::string(COMPACTION_STORE_SUFFIX);
+
+    // Changes recorded while the file was written are kept in the new journal
+    if (copy_compatibility_journal(database.journalPath, compaction.journalEnd, database.journalSize, compaction.source) != IMAGE_OPERATION_OK)
+    {
+        unlink(compaction.xmlTmpPath.c_str());
+        unlink(newStorePath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (rename(compaction.xmlTmpPath.c_str(), compaction.xmlPath.c_str()) != 0)
+    {
+        discard_compatibility_journal(database.journalPath);
+        unlink(compaction.xmlTmpPath.c_str());
+        unlink(newStorePath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // If the process stops here, the new journal is installed and the store
+    // built again when the database is loaded
+    install_compatibility_journal(database.journalPath);
+    rename(newStorePath.c_str(), compaction.storePath.c_str());
+    return reload_compatibility_database(database);
+}
+
+void select_compatibility_softwares(
+    const CompatibilityDatabase &database,
+    const char *const *partNumbers,
+    int count,
+    std::vector<uint32_t> &softwares)
+{
+    softwares.clear();
+    for (int i = 0; i < count; i++)
+    {
+        if (partNumbers[i] == NULL)
+        {
+            continue;
+        }
+
+        // Entries changed since the store was built come after it
+        uint32_t index = 0;
+        std::unordered_map<std::string, size_t>::const_iterator it = database.journalIndex.find(partNumbers[i]);
+        if (it != database.journalIndex.end())
+        {
+            if (it->second != JOURNAL_REMOVED)
+            {
+                softwares.push_back(database.store.size() + it->second);
+            }
+        }
+        else if (database.store.find(partNumbers[i], index))
+        {
+            softwares.push_back(index);
+        }
+    }
+
+    // Back to file order, without repeated part numbers
+    std::sort(softwares.begin(), softwares.end());
+    softwares.erase(std::unique(softwares.begin(), softwares.end()), softwares.end());
+}
+
+void select_compatible_softwares(
+    const CompatibilityDatabase &database,
+    const char *lru,
+    std::vector<uint32_t> &softwares)
+{
+    softwares.clear();
+    const CompatibilityStore &store = database.store;
+
+    // Store entries changed since it was built are found in the changes
+    std::vector<uint32_t> indexes;
+    store.find_lru(lru, indexes);
+    for (size_t i = 0; i < indexes.size(); i++)
+    {
+        if (database.journalIndex.empty() ||
+            database.journalIndex.find(store.part_number(indexes[i])) == database.journalIndex.end())
+        {
+            softwares.push_back(indexes[i]);
+        }
+    }
+
+    std::unordered_map<std::string, std::vector<size_t>>::const_iterator it = database.journalLruIndex.find(lru);
+    if (it != database.journalLruIndex.end())
+    {
+        for (size_t i = 0; i < it->second.size(); i++)
+        {
+            // Entries changed again are no longer the last entry of their part number
+            size_t position = it->second[i];
+            std::unordered_map<std::string, size_t>::const_iterator last =
+                database.journalIndex.find(database.journalSoftwares[position].partNumber);
+            if (last != database.journalIndex.end() && last->second == position)
+            {
+                softwares.push_back(store.size() + position);
+            }
+        }
+    }
+
+    // An entry with the LRU more than once is found more than once
+    std::sort(softwares.begin(), softwares.end());
+    softwares.erase(std::unique(softwares.begin(), softwares.end()), softwares.end());
+}
+
+const char *compatibility_part_number(const CompatibilityDatabase &database, uint32_t software)
+{
+    const CompatibilityStore &store = database.store;
+    if (software < store.size())
+    {
+        return store.part_number(software);
+    }
+
+    software -= store.size();
+    return (software < database.journalSoftwares.size()) ? database.journalSoftwares[software].partNumber.c_str() : "";
+}
+
+ImageOperationResult print_compatibility_subset(
+    const CompatibilityDatabase &database,
+    const std::vector<uint32_t> &softwares,
+    tinyxml2::XMLPrinter &printer)
+{
+    const CompatibilityStore &store = database.store;
+    print_document_start(printer, store.declaration(), store.root_name());
+
+    // Each element is parsed again to be printed with everything it has
+    std::string xml;
+    for (size_t i = 0; i < softwares.size(); i++)
+    {
+        if (softwares[i] >= store.size())
+        {
+            xml = database.journalSoftwares[softwares[i] - store.size()].xml;
+        }
+        else if (!store.software_xml(softwares[i], xml))
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        tinyxml2::XMLDocument document;
+        if (document.Parse(xml.data(), xml.size()) != tinyxml2::XML_SUCCESS || document.RootElement() == NULL)
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+        document.RootElement()->Accept(&printer);
+    }
+    printer.CloseElement();
+    return IMAGE_OPERATION_OK;
+}
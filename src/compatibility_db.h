@@ -0,0 +1,276 @@
+#ifndef COMPATIBILITY_DB_H
+#define COMPATIBILITY_DB_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "iimagemanager.h"
+#include "compatibility_store.h"
+#include "tinyxml2.h"
+
+// Position in CompatibilityDatabase::journalIndex of a removed part number
+#define JOURNAL_REMOVED SIZE_MAX
+
+/**
+ * @brief Compatibility data of the image directory. The compatibility file
+ * is only streamed to build the store and written to export the data, all
+ * queries are answered by the store and the changes made after it was built.
+ * Changes are appended to a journal and applied in memory, the compatibility
+ * file is only written again when the journal is compacted.
+ * Entries are looked up by the part number of each SOFTWARE and the name
+ * and part number of its LRUs. The elements themselves are copied as they
+ * were imported, so anything else they have is kept.
+ */
+struct CompatibilityDatabase
+{
+    bool valid = false;
+    std::string xmlPath;
+    std::string storePath;
+    std::string journalPath;
+    CompatibilityStore store;
+
+    // File status of the compatibility file the store and journal are for
+    struct stat source;
+
+    // Entries changed since the compatibility file was written, in the order
+    // they were changed. journalIndex has the last entry of each part number
+    // changed, or JOURNAL_REMOVED. Entries changed again are cleared.
+    // journalLruIndex has the entries with an LRU that has each LRU name and
+    // part number, including entries changed again.
+    std::vector<CompatibilitySoftware> journalSoftwares;
+    std::unordered_map<std::string, size_t> journalIndex;
+    std::unordered_map<std::string, std::vector<size_t>> journalLruIndex;
+    uint64_t journalSize = 0;
+
+    // Number of entries, with the changes applied
+    uint32_t softwareCount = 0;
+};
+
+/**
+ * @brief Changes written by a merge, see write_compatibility_merge.
+ * Either a new compatibility file was written, or the entries were appended
+ * to the journal.
+ */
+struct CompatibilityMerge
+{
+    bool rewritten = false;
+    std::vector<CompatibilitySoftware> softwares;
+    uint64_t journalSize = 0;
+};
+
+/**
+ * @brief Compaction of the journal into the compatibility file, see
+ * start_compatibility_compaction.
+ */
+struct CompatibilityCompaction
+{
+    FILE *xmlFile = NULL;
+    std::unordered_set<std::string> changed;
+    std::vector<CompatibilitySoftware> softwares;
+    uint64_t journalEnd = 0;
+
+    std::string xmlPath;
+    std::string storePath;
+    std::string xmlTmpPath;
+    struct stat source;
+};
+
+/**
+ * Load the database of a compatibility file. The store is built again if
+ * it's missing or the compatibility file changed since it was built, and the
+ * changes in the journal are applied. The changes of a journal written for
+ * another version of the compatibility file are applied too, and the journal
+ * is written again for this version. A missing compatibility file results in
+ * an empty database.
+ *
+ * @param[in] xmlPath compatibility file path.
+ * @param[in] storePath store path.
+ * @param[in] journalPath journal path.
+ * @param[out] database loaded database. It's not valid on error.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult load_compatibility_database(
+    const std::string &xmlPath,
+    const std::string &storePath,
+    const std::string &journalPath,
+    CompatibilityDatabase &database);
+
+/**
+ * Check if the compatibility file of a database was replaced, changed or
+ * removed since the database was loaded.
+ *
+ * @param[in] database database to check.
+ * @return true if the database must be loaded again.
+ */
+bool compatibility_file_changed(const CompatibilityDatabase &database);
+
+/**
+ * Load a database again after another process changed it. If the
+ * compatibility file is the same, the store is kept and only the journal is
+ * read again, so a compaction being written can go on.
+ *
+ * @param[in,out] database database to be loaded again.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult refresh_compatibility_database(CompatibilityDatabase &database);
+
+/**
+ * Write compatibility files merged into a database, without changing the
+ * database. An entry with the same part number as an existing one replaces
+ * it and is moved to the end. Files are streamed, read once to be checked
+ * and once more while their entries are appended to the journal. If there is
+ * no compatibility file yet, it's a copy of the first file instead, with the
+ * entries of the other ones. A file is
+ * rejected if it's not well formed, has no SOFTWARE entry or has an entry
+ * without part number.
+ * The database can be read while the merge is written, but must not be
+ * changed until apply_compatibility_merge is called.
+ *
+ * @param[in] database database the files are merged into.
+ * @param[in] paths compatibility files to be merged.
+ * @param[out] results result of each file.
+ * @param[out] merge changes to be applied to the database.
+ * @return IMAGE_OPERATION_OK if success, even if some files were rejected.
+ * @return IMAGE_OPERATION_ERROR if the changes could not be written. Nothing
+ * is changed.
+ */
+ImageOperationResult write_compatibility_merge(
+    const CompatibilityDatabase &database,
+    const std::vector<std::string> &paths,
+    std::vector<ImageOperationResult> &results,
+    CompatibilityMerge &merge);
+
+/**
+ * Apply the changes written by write_compatibility_merge to a database.
+ *
+ * @param[in,out] database database to be updated.
+ * @param[in] merge changes written.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR if the database could not be loaded again
+ * after a new compatibility file was written.
+ */
+ImageOperationResult apply_compatibility_merge(
+    CompatibilityDatabase &database,
+    const CompatibilityMerge &merge);
+
+/**
+ * Remove the entry of a part number from a database. The removal is
+ * appended to the journal.
+ *
+ * @param[in,out] database database to be updated.
+ * @param[in] partNumber software part number.
+ * @return IMAGE_OPERATION_OK if success, or if there is no such entry.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult remove_compatibility_software(
+    CompatibilityDatabase &database,
+    const std::string &partNumber);
+
+/**
+ * Start compacting the journal of a database. Only the changes are copied,
+ * the compatibility file is kept open and copied without the entries
+ * changed, with everything else it has.
+ * The three steps let the database be used while the new compatibility file
+ * is written: start and finish must be called with the database locked,
+ * write_compatibility_compaction does not use the database.
+ *
+ * @param[in] database database to be compacted.
+ * @param[out] compaction compaction state.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR if there is nothing to compact.
+ */
+ImageOperationResult start_compatibility_compaction(
+    const CompatibilityDatabase &database,
+    CompatibilityCompaction &compaction);
+
+/**
+ * Write the new compatibility file and its store, without installing them.
+ * The compatibility file opened by start_compatibility_compaction is closed.
+ *
+ * @param[in,out] compaction compaction state.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult write_compatibility_compaction(CompatibilityCompaction &compaction);
+
+/**
+ * Install the new compatibility file and its store. Changes recorded since
+ * the compaction started are kept in a new journal.
+ *
+ * @param[in,out] database database being compacted.
+ * @param[in] compaction compaction state.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise. If the new compatibility file
+ * could not be installed, the database is not changed.
+ */
+ImageOperationResult finish_compatibility_compaction(
+    CompatibilityDatabase &database,
+    CompatibilityCompaction &compaction);
+
+/**
+ * Select the entries matching a part number list, in file order. Each part
+ * number is looked up in the store, so the cost does not depend on the size
+ * of the compatibility file.
+ *
+ * @param[in] database database to search.
+ * @param[in] partNumbers part numbers to be selected. NULL items are ignored.
+ * @param[in] count size of the part number list.
+ * @param[out] softwares positions of the selected entries. Entries changed
+ * since the store was built come after the store entries.
+ */
+void select_compatibility_softwares(
+    const CompatibilityDatabase &database,
+    const char *const *partNumbers,
+    int count,
+    std::vector<uint32_t> &softwares);
+
+/**
+ * Select the entries compatible with an LRU, in file order. The LRU is
+ * looked up in the reverse index of the store and in the changes, so the
+ * cost depends on the number of entries found.
+ *
+ * @param[in] database database to search.
+ * @param[in] lru LRU name or part number.
+ * @param[out] softwares positions of the selected entries, see
+ * select_compatibility_softwares.
+ */
+void select_compatible_softwares(
+    const CompatibilityDatabase &database,
+    const char *lru,
+    std::vector<uint32_t> &softwares);
+
+/**
+ * Get the part number of an entry.
+ *
+ * @param[in] database database the entry belongs to.
+ * @param[in] software position of the entry, see select_compatibility_softwares.
+ * @return software part number.
+ */
+const char *compatibility_part_number(const CompatibilityDatabase &database, uint32_t software);
+
+/**
+ * Print a compatibility document with some entries of a database, formatted
+ * as tinyxml2 saves documents. The elements are read from the compatibility
+ * file or the journal, with everything they have.
+ *
+ * @param[in] database database the entries belong to.
+ * @param[in] softwares positions of the entries, see
+ * select_compatibility_softwares, in output order.
+ * @param[in,out] printer printer the document is written to.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR if an element could not be read.
+ */
+ImageOperationResult print_compatibility_subset(
+    const CompatibilityDatabase &database,
+    const std::vector<uint32_t> &softwares,
+    tinyxml2::XMLPrinter &printer);
+
+#endif // COMPATIBILITY_DB_H
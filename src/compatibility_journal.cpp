@@ -0,0 +1,415 @@
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "compatibility_journal.h"
+#include "gcrypt.h"
+
+#define JOURNAL_MAGIC "PESCJRNL"
+#define JOURNAL_VERSION 2
+
+// Written in native byte order, so a journal from another machine is dropped
+#define JOURNAL_BYTE_ORDER 0x01020304
+
+// Larger records are taken as damaged
+#define MAX_RECORD_SIZE (16 * 1024 * 1024)
+
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+/**
+ * @brief Journal file header.
+ */
+struct JournalHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+
+    // Compatibility file the changes are applied to
+    uint64_t sourceSize;
+    int64_t sourceMtimeSec;
+    int64_t sourceMtimeNsec;
+    uint64_t sourceInode;
+};
+
+/**
+ * @brief Header of each record. The payload has the part number, followed by
+ * the number of LRUs, their name and part number and the SOFTWARE element
+ * as it was imported for JOURNAL_UPSERT.
+ * Strings are stored as their size followed by their characters.
+ */
+struct JournalRecordHeader
+{
+    uint32_t operation;
+    uint32_t size;
+    uint32_t checksum;
+};
+
+static void fill_header(JournalHeader &header, const struct stat &source)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.byteOrder = JOURNAL_BYTE_ORDER;
+    header.sourceSize = source.st_size;
+    header.sourceMtimeSec = source.st_mtim.tv_sec;
+    header.sourceMtimeNsec = source.st_mtim.tv_nsec;
+    header.sourceInode = source.st_ino;
+}
+
+/**
+ * Check if a file is a journal for a version of the compatibility file, or
+ * for any version if source is NULL.
+ */
+static bool journal_matches(const std::string &path, const struct stat *source)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+    {
+        return false;
+    }
+
+    JournalHeader header;
+    JournalHeader expected;
+    struct stat any;
+    memset(&any, 0, sizeof(any));
+    fill_header(expected, (source != NULL) ? *source : any);
+    size_t compared = (source != NULL) ? sizeof(header) : offsetof(JournalHeader, sourceSize);
+    bool matches = (fread(&header, sizeof(header), 1, fp) == 1 && memcmp(&header, &expected, compared) == 0);
+    fclose(fp);
+    return matches;
+}
+
+static uint32_t record_checksum(const std::string &payload)
+{
+    unsigned char digest[4];
+    gcry_md_hash_buffer(GCRY_MD_CRC32, digest, payload.data(), payload.size());
+
+    uint32_t checksum;
+    memcpy(&checksum, digest, sizeof(checksum));
+    return checksum;
+}
+
+static void put_uint32(std::string &payload, uint32_t value)
+{
+    payload.append((const char *)&value, sizeof(value));
+}
+
+static void put_string(std::string &payload, const std::string &value)
+{
+    put_uint32(payload, value.size());
+    payload.append(value);
+}
+
+static bool get_uint32(const std::string &payload, size_t &offset, uint32_t &value)
+{
+    if (payload.size() - offset < sizeof(value))
+    {
+        return false;
+    }
+
+    memcpy(&value, payload.data() + offset, sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+static bool get_string(const std::string &payload, size_t &offset, std::string &value)
+{
+    uint32_t size = 0;
+    if (!get_uint32(payload, offset, size) || payload.size() - offset < size)
+    {
+        return false;
+    }
+
+    value.assign(payload, offset, size);
+    offset += size;
+    return true;
+}
+
+static bool decode_record(uint32_t operation, const std::string &payload, CompatibilitySoftware &software)
+{
+    size_t offset = 0;
+    software.lrus.clear();
+    if (!get_string(payload, offset, software.partNumber))
+    {
+        return false;
+    }
+
+    if (operation == JOURNAL_UPSERT)
+    {
+        uint32_t lruCount = 0;
+        if (!get_uint32(payload, offset, lruCount) || lruCount > (payload.size() - offset) / (2 * sizeof(uint32_t)))
+        {
+            return false;
+        }
+
+        software.lrus.resize(lruCount);
+        for (uint32_t i = 0; i < lruCount; i++)
+        {
+            if (!get_string(payload, offset, software.lrus[i].name) ||
+                !get_string(payload, offset, software.lrus[i].partNumber))
+            {
+                return false;
+            }
+        }
+
+        if (!get_string(payload, offset, software.xml))
+        {
+            return false;
+        }
+    }
+
+    return offset == payload.size();
+}
+
+static ImageOperationResult read_journal_file(
+    const std::string &path,
+    const CompatibilityJournalCallback &callback,
+    uint64_t &size)
+{
+    size = 0;
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL || fseek(fp, sizeof(JournalHeader), SEEK_SET) != 0)
+    {
+        if (fp != NULL)
+        {
+            fclose(fp);
+        }
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    uint64_t end = sizeof(JournalHeader);
+    JournalRecordHeader recordHeader;
+    std::string payload;
+    CompatibilitySoftware software;
+    while (fread(&recordHeader, sizeof(recordHeader), 1, fp) == 1)
+    {
+        if ((recordHeader.operation != JOURNAL_UPSERT && recordHeader.operation != JOURNAL_REMOVE) ||
+            recordHeader.size > MAX_RECORD_SIZE)
+        {
+            break;
+        }
+
+        payload.resize(recordHeader.size);
+        if ((recordHeader.size > 0 && fread(&payload[0], 1, recordHeader.size, fp) != recordHeader.size) ||
+            record_checksum(payload) != recordHeader.checksum ||
+            !decode_record(recordHeader.operation, payload, software))
+        {
+            break;
+        }
+
+        callback((CompatibilityJournalOperation)recordHeader.operation, software);
+        end += sizeof(recordHeader) + recordHeader.size;
+    }
+
+    fclose(fp);
+    size = end;
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult read_compatibility_journal(
+    const std::string &path,
+    const struct stat &source,
+    const CompatibilityJournalCallback &callback,
+    uint64_t &size)
+{
+    // A compaction may have stopped after replacing the compatibility file
+    // but before replacing the journal
+    std::string tmpPath = path + std::string(".tmp");
+    if (!journal_matches(path, &source) && journal_matches(tmpPath, &source))
+    {
+        rename(tmpPath.c_str(), path.c_str());
+    }
+    unlink(tmpPath.c_str());
+
+    if (journal_matches(path, &source))
+    {
+        return read_journal_file(path, callback, size);
+    }
+
+    // The changes of a journal for another version of the compatibility
+    // file, such as imports made before it was replaced, are applied to this
+    // version too, and the journal is written again for it
+    size = 0;
+    uint64_t end = 0;
+    if (!journal_matches(path, NULL) || read_journal_file(path, callback, end) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (copy_compatibility_journal(path, sizeof(JournalHeader), end, source) != IMAGE_OPERATION_OK ||
+        install_compatibility_journal(path) != IMAGE_OPERATION_OK)
+    {
+        discard_compatibility_journal(path);
+    }
+
+    size = end;
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult copy_compatibility_journal(
+    const std::string &path,
+    uint64_t offset,
+    uint64_t end,
+    const struct stat &source)
+{
+    std::string tmpPath = path + std::string(".tmp");
+    FILE *out = fopen(tmpPath.c_str(), "wb");
+    if (out == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    JournalHeader header;
+    fill_header(header, source);
+    bool error = (fwrite(&header, sizeof(header), 1, out) != 1);
+
+    if (!error && end > offset)
+    {
+        FILE *in = fopen(path.c_str(), "rb");
+        error = (in == NULL || fseek(in, offset, SEEK_SET) != 0);
+
+        std::vector<char> buffer(COPY_BUFFER_SIZE);
+        uint64_t remaining = end - offset;
+        while (!error && remaining > 0)
+        {
+            size_t count = (remaining < buffer.size()) ? remaining : buffer.size();
+            error = (fread(&buffer[0], 1, count, in) != count || fwrite(&buffer[0], 1, count, out) != count);
+            remaining -= count;
+        }
+
+        if (in != NULL)
+        {
+            fclose(in);
+        }
+    }
+
+    error = error || fflush(out) != 0 || ferror(out) != 0 || fsync(fileno(out)) != 0;
+    if (fclose(out) != 0 || error)
+    {
+        unlink(tmpPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult install_compatibility_journal(const std::string &path)
+{
+    std::string tmpPath = path + std::string(".tmp");
+    return (rename(tmpPath.c_str(), path.c_str()) == 0) ? IMAGE_OPERATION_OK : IMAGE_OPERATION_ERROR;
+}
+
+void discard_compatibility_journal(const std::string &path)
+{
+    std::string tmpPath = path + std::string(".tmp");
+    unlink(tmpPath.c_str());
+}
+
+CompatibilityJournalWriter::CompatibilityJournalWriter() : fp(NULL), startSize(0), size(0)
+{
+}
+
+CompatibilityJournalWriter::~CompatibilityJournalWriter()
+{
+    rollback();
+}
+
+ImageOperationResult CompatibilityJournalWriter::open(const std::string &journalPath, uint64_t journalSize, const struct stat &source)
+{
+    rollback();
+    path = journalPath;
+
+    if (journalSize == 0)
+    {
+        JournalHeader header;
+        fill_header(header, source);
+        fp = fopen(path.c_str(), "wb");
+        if (fp == NULL)
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        startSize = 0;
+        size = sizeof(header);
+        fwrite(&header, sizeof(header), 1, fp);
+        return IMAGE_OPERATION_OK;
+    }
+
+    // Anything after the valid part was left by an interrupted append
+    fp = fopen(path.c_str(), "r+b");
+    if (fp == NULL || ftruncate(fileno(fp), journalSize) != 0 || fseek(fp, 0, SEEK_END) != 0)
+    {
+        if (fp != NULL)
+        {
+            fclose(fp);
+            fp = NULL;
+        }
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    startSize = journalSize;
+    size = journalSize;
+    return IMAGE_OPERATION_OK;
+}
+
+void CompatibilityJournalWriter::append(CompatibilityJournalOperation operation, const CompatibilitySoftware &software)
+{
+    if (fp == NULL)
+    {
+        return;
+    }
+
+    record.clear();
+    put_string(record, software.partNumber);
+    if (operation == JOURNAL_UPSERT)
+    {
+        put_uint32(record, software.lrus.size());
+        for (size_t i = 0; i < software.lrus.size(); i++)
+        {
+            put_string(record, software.lrus[i].name);
+            put_string(record, software.lrus[i].partNumber);
+        }
+        put_string(record, software.xml);
+    }
+
+    JournalRecordHeader recordHeader;
+    recordHeader.operation = operation;
+    recordHeader.size = record.size();
+    recordHeader.checksum = record_checksum(record);
+    fwrite(&recordHeader, sizeof(recordHeader), 1, fp);
+    fwrite(record.data(), 1, record.size(), fp);
+    size += sizeof(recordHeader) + record.size();
+}
+
+ImageOperationResult CompatibilityJournalWriter::commit(uint64_t &journalSize)
+{
+    if (fp == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    bool error = (fflush(fp) != 0 || ferror(fp) != 0 || fdatasync(fileno(fp)) != 0);
+    if (fclose(fp) != 0 || error)
+    {
+        fp = NULL;
+        truncate(path.c_str(), startSize);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    fp = NULL;
+    journalSize = size;
+    return IMAGE_OPERATION_OK;
+}
+
+void CompatibilityJournalWriter::rollback()
+{
+    if (fp != NULL)
+    {
+        fclose(fp);
+        fp = NULL;
+        truncate(path.c_str(), startSize);
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef COMPATIBILITY_JOURNAL_H
+#define COMPATIBILITY_JOURNAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <functional>
+#include <string>
+
+#include "iimagemanager.h"
+#include "compatibility_store.h"
+
+/**
+ * @brief Change recorded in the journal.
+ */
+typedef enum
+{
+    JOURNAL_UPSERT = 1,
+    JOURNAL_REMOVE = 2
+} CompatibilityJournalOperation;
+
+/**
+ * @brief Called with each record of a journal. Only the part number of the
+ * entry is set for JOURNAL_REMOVE.
+ */
+typedef std::function<void(CompatibilityJournalOperation operation, const CompatibilitySoftware &software)> CompatibilityJournalCallback;
+
+/**
+ * Read the records of a journal, in the order they were written.
+ * A journal holds the changes made to one version of the compatibility file,
+ * identified by its file status. Reading stops at the first incomplete or
+ * damaged record, which is what a crash while appending leaves.
+ * If the journal was written for another version of the compatibility file
+ * but a replacement journal for this version is waiting to be installed, it's
+ * installed first (see copy_compatibility_journal). Otherwise the records of
+ * the other version are read, and the journal is written again for this one.
+ *
+ * @param[in] path journal path.
+ * @param[in] source current file status of the compatibility file.
+ * @param[in] callback function called with each record.
+ * @param[out] size size of the valid part of the journal, 0 if there is none.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR if there is no journal.
+ */
+ImageOperationResult read_compatibility_journal(
+    const std::string &path,
+    const struct stat &source,
+    const CompatibilityJournalCallback &callback,
+    uint64_t &size);
+
+/**
+ * Write a replacement journal with a part of the records of a journal. It's
+ * written next to the journal and only replaces it when
+ * install_compatibility_journal is called.
+ *
+ * @param[in] path journal path.
+ * @param[in] offset offset of the first record to be kept.
+ * @param[in] end end of the last record to be kept.
+ * @param[in] source file status of the compatibility file the new journal is for.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult copy_compatibility_journal(
+    const std::string &path,
+    uint64_t offset,
+    uint64_t end,
+    const struct stat &source);
+
+/**
+ * Replace a journal with the one written by copy_compatibility_journal.
+ *
+ * @param[in] path journal path.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult install_compatibility_journal(const std::string &path);
+
+/**
+ * Remove a replacement journal that will not be installed.
+ *
+ * @param[in] path journal path.
+ */
+void discard_compatibility_journal(const std::string &path);
+
+/**
+ * @brief Appends records to a journal. Nothing is guaranteed to be written
+ * until commit succeeds, and records appended since open are dropped if the
+ * writer is destroyed without being committed.
+ */
+class CompatibilityJournalWriter
+{
+public:
+    CompatibilityJournalWriter();
+
+    /**
+     * Drop the records not committed.
+     */
+    ~CompatibilityJournalWriter();
+
+    /**
+     * Open a journal to append records.
+     *
+     * @param[in] path journal path.
+     * @param[in] size size of the valid part of the journal, see
+     * read_compatibility_journal. If 0, a new journal is started.
+     * @param[in] source file status of the compatibility file, used for a new journal.
+     * @return IMAGE_OPERATION_OK if success.
+     * @return IMAGE_OPERATION_ERROR otherwise.
+     */
+    ImageOperationResult open(const std::string &path, uint64_t size, const struct stat &source);
+
+    /**
+     * Append a record.
+     *
+     * @param[in] operation change to be recorded.
+     * @param[in] software entry changed. Only its part number is used for JOURNAL_REMOVE.
+     */
+    void append(CompatibilityJournalOperation operation, const CompatibilitySoftware &software);
+
+    /**
+     * Write the records to disk and close the journal.
+     *
+     * @param[out] size new size of the journal.
+     * @return IMAGE_OPERATION_OK if success.
+     * @return IMAGE_OPERATION_ERROR otherwise. The records are dropped.
+     */
+    ImageOperationResult commit(uint64_t &size);
+
+    /**
+     * Drop the records appended since open and close the journal.
+     */
+    void rollback();
+
+private:
+    CompatibilityJournalWriter(const CompatibilityJournalWriter &);
+    CompatibilityJournalWriter &operator=(const CompatibilityJournalWriter &);
+
+    FILE *fp;
+    std::string path;
+    uint64_t startSize;
+    uint64_t size;
+    std::string record;
+};
+
+#endif // COMPATIBILITY_JOURNAL_H
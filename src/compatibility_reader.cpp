@@ -0,0 +1,729 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "compatibility_reader.h"
+
+#define READ_BUFFER_SIZE (64 * 1024)
+
+// Longest entity name that is decoded, like "#x10FFFF"
+#define MAX_ENTITY_SIZE 10
+
+static bool is_space(int c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Same name characters tinyxml2 accepts
+static bool is_name_start_char(int c)
+{
+    return c >= 0x80 || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == ':' || c == '_';
+}
+
+static bool is_name_char(int c)
+{
+    return is_name_start_char(c) || (c >= '0' && c <= '9') || c == '.' || c == '-';
+}
+
+static void append_utf8(std::string &value, unsigned long code)
+{
+    if (code < 0x80)
+    {
+        value.push_back((char)code);
+    }
+    else if (code < 0x800)
+    {
+        value.push_back((char)(0xC0 | (code >> 6)));
+        value.push_back((char)(0x80 | (code & 0x3F)));
+    }
+    else if (code < 0x10000)
+    {
+        value.push_back((char)(0xE0 | (code >> 12)));
+        value.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+        value.push_back((char)(0x80 | (code & 0x3F)));
+    }
+    else
+    {
+        value.push_back((char)(0xF0 | (code >> 18)));
+        value.push_back((char)(0x80 | ((code >> 12) & 0x3F)));
+        value.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+        value.push_back((char)(0x80 | (code & 0x3F)));
+    }
+}
+
+/**
+ * Decode an entity name, without '&' and ';'.
+ */
+static bool decode_entity(const std::string &name, std::string &value)
+{
+    if (name == "lt")
+    {
+        value.push_back('<');
+    }
+    else if (name == "gt")
+    {
+        value.push_back('>');
+    }
+    else if (name == "amp")
+    {
+        value.push_back('&');
+    }
+    else if (name == "quot")
+    {
+        value.push_back('"');
+    }
+    else if (name == "apos")
+    {
+        value.push_back('\'');
+    }
+    else if (name.size() > 1 && name[0] == '#')
+    {
+        bool hex = (name[1] == 'x');
+        const char *digits = name.c_str() + (hex ? 2 : 1);
+        char *digitsEnd = NULL;
+        unsigned long code = strtoul(digits, &digitsEnd, hex ? 16 : 10);
+        if (digits[0] == '\0' || *digitsEnd != '\0' || code == 0 || code > 0x10FFFF)
+        {
+            return false;
+        }
+        append_utf8(value, code);
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Buffered reader with a few characters of lookahead.
+ */
+class XmlInput
+{
+public:
+    explicit XmlInput(FILE *fp) : fp(fp), buffer(READ_BUFFER_SIZE), position(0), end(0), discarded(0), marked(NULL)
+    {
+    }
+
+    /**
+     * @return offset in the file of the next character.
+     */
+    uint64_t offset() const
+    {
+        return discarded + position;
+    }
+
+    /**
+     * Start appending the characters read to text, from the next one on.
+     */
+    void mark(std::string &text)
+    {
+        marked = &text;
+        markPosition = position;
+    }
+
+    /**
+     * Stop copying the characters read.
+     */
+    void unmark()
+    {
+        if (marked != NULL)
+        {
+            marked->append(&buffer[markPosition], position - markPosition);
+            marked = NULL;
+        }
+    }
+
+    int peek()
+    {
+        return fill(1) ? (unsigned char)buffer[position] : -1;
+    }
+
+    int next()
+    {
+        return fill(1) ? (unsigned char)buffer[position++] : -1;
+    }
+
+    bool starts_with(const char *text)
+    {
+        size_t size = strlen(text);
+        return fill(size) && memcmp(&buffer[position], text, size) == 0;
+    }
+
+    void skip(size_t count)
+    {
+        position += count;
+    }
+
+    /**
+     * Skip text up to the next '<'.
+     *
+     * @return false if the text has a character other than whitespace.
+     */
+    bool skip_text()
+    {
+        bool onlySpaces = true;
+        while (fill(1))
+        {
+            const char *start = &buffer[position];
+            const char *found = (const char *)memchr(start, '<', end - position);
+            const char *stop = (found != NULL) ? found : &buffer[end];
+            for (const char *c = start; c < stop && onlySpaces; c++)
+            {
+                onlySpaces = is_space((unsigned char)*c);
+            }
+
+            position += stop - start;
+            if (found != NULL)
+            {
+                break;
+            }
+        }
+        return onlySpaces;
+    }
+
+    /**
+     * Append characters to value until one for which stop returns true.
+     */
+    template <typename Predicate>
+    void read_while_not(Predicate stop, std::string &value)
+    {
+        while (fill(1))
+        {
+            size_t first = position;
+            while (position < end && !stop((unsigned char)buffer[position]))
+            {
+                position++;
+            }
+
+            value.append(&buffer[first], position - first);
+            if (position < end)
+            {
+                break;
+            }
+        }
+    }
+
+    bool read_error() const
+    {
+        return ferror(fp) != 0;
+    }
+
+private:
+    bool fill(size_t count)
+    {
+        if (end - position >= count)
+        {
+            return true;
+        }
+
+        if (marked != NULL)
+        {
+            marked->append(&buffer[markPosition], position - markPosition);
+            markPosition = 0;
+        }
+
+        memmove(&buffer[0], &buffer[position], end - position);
+        discarded += position;
+        end -= position;
+        position = 0;
+        while (end < count)
+        {
+            size_t read = fread(&buffer[end], 1, buffer.size() - end, fp);
+            if (read == 0)
+            {
+                return false;
+            }
+            end += read;
+        }
+        return true;
+    }
+
+    FILE *fp;
+    std::vector<char> buffer;
+    size_t position;
+    size_t end;
+    uint64_t discarded;
+    std::string *marked;
+    size_t markPosition;
+};
+
+/**
+ * @brief Pull parser of compatibility files. Only the names of the open
+ * elements and the SOFTWARE entry being parsed are kept.
+ */
+class CompatibilityParser
+{
+public:
+    CompatibilityParser(FILE *fp, CompatibilityFileInfo &info, const CompatibilitySoftwareCallback &callback)
+        : input(fp),
+          info(info),
+          callback(callback),
+          rootSeen(false),
+          inRoot(false),
+          inSoftware(false),
+          softwareHasPartNumber(false),
+          nodeStart(0),
+          nodeEnd(0),
+          spaceBefore(true),
+          closeOffset(0)
+    {
+    }
+
+    ImageOperationResult parse()
+    {
+        if (input.starts_with("\xEF\xBB\xBF"))
+        {
+            input.skip(3);
+        }
+
+        bool firstNode = true;
+        for (;;)
+        {
+            int c = input.peek();
+            if (c < 0)
+            {
+                break;
+            }
+
+            if (c != '<')
+            {
+                // Text is ignored, but only whitespace is allowed outside
+                // elements. What is in the root element is kept for the
+                // indentation of the next entry.
+                bool inRootText = (openElements.size() == 1 && inRoot);
+                if (inRootText)
+                {
+                    input.mark(space);
+                }
+                bool onlySpaces = input.skip_text();
+                if (inRootText)
+                {
+                    input.unmark();
+                }
+                if (!onlySpaces)
+                {
+                    if (openElements.empty())
+                    {
+                        return IMAGE_OPERATION_ERROR;
+                    }
+                    spaceBefore = false;
+                }
+                continue;
+            }
+
+            nodeStart = input.offset();
+            bool ok;
+            if (input.starts_with("<?"))
+            {
+                ok = parse_declaration(firstNode);
+            }
+            else if (input.starts_with("<!--"))
+            {
+                ok = skip_until("-->");
+            }
+            else if (input.starts_with("<![CDATA["))
+            {
+                ok = !openElements.empty() && skip_until("]]>");
+            }
+            else if (input.starts_with("<!"))
+            {
+                ok = skip_until(">");
+            }
+            else if (input.starts_with("</"))
+            {
+                ok = parse_end_tag();
+            }
+            else
+            {
+                ok = parse_start_tag();
+            }
+
+            if (!ok)
+            {
+                return IMAGE_OPERATION_ERROR;
+            }
+            firstNode = false;
+            nodeEnd = input.offset();
+            spaceBefore = true;
+            space.clear();
+        }
+
+        if (input.read_error() || !rootSeen || !openElements.empty())
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        return IMAGE_OPERATION_OK;
+    }
+
+private:
+    bool skip_until(const char *terminator)
+    {
+        size_t size = strlen(terminator);
+        for (;;)
+        {
+            if (input.starts_with(terminator))
+            {
+                input.skip(size);
+                return true;
+            }
+
+            if (input.next() < 0)
+            {
+                return false;
+            }
+        }
+    }
+
+    void skip_spaces()
+    {
+        while (is_space(input.peek()))
+        {
+            input.next();
+        }
+    }
+
+    bool read_name(std::string &name)
+    {
+        name.clear();
+        if (!is_name_start_char(input.peek()))
+        {
+            return false;
+        }
+
+        input.read_while_not([](int c) { return !is_name_char(c); }, name);
+        return true;
+    }
+
+    bool read_attribute_value(int quote, std::string &value)
+    {
+        value.clear();
+        for (;;)
+        {
+            input.read_while_not([quote](int c) { return c == quote || c == '&' || c == '\r'; }, value);
+
+            int c = input.next();
+            if (c < 0)
+            {
+                return false;
+            }
+
+            if (c == quote)
+            {
+                return true;
+            }
+
+            if (c == '&')
+            {
+                // Unknown entities are kept as they are
+                std::string entity;
+                while (entity.size() < MAX_ENTITY_SIZE && input.peek() >= 0 && input.peek() != ';' &&
+                       input.peek() != quote && input.peek() != '&')
+                {
+                    entity.push_back((char)input.next());
+                }
+
+                if (input.peek() != ';')
+                {
+                    value.push_back('&');
+                    value.append(entity);
+                }
+                else
+                {
+                    input.next();
+                    if (!decode_entity(entity, value))
+                    {
+                        value.push_back('&');
+                        value.append(entity);
+                        value.push_back(';');
+                    }
+                }
+            }
+            else if (c == '\r')
+            {
+                // Line ends are normalized
+                if (input.peek() == '\n')
+                {
+                    input.next();
+                }
+                value.push_back('\n');
+            }
+            else
+            {
+                value.push_back((char)c);
+            }
+        }
+    }
+
+    /**
+     * Parse a declaration or processing instruction. Like in tinyxml2, it's
+     * the document declaration if it's the first node.
+     */
+    bool parse_declaration(bool firstNode)
+    {
+        input.skip(2);
+
+        std::string content;
+        for (;;)
+        {
+            if (input.starts_with("?>"))
+            {
+                input.skip(2);
+                break;
+            }
+
+            int c = input.next();
+            if (c < 0)
+            {
+                return false;
+            }
+
+            if (firstNode)
+            {
+                content.push_back((char)c);
+            }
+        }
+
+        if (firstNode)
+        {
+            info.declaration = content;
+        }
+        return true;
+    }
+
+    bool parse_start_tag()
+    {
+        // Each element in the root is copied until it's known if it's an
+        // entry, after the whitespace that starts its line
+        bool copied = (openElements.size() == 1 && inRoot);
+        size_t indent = 0;
+        if (copied)
+        {
+            size_t lineStart = space.find_last_of("\r\n");
+            software.xml.assign(spaceBefore ? space.substr((lineStart == std::string::npos) ? 0 : lineStart + 1) : std::string());
+            indent = software.xml.size();
+            input.mark(software.xml);
+        }
+        input.skip(1);
+
+        std::string name;
+        if (!read_name(name))
+        {
+            return false;
+        }
+
+        size_t depth = openElements.size();
+        bool isRoot = (depth == 0 && !rootSeen);
+        bool isSoftware = (depth == 1 && inRoot && name == "SOFTWARE");
+        bool isLru = (depth == 2 && inSoftware && name == "LRU");
+
+        CompatibilityLru lru;
+        bool hasName = false;
+        bool hasPartNumber = false;
+        bool selfClosing = false;
+        std::string attribute;
+        for (;;)
+        {
+            skip_spaces();
+            int c = input.peek();
+            if (c == '/')
+            {
+                closeOffset = input.offset();
+                input.next();
+                if (input.next() != '>')
+                {
+                    return false;
+                }
+                selfClosing = true;
+                break;
+            }
+
+            if (c == '>')
+            {
+                input.next();
+                break;
+            }
+
+            if (!read_name(attribute))
+            {
+                return false;
+            }
+
+            skip_spaces();
+            if (input.next() != '=')
+            {
+                return false;
+            }
+
+            skip_spaces();
+            int quote = input.next();
+            if (quote != '"' && quote != '\'')
+            {
+                return false;
+            }
+
+            // The first attribute with a name is the one used
+            if (attribute == "PN" && !hasPartNumber)
+            {
+                hasPartNumber = true;
+                if (!read_attribute_value(quote, lru.partNumber))
+                {
+                    return false;
+                }
+            }
+            else if (attribute == "name" && !hasName)
+            {
+                hasName = true;
+                if (!read_attribute_value(quote, lru.name))
+                {
+                    return false;
+                }
+            }
+            else if (!read_attribute_value(quote, value))
+            {
+                return false;
+            }
+        }
+
+        if (copied && !isSoftware)
+        {
+            input.unmark();
+        }
+
+        if (isRoot)
+        {
+            rootSeen = true;
+            inRoot = true;
+            info.rootName = name;
+            if (selfClosing)
+            {
+                info.rootEnd = closeOffset;
+                info.rootSelfClosing = true;
+            }
+        }
+        else if (isSoftware)
+        {
+            inSoftware = true;
+            softwareHasPartNumber = hasPartNumber;
+            software.partNumber.swap(lru.partNumber);
+            software.lrus.clear();
+            software.offset = nodeStart - indent;
+            software.spaceBefore = spaceBefore ? software.offset - nodeEnd : 0;
+        }
+        else if (isLru)
+        {
+            software.lrus.push_back(lru);
+        }
+
+        if (selfClosing)
+        {
+            close_element(depth);
+        }
+        else
+        {
+            openElements.push_back(name);
+        }
+        return true;
+    }
+
+    bool parse_end_tag()
+    {
+        input.skip(2);
+
+        std::string name;
+        if (!read_name(name))
+        {
+            return false;
+        }
+
+        skip_spaces();
+        if (input.next() != '>' || openElements.empty() || openElements.back() != name)
+        {
+            return false;
+        }
+
+        openElements.pop_back();
+        if (openElements.empty() && inRoot)
+        {
+            info.rootEnd = nodeStart;
+            info.rootEndSpace = spaceBefore ? nodeStart - nodeEnd : 0;
+        }
+        close_element(openElements.size());
+        return true;
+    }
+
+    void close_element(size_t depth)
+    {
+        if (depth == 0)
+        {
+            inRoot = false;
+        }
+        else if (depth == 1 && inSoftware)
+        {
+            input.unmark();
+            inSoftware = false;
+            info.softwareCount++;
+            if (!softwareHasPartNumber)
+            {
+                info.missingPartNumber = true;
+            }
+            else if (callback)
+            {
+                callback(software);
+            }
+        }
+    }
+
+    XmlInput input;
+    CompatibilityFileInfo &info;
+    const CompatibilitySoftwareCallback &callback;
+
+    std::vector<std::string> openElements;
+    bool rootSeen;
+    bool inRoot;
+    bool inSoftware;
+    bool softwareHasPartNumber;
+    CompatibilitySoftware software;
+    std::string value;
+
+    // Start and end offsets of the last node parsed, and whether there is
+    // only whitespace after it
+    uint64_t nodeStart;
+    uint64_t nodeEnd;
+    bool spaceBefore;
+    std::string space;
+    uint64_t closeOffset;
+};
+
+ImageOperationResult read_compatibility_file(
+    FILE *fp,
+    CompatibilityFileInfo &info,
+    const CompatibilitySoftwareCallback &callback)
+{
+    info = CompatibilityFileInfo();
+
+    CompatibilityParser parser(fp, info, callback);
+    return parser.parse();
+}
+
+ImageOperationResult read_compatibility_file(
+    const std::string &path,
+    CompatibilityFileInfo &info,
+    const CompatibilitySoftwareCallback &callback)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+    {
+        info = CompatibilityFileInfo();
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    ImageOperationResult result = read_compatibility_file(fp, info, callback);
+    fclose(fp);
+    return result;
+}
@@ -0,0 +1,70 @@
+#ifndef COMPATIBILITY_READER_H
+#define COMPATIBILITY_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <string>
+
+#include "iimagemanager.h"
+#include "compatibility_store.h"
+
+/**
+ * @brief Document level data of a compatibility file.
+ */
+struct CompatibilityFileInfo
+{
+    std::string declaration;
+    std::string rootName;
+    size_t softwareCount = 0;
+    bool missingPartNumber = false;
+
+    // Offset of the end tag of the root element, and number of whitespace
+    // characters before it. For an empty element, offset of its "/>".
+    uint64_t rootEnd = 0;
+    uint64_t rootEndSpace = 0;
+    bool rootSelfClosing = false;
+};
+
+/**
+ * @brief Called with each SOFTWARE entry of a compatibility file, as soon as
+ * its element is closed.
+ */
+typedef std::function<void(const CompatibilitySoftware &software)> CompatibilitySoftwareCallback;
+
+/**
+ * Read a compatibility file without loading it. The file is parsed as it's
+ * read, so only the SOFTWARE element being parsed is kept in memory.
+ * The XML syntax of the whole file is checked, and SOFTWARE entries are
+ * reported as they are found. An entry without part number is not reported,
+ * it's only flagged in info.
+ *
+ * @param[in] path compatibility file path.
+ * @param[out] info declaration, root element and entry count of the file.
+ * @param[in] callback function called with each entry. May be empty.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR if the file can't be read or is not well formed XML.
+ */
+ImageOperationResult read_compatibility_file(
+    const std::string &path,
+    CompatibilityFileInfo &info,
+    const CompatibilitySoftwareCallback &callback);
+
+/**
+ * Read a compatibility file already open, see read_compatibility_file. It's
+ * read from the current position.
+ *
+ * @param[in] fp compatibility file.
+ * @param[out] info declaration, root element and entry count of the file.
+ * @param[in] callback function called with each entry. May be empty.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR if the file can't be read or is not well formed XML.
+ */
+ImageOperationResult read_compatibility_file(
+    FILE *fp,
+    CompatibilityFileInfo &info,
+    const CompatibilitySoftwareCallback &callback);
+
+#endif // COMPATIBILITY_READER_H
@@ -0,0 +1,446 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "compatibility_store.h"
+
+#define STORE_MAGIC "PESCOMPT"
+#define STORE_VERSION 3
+
+// Written in native byte order, so a store from another machine is rebuilt
+#define STORE_BYTE_ORDER 0x01020304
+
+/**
+ * @brief Store file header. Offsets are from the start of the file.
+ */
+struct StoreHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+
+    // Compatibility file the store was built from
+    uint64_t sourceSize;
+    int64_t sourceMtimeSec;
+    int64_t sourceMtimeNsec;
+    uint64_t sourceInode;
+
+    uint32_t softwareCount;
+    uint32_t lruCount;
+    uint32_t stringCount;
+    uint32_t stringDataSize;
+    uint32_t declaration;
+    uint32_t rootName;
+    uint32_t softwareOffset;
+    uint32_t sortedOffset;
+    uint32_t lruOffset;
+    uint32_t lruRefCount;
+    uint32_t lruRefOffset;
+    uint32_t stringOffset;
+    uint32_t stringDataOffset;
+};
+
+static bool source_matches(const StoreHeader &header, const struct stat &source)
+{
+    return header.sourceSize == (uint64_t)source.st_size &&
+           header.sourceMtimeSec == (int64_t)source.st_mtim.tv_sec &&
+           header.sourceMtimeNsec == (int64_t)source.st_mtim.tv_nsec &&
+           header.sourceInode == (uint64_t)source.st_ino;
+}
+
+CompatibilityStore::CompatibilityStore()
+    : data(NULL),
+      dataSize(0),
+      xmlFd(-1),
+      header(NULL),
+      softwares(NULL),
+      sorted(NULL),
+      lrus(NULL),
+      lruRefs(NULL),
+      strings(NULL),
+      stringData(NULL)
+{
+}
+
+CompatibilityStore::~CompatibilityStore()
+{
+    close();
+}
+
+ImageOperationResult CompatibilityStore::open(const std::string &path, const std::string &xmlPath, const struct stat &source)
+{
+    close();
+
+    // The compatibility file must still be the one the store is for
+    struct stat xmlStatus;
+    int xmlFile = ::open(xmlPath.c_str(), O_RDONLY);
+    if (xmlFile < 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+    if (fstat(xmlFile, &xmlStatus) != 0 ||
+        xmlStatus.st_size != source.st_size ||
+        xmlStatus.st_mtim.tv_sec != source.st_mtim.tv_sec ||
+        xmlStatus.st_mtim.tv_nsec != source.st_mtim.tv_nsec ||
+        xmlStatus.st_ino != source.st_ino)
+    {
+        ::close(xmlFile);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        ::close(xmlFile);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(StoreHeader))
+    {
+        ::close(fd);
+        ::close(xmlFile);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        ::close(xmlFile);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // Only the layout is checked here. Indexes read from the file are
+    // checked when they are used.
+    const StoreHeader *storeHeader = (const StoreHeader *)mapping;
+    const char *base = (const char *)mapping;
+    uint64_t fileSize = st.st_size;
+    bool valid =
+        memcmp(storeHeader->magic, STORE_MAGIC, sizeof(storeHeader->magic)) == 0 &&
+        storeHeader->version == STORE_VERSION &&
+        storeHeader->byteOrder == STORE_BYTE_ORDER &&
+        source_matches(*storeHeader, source) &&
+        storeHeader->softwareOffset == sizeof(StoreHeader) &&
+        storeHeader->sortedOffset == storeHeader->softwareOffset + (uint64_t)storeHeader->softwareCount * sizeof(StoreSoftware) &&
+        storeHeader->lruOffset == storeHeader->sortedOffset + (uint64_t)storeHeader->softwareCount * sizeof(uint32_t) &&
+        storeHeader->lruRefOffset == storeHeader->lruOffset + (uint64_t)storeHeader->lruCount * sizeof(StoreLru) &&
+        storeHeader->stringOffset == storeHeader->lruRefOffset + (uint64_t)storeHeader->lruRefCount * sizeof(StoreLruRef) &&
+        storeHeader->stringDataOffset == storeHeader->stringOffset + (uint64_t)storeHeader->stringCount * sizeof(uint32_t) &&
+        storeHeader->stringDataOffset + (uint64_t)storeHeader->stringDataSize == fileSize &&
+        storeHeader->stringDataSize > 0 &&
+        base[fileSize - 1] == '\0';
+    if (!valid)
+    {
+        munmap(mapping, st.st_size);
+        ::close(xmlFile);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    data = mapping;
+    dataSize = st.st_size;
+    xmlFd = xmlFile;
+    header = storeHeader;
+    softwares = (const StoreSoftware *)(base + header->softwareOffset);
+    sorted = (const uint32_t *)(base + header->sortedOffset);
+    lrus = (const StoreLru *)(base + header->lruOffset);
+    lruRefs = (const StoreLruRef *)(base + header->lruRefOffset);
+    strings = (const uint32_t *)(base + header->stringOffset);
+    stringData = base + header->stringDataOffset;
+    return IMAGE_OPERATION_OK;
+}
+
+void CompatibilityStore::close()
+{
+    if (data != NULL)
+    {
+        munmap(data, dataSize);
+    }
+    if (xmlFd >= 0)
+    {
+        ::close(xmlFd);
+    }
+
+    data = NULL;
+    dataSize = 0;
+    xmlFd = -1;
+    header = NULL;
+    softwares = NULL;
+    sorted = NULL;
+    lrus = NULL;
+    lruRefs = NULL;
+    strings = NULL;
+    stringData = NULL;
+}
+
+uint32_t CompatibilityStore::size() const
+{
+    return (header != NULL) ? header->softwareCount : 0;
+}
+
+bool CompatibilityStore::find(const char *partNumber, uint32_t &index) const
+{
+    uint32_t low = 0;
+    uint32_t high = size();
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        int compare = strcmp(part_number(sorted[middle]), partNumber);
+        if (compare == 0)
+        {
+            index = sorted[middle];
+            return index < size();
+        }
+
+        if (compare < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return false;
+}
+
+void CompatibilityStore::find_lru(const char *lru, std::vector<uint32_t> &indexes) const
+{
+    // First item with the string, items are sorted by string and entry
+    uint32_t low = 0;
+    uint32_t high = (header != NULL) ? header->lruRefCount : 0;
+    uint32_t count = high;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (strcmp(string_at(lruRefs[middle].lru), lru) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    for (; low < count && strcmp(string_at(lruRefs[low].lru), lru) == 0; low++)
+    {
+        if (lruRefs[low].software < size())
+        {
+            indexes.push_back(lruRefs[low].software);
+        }
+    }
+}
+
+const char *CompatibilityStore::part_number(uint32_t index) const
+{
+    return (index < size()) ? string_at(softwares[index].partNumber) : "";
+}
+
+uint32_t CompatibilityStore::lru_count(uint32_t index) const
+{
+    return (index < size()) ? softwares[index].lruCount : 0;
+}
+
+const char *CompatibilityStore::lru_name(uint32_t index, uint32_t lru) const
+{
+    if (lru >= lru_count(index) || (uint64_t)softwares[index].firstLru + lru >= header->lruCount)
+    {
+        return "";
+    }
+    return string_at(lrus[softwares[index].firstLru + lru].name);
+}
+
+const char *CompatibilityStore::lru_part_number(uint32_t index, uint32_t lru) const
+{
+    if (lru >= lru_count(index) || (uint64_t)softwares[index].firstLru + lru >= header->lruCount)
+    {
+        return "";
+    }
+    return string_at(lrus[softwares[index].firstLru + lru].partNumber);
+}
+
+bool CompatibilityStore::software_xml(uint32_t index, std::string &xml) const
+{
+    xml.clear();
+    if (index >= size() || xmlFd < 0)
+    {
+        return false;
+    }
+
+    xml.resize(softwares[index].xmlSize);
+    size_t done = 0;
+    while (done < xml.size())
+    {
+        ssize_t count = pread(xmlFd, &xml[done], xml.size() - done, softwares[index].xmlOffset + done);
+        if (count <= 0)
+        {
+            return false;
+        }
+        done += count;
+    }
+
+    // The offset is checked by what is found there
+    size_t start = xml.find_first_not_of(" \t");
+    return start != std::string::npos && xml.compare(start, 9, "<SOFTWARE") == 0;
+}
+
+const char *CompatibilityStore::declaration() const
+{
+    return (header != NULL) ? string_at(header->declaration) : "";
+}
+
+const char *CompatibilityStore::root_name() const
+{
+    return (header != NULL) ? string_at(header->rootName) : "";
+}
+
+const char *CompatibilityStore::string_at(uint32_t id) const
+{
+    if (header == NULL || id >= header->stringCount || strings[id] >= header->stringDataSize)
+    {
+        return "";
+    }
+    return stringData + strings[id];
+}
+
+void CompatibilityStoreBuilder::add(const CompatibilitySoftware &software)
+{
+    StoreSoftware storeSoftware;
+    storeSoftware.partNumber = intern(software.partNumber);
+    storeSoftware.firstLru = lrus.size();
+    storeSoftware.lruCount = software.lrus.size();
+    storeSoftware.xmlSize = software.xml.size();
+    storeSoftware.xmlOffset = software.offset;
+    softwares.push_back(storeSoftware);
+
+    for (size_t i = 0; i < software.lrus.size(); i++)
+    {
+        StoreLru lru;
+        lru.name = intern(software.lrus[i].name);
+        lru.partNumber = intern(software.lrus[i].partNumber);
+        lrus.push_back(lru);
+
+        StoreLruRef ref;
+        ref.software = softwares.size() - 1;
+        if (!software.lrus[i].name.empty())
+        {
+            ref.lru = lru.name;
+            lruRefs.push_back(ref);
+        }
+        if (!software.lrus[i].partNumber.empty() && lru.partNumber != lru.name)
+        {
+            ref.lru = lru.partNumber;
+            lruRefs.push_back(ref);
+        }
+    }
+}
+
+ImageOperationResult CompatibilityStoreBuilder::write(
+    const std::string &path,
+    const std::string &declaration,
+    const std::string &rootName,
+    const struct stat &source)
+{
+    StoreHeader storeHeader;
+    memset(&storeHeader, 0, sizeof(storeHeader));
+    memcpy(storeHeader.magic, STORE_MAGIC, sizeof(storeHeader.magic));
+    storeHeader.version = STORE_VERSION;
+    storeHeader.byteOrder = STORE_BYTE_ORDER;
+    storeHeader.sourceSize = source.st_size;
+    storeHeader.sourceMtimeSec = source.st_mtim.tv_sec;
+    storeHeader.sourceMtimeNsec = source.st_mtim.tv_nsec;
+    storeHeader.sourceInode = source.st_ino;
+    storeHeader.declaration = intern(declaration);
+    storeHeader.rootName = intern(rootName);
+    storeHeader.softwareCount = softwares.size();
+    storeHeader.lruCount = lrus.size();
+    storeHeader.stringCount = stringOffsets.size();
+    storeHeader.stringDataSize = stringData.size();
+
+    std::vector<uint32_t> sorted(softwares.size());
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(), [this](uint32_t a, uint32_t b) {
+        return strcmp(stringData.c_str() + stringOffsets[softwares[a].partNumber],
+                      stringData.c_str() + stringOffsets[softwares[b].partNumber]) < 0;
+    });
+
+    // Strings are stored once, so items with the same string are together
+    // once sorted, with each entry only once
+    std::sort(lruRefs.begin(), lruRefs.end(), [this](const StoreLruRef &a, const StoreLruRef &b) {
+        int compare = (a.lru == b.lru) ? 0 : strcmp(stringData.c_str() + stringOffsets[a.lru], stringData.c_str() + stringOffsets[b.lru]);
+        return (compare != 0) ? compare < 0 : a.software < b.software;
+    });
+    lruRefs.erase(std::unique(lruRefs.begin(), lruRefs.end(), [](const StoreLruRef &a, const StoreLruRef &b) {
+                      return a.lru == b.lru && a.software == b.software;
+                  }),
+                  lruRefs.end());
+    storeHeader.lruRefCount = lruRefs.size();
+
+    // Sections are arrays of 32-bit values, so they stay aligned
+    uint64_t offset = sizeof(StoreHeader);
+    storeHeader.softwareOffset = offset;
+    offset += softwares.size() * sizeof(StoreSoftware);
+    storeHeader.sortedOffset = offset;
+    offset += sorted.size() * sizeof(uint32_t);
+    storeHeader.lruOffset = offset;
+    offset += lrus.size() * sizeof(StoreLru);
+    storeHeader.lruRefOffset = offset;
+    offset += lruRefs.size() * sizeof(StoreLruRef);
+    storeHeader.stringOffset = offset;
+    offset += stringOffsets.size() * sizeof(uint32_t);
+    storeHeader.stringDataOffset = offset;
+    offset += stringData.size();
+    if (offset > UINT32_MAX)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    std::string tmpPath = path + std::string(".tmp");
+    FILE *fp = fopen(tmpPath.c_str(), "wb");
+    if (fp == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    fwrite(&storeHeader, sizeof(storeHeader), 1, fp);
+    fwrite(softwares.data(), sizeof(StoreSoftware), softwares.size(), fp);
+    fwrite(sorted.data(), sizeof(uint32_t), sorted.size(), fp);
+    fwrite(lrus.data(), sizeof(StoreLru), lrus.size(), fp);
+    fwrite(lruRefs.data(), sizeof(StoreLruRef), lruRefs.size(), fp);
+    fwrite(stringOffsets.data(), sizeof(uint32_t), stringOffsets.size(), fp);
+    fwrite(stringData.data(), 1, stringData.size(), fp);
+
+    bool error = (fflush(fp) != 0 || ferror(fp) != 0 || fsync(fileno(fp)) != 0);
+    if (fclose(fp) != 0 || error || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    return IMAGE_OPERATION_OK;
+}
+
+uint32_t CompatibilityStoreBuilder::intern(const std::string &value)
+{
+    std::unordered_map<std::string, uint32_t>::iterator it = stringIds.find(value);
+    if (it != stringIds.end())
+    {
+        return it->second;
+    }
+
+    uint32_t id = stringOffsets.size();
+    stringOffsets.push_back(stringData.size());
+    stringData.append(value);
+    stringData.push_back('\0');
+    stringIds[value] = id;
+    return id;
+}
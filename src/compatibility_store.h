@@ -0,0 +1,241 @@
+#ifndef COMPATIBILITY_STORE_H
+#define COMPATIBILITY_STORE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "iimagemanager.h"
+
+/**
+ * @brief An LRU a software is compatible with.
+ */
+struct CompatibilityLru
+{
+    std::string name;
+    std::string partNumber;
+};
+
+/**
+ * @brief A SOFTWARE entry of the compatibility file. The part numbers are
+ * what the entry is looked up by, the element itself is kept as it was
+ * written, with anything else it has, to be copied to other documents.
+ */
+struct CompatibilitySoftware
+{
+    std::string partNumber;
+    std::vector<CompatibilityLru> lrus;
+    std::string xml;
+
+    // Offset of the element in the file it was read from, including the
+    // indentation of its line, which starts xml, and number of other
+    // whitespace characters before it
+    uint64_t offset = 0;
+    uint64_t spaceBefore = 0;
+};
+
+struct StoreHeader;
+
+/**
+ * @brief SOFTWARE entry. Strings are indexes in the string table. The
+ * element itself is not stored, only where it is in the compatibility file.
+ */
+struct StoreSoftware
+{
+    uint32_t partNumber;
+    uint32_t firstLru;
+    uint32_t lruCount;
+    uint32_t xmlSize;
+    uint64_t xmlOffset;
+};
+
+/**
+ * @brief LRU of a SOFTWARE entry. Strings are indexes in the string table.
+ */
+struct StoreLru
+{
+    uint32_t name;
+    uint32_t partNumber;
+};
+
+/**
+ * @brief Reverse index item: an entry with an LRU that has the string as
+ * name or part number. Strings are indexes in the string table.
+ */
+struct StoreLruRef
+{
+    uint32_t lru;
+    uint32_t software;
+};
+
+/**
+ * @brief Builds a store file one entry at a time. Entries are kept in the
+ * store format, with each string stored once.
+ */
+class CompatibilityStoreBuilder
+{
+public:
+    /**
+     * Add an entry after the ones already added.
+     *
+     * @param[in] software entry to be added.
+     */
+    void add(const CompatibilitySoftware &software);
+
+    /**
+     * Write the store file. The file is replaced atomically.
+     *
+     * @param[in] path store path.
+     * @param[in] declaration XML declaration of the compatibility file.
+     * @param[in] rootName root element name of the compatibility file.
+     * @param[in] source file status of the compatibility file.
+     * @return IMAGE_OPERATION_OK if success.
+     * @return IMAGE_OPERATION_ERROR otherwise.
+     */
+    ImageOperationResult write(
+        const std::string &path,
+        const std::string &declaration,
+        const std::string &rootName,
+        const struct stat &source);
+
+private:
+    uint32_t intern(const std::string &value);
+
+    std::vector<StoreSoftware> softwares;
+    std::vector<StoreLru> lrus;
+    std::vector<StoreLruRef> lruRefs;
+    std::unordered_map<std::string, uint32_t> stringIds;
+    std::vector<uint32_t> stringOffsets;
+    std::string stringData;
+};
+
+/**
+ * @brief Compatibility data in a compact binary file, mapped in memory.
+ * The file has the SOFTWARE entries in compatibility file order, a table of
+ * the entries sorted by part number, the LRUs of all entries, a reverse index
+ * from LRU names and part numbers to entries and a table of strings, each
+ * stored once. It's a cache of the compatibility file it was
+ * built from, and is only used while that file does not change. The file is
+ * kept open with the store, the elements of the entries are read from it.
+ * Store files are written with CompatibilityStoreBuilder.
+ */
+class CompatibilityStore
+{
+public:
+    CompatibilityStore();
+
+    /**
+     * Unmap the file.
+     */
+    ~CompatibilityStore();
+
+    /**
+     * Map a store file, replacing the one currently mapped, and open its
+     * compatibility file.
+     *
+     * @param[in] path store path.
+     * @param[in] xmlPath compatibility file path.
+     * @param[in] source current file status of the compatibility file.
+     * @return IMAGE_OPERATION_OK if success.
+     * @return IMAGE_OPERATION_ERROR if the store is missing, not valid or
+     * was built from another version of the compatibility file.
+     */
+    ImageOperationResult open(const std::string &path, const std::string &xmlPath, const struct stat &source);
+
+    /**
+     * Unmap the file and close the compatibility file. The store is then
+     * empty.
+     */
+    void close();
+
+    /**
+     * @return number of SOFTWARE entries.
+     */
+    uint32_t size() const;
+
+    /**
+     * Find an entry by part number.
+     *
+     * @param[in] partNumber software part number.
+     * @param[out] index position of the entry in compatibility file order.
+     * @return true if found.
+     */
+    bool find(const char *partNumber, uint32_t &index) const;
+
+    /**
+     * Find the entries with an LRU that has a name or part number.
+     *
+     * @param[in] lru LRU name or part number.
+     * @param[out] indexes positions of the entries, in compatibility file
+     * order, appended to the list.
+     */
+    void find_lru(const char *lru, std::vector<uint32_t> &indexes) const;
+
+    /**
+     * @param[in] index position of the entry.
+     * @return part number of the entry.
+     */
+    const char *part_number(uint32_t index) const;
+
+    /**
+     * @param[in] index position of the entry.
+     * @return number of LRUs of the entry.
+     */
+    uint32_t lru_count(uint32_t index) const;
+
+    /**
+     * @param[in] index position of the entry.
+     * @param[in] lru position of the LRU in the entry.
+     * @return name of the LRU, empty if it has none.
+     */
+    const char *lru_name(uint32_t index, uint32_t lru) const;
+
+    /**
+     * @param[in] index position of the entry.
+     * @param[in] lru position of the LRU in the entry.
+     * @return part number of the LRU, empty if it has none.
+     */
+    const char *lru_part_number(uint32_t index, uint32_t lru) const;
+
+    /**
+     * Read the element of an entry from the compatibility file, as it was
+     * written.
+     *
+     * @param[in] index position of the entry.
+     * @param[out] xml SOFTWARE element, after the indentation of its line.
+     * @return true if success.
+     */
+    bool software_xml(uint32_t index, std::string &xml) const;
+
+    /**
+     * @return XML declaration of the compatibility file, empty if none.
+     */
+    const char *declaration() const;
+
+    /**
+     * @return root element name of the compatibility file.
+     */
+    const char *root_name() const;
+
+private:
+    CompatibilityStore(const CompatibilityStore &);
+    CompatibilityStore &operator=(const CompatibilityStore &);
+
+    const char *string_at(uint32_t id) const;
+
+    void *data;
+    size_t dataSize;
+    int xmlFd;
+    const StoreHeader *header;
+    const StoreSoftware *softwares;
+    const uint32_t *sorted;
+    const StoreLru *lrus;
+    const StoreLruRef *lruRefs;
+    const uint32_t *strings;
+    const char *stringData;
+};
+
+#endif // COMPATIBILITY_STORE_H
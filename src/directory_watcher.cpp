@@ -0,0 +1,140 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <unordered_set>
+#include <vector>
+
+#include "directory_watcher.h"
+
+// Files created, or written and closed, renamed in or out, or removed.
+// IN_CREATE is only needed for hard links, files being written are checked
+// again when they are closed.
+#define WATCH_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+
+#define WATCH_BUFFER_SIZE (64 * 1024)
+
+DirectoryWatcher::DirectoryWatcher() : inotifyFd(-1), stopFd(-1)
+{
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    stop();
+}
+
+ImageOperationResult DirectoryWatcher::start(const std::string &path, const Callback &watchCallback)
+{
+    stop();
+
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (inotifyFd < 0 || stopFd < 0 || inotify_add_watch(inotifyFd, path.c_str(), WATCH_EVENTS) < 0)
+    {
+        stop();
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    callback = watchCallback;
+    thread = std::thread(&DirectoryWatcher::run, this);
+    return IMAGE_OPERATION_OK;
+}
+
+void DirectoryWatcher::stop()
+{
+    if (thread.joinable())
+    {
+        uint64_t value = 1;
+        while (write(stopFd, &value, sizeof(value)) < 0 && errno == EINTR)
+        {
+        }
+        thread.join();
+    }
+
+    if (inotifyFd >= 0)
+    {
+        close(inotifyFd);
+        inotifyFd = -1;
+    }
+
+    if (stopFd >= 0)
+    {
+        close(stopFd);
+        stopFd = -1;
+    }
+}
+
+void DirectoryWatcher::run()
+{
+    std::vector<char> buffer(WATCH_BUFFER_SIZE);
+    struct pollfd fds[2];
+    fds[0].fd = inotifyFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopFd;
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+
+        if (fds[1].revents != 0)
+        {
+            return;
+        }
+
+        ssize_t size = read(inotifyFd, &buffer[0], buffer.size());
+        if (size <= 0)
+        {
+            if (size < 0 && (errno == EINTR || errno == EAGAIN))
+            {
+                continue;
+            }
+            return;
+        }
+
+        // A file usually has several events (created, written, closed), it's
+        // only reported once per read
+        std::vector<std::string> fileNames;
+        std::unordered_set<std::string> seen;
+        bool overflow = false;
+        for (ssize_t offset = 0; offset < size;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)&buffer[offset];
+            offset += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                overflow = true;
+            }
+            else if (event->len > 0 && !(event->mask & IN_ISDIR))
+            {
+                std::string fileName(event->name);
+                if (seen.insert(fileName).second)
+                {
+                    fileNames.push_back(fileName);
+                }
+            }
+        }
+
+        if (overflow)
+        {
+            callback(std::string());
+            continue;
+        }
+
+        for (std::vector<std::string>::iterator it = fileNames.begin(); it != fileNames.end(); ++it)
+        {
+            callback(*it);
+        }
+    }
+}
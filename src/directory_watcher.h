@@ -0,0 +1,58 @@
+#ifndef DIRECTORY_WATCHER_H
+#define DIRECTORY_WATCHER_H
+
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "iimagemanager.h"
+
+/**
+ * @brief Watches a directory with inotify from a thread of its own, and
+ * reports the files added, written, renamed or removed in it.
+ */
+class DirectoryWatcher
+{
+public:
+    /**
+     * Called from the watcher thread with the name of a file that changed.
+     * The name is empty if events were lost, so the whole directory must be
+     * checked.
+     */
+    typedef std::function<void(const std::string &fileName)> Callback;
+
+    DirectoryWatcher();
+
+    /**
+     * Stop watching.
+     */
+    ~DirectoryWatcher();
+
+    /**
+     * Start watching a directory.
+     *
+     * @param[in] path directory to be watched.
+     * @param[in] callback called for each change.
+     * @return IMAGE_OPERATION_OK if success.
+     * @return IMAGE_OPERATION_ERROR otherwise.
+     */
+    ImageOperationResult start(const std::string &path, const Callback &callback);
+
+    /**
+     * Stop watching and wait for the callback running, if any.
+     */
+    void stop();
+
+private:
+    DirectoryWatcher(const DirectoryWatcher &);
+    DirectoryWatcher &operator=(const DirectoryWatcher &);
+
+    void run();
+
+    int inotifyFd;
+    int stopFd;
+    Callback callback;
+    std::thread thread;
+};
+
+#endif // DIRECTORY_WATCHER_H
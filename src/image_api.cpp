@@ -1,35 +1,576 @@
+#include <ctype.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <linux/fs.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <iostream>
 
 #include "iimagemanager.h"
+#include "blocking_queue.h"
+#include "compatibility_cache.h"
+#include "compatibility_db.h"
+#include "compatibility_reader.h"
+#include "directory_watcher.h"
+#include "image_index.h"
+#include "image_manifest.h"
+#include "shared_index.h"
+#include "string_arena.h"
+#include "worker_pool.h"
 #include "tinyxml2.h"
 #include "gcrypt.h"
 
 #define RELATIVE_IMAGE_DIR "/pes/images"
 
 #define COMPATIBILITY_FILE_PN "00000000"
+#define COMPATIBILITY_PART_NUMBER 0
 #define COMPATIBILITY_FILE "compatibility.xml"
 
-#define CUSTOM_COMPATIBILITY_FILE "/tmp/compatibility.xml"
+// Binary form of the compatibility file, used to answer queries
+#define COMPATIBILITY_STORE_FILE ".compatibility.bin"
+#define COMPATIBILITY_JOURNAL_FILE ".compatibility.journal"
+
+// Compatibility files written for callers are kept in a hidden directory of
+// each handler, created in the image directory
+#define SUBSET_DIR_TEMPLATE ".subsets_XXXXXX"
+#define SUBSET_FILE_PREFIX "compatibility_"
+#define SUBSET_NAME_DIGEST_SIZE 16
+// Number of the last compatibility files written for callers that are kept,
+// older ones are removed
+#define SUBSET_FILES_KEPT 16
+
+// Paths returned by get_image_path are dropped for images no longer listed
+// once there are this many times more paths than images
+#define IMAGE_PATHS_SWEEP_FACTOR 2
+
+// The manifest log is merged into the manifest once it's larger than the
+// manifest and than this size
+#define MANIFEST_LOG_MIN_SIZE (64 * 1024)
+
+// Images being imported are written to a hidden temporary file first
+#define TMP_IMAGE_TEMPLATE ".import_XXXXXX"
 
 #define PN_SIZE 4
 #define SHA256_SIZE 32
 
+// Images are hashed in blocks of this size, so memory usage does not depend on image size
+#define CHECKSUM_BLOCK_SIZE (64 * 1024)
+
+// Buffer size used to copy files when the kernel can't do it for us
+#define COPY_BLOCK_SIZE (1024 * 1024)
+
+// Buffers in flight between the stages of a batch import
+#define IMPORT_PIPELINE_BUFFERS 8
+
+// Default memory used to cache compatibility documents
+#define DEFAULT_SUBSET_CACHE_SIZE (4 * 1024 * 1024)
+#define DEFAULT_COMPATIBILITY_JOURNAL_SIZE (256 * 1024)
+
+// Files copied by the kernel are copied in chunks, so imports can be cancelled
+#define KERNEL_COPY_CHUNK_SIZE (64 * 1024 * 1024)
+
+// Number of bytes used to tell XML files from binary images
+#define XML_SNIFF_SIZE 64
+
+/**
+ * @brief An image found in the image directory that needs to be verified.
+ */
+struct PendingImage
+{
+    std::string fileName;
+    std::string filePath;
+    // Part number from the file name, for images listed before they are verified
+    uint32_t partNumber = 0;
+    struct stat st;
+    unsigned char header[PN_SIZE + SHA256_SIZE];
+    bool isValidChecksum = false;
+};
+
+/**
+ * @brief Progress of an import, shared with whoever is waiting for it.
+ */
+struct ImportProgress
+{
+    std::atomic<unsigned long long> bytesDone;
+    std::atomic<unsigned long long> bytesTotal;
+    std::atomic<bool> cancelled;
+
+    ImportProgress() : bytesDone(0), bytesTotal(0), cancelled(false) {}
+};
+
+struct ImageImportOperation
+{
+    std::string path;
+    ImageImportCallback callback = NULL;
+    void *userData = NULL;
+    ImportProgress progress;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;
+    ImageOperationResult result = IMAGE_OPERATION_ERROR;
+    // Kept by the handler, see ImageHandler::strings
+    const char *partNumber = NULL;
+
+    // Held by the caller and by the worker running the import
+    std::atomic<int> references;
+
+    ImageImportOperation() : references(0) {}
+};
+
+/**
+ * @brief Part numbers of the image list at some point, returned by
+ * get_images. It's never changed, a new one is built when the list changed,
+ * and only the previous one is kept after that. The part numbers themselves
+ * are kept by the handler.
+ */
+struct ImageListSnapshot
+{
+    uint64_t generation = 0;
+    std::vector<char *> partNumbers;
+};
+
 struct ImageHandler
 {
     std::string imageDir;
-    std::unordered_map<std::string, std::string> image_map;
-    char **images = NULL;
-    int get_list_size = 0;
+    std::string manifestPath;
+    ImageManifest manifest;
+    // Files whose manifest entry changed since the last update of the
+    // manifest on disk, see set_manifest_entry
+    std::vector<std::string> manifestChanges;
+    bool allowHardlink = false;
+    unsigned int scanThreads = 0;
+    bool lazyVerification = false;
+    ImageIndex images;
+
+    // Changes every time the image list changes. The snapshot returned by
+    // get_images is only built again when it's out of date. The one it
+    // replaced is kept once, a caller may still be using it.
+    uint64_t imageListGeneration = 1;
+    std::unique_ptr<ImageListSnapshot> imageList;
+    std::unique_ptr<ImageListSnapshot> previousImageList;
+
+    // Part numbers returned to callers are kept here until the handler is
+    // destroyed, so callers don't need to copy them. Each is stored once.
+    StringArena strings;
+    std::unordered_map<uint32_t, const char *> partNumberNames;
+    // Last path returned by get_image_path for each part number. It's only
+    // changed when the image is replaced by a file with another name, and
+    // dropped once the image is no longer listed, see image_path_name.
+    std::unordered_map<uint32_t, std::string> imagePaths;
+
+    // Protects the image list and the manifest. It's only held while they
+    // are read or changed in memory, never while files are copied or written.
+    std::mutex mutex;
+
+    // Imports and removals of the same part number are serialized by one of
+    // these locks, chosen by part number, and the same lock in the index
+    std::mutex partNumberLocks[SHARED_INDEX_PART_NUMBER_LOCKS];
+
+    // Shared with the other handlers of the image directory. indexMutex
+    // serializes the changes to the image list on disk made by this
+    // handler, and indexGeneration is the generation the image list in
+    // memory was loaded or saved at.
+    SharedIndex sharedIndex;
+    std::mutex indexMutex;
+    std::atomic<uint64_t> indexGeneration;
+    // Manifest on disk the image list in memory is up to date with. It's
+    // protected by indexMutex and the index lock.
+    ManifestPosition manifestPosition;
+
+    // Serializes changes to the compatibility data. They are written to disk
+    // holding only this lock, so queries don't wait for them. Other
+    // handlers are excluded by the compatibility lock of the shared index,
+    // and compatibilityGeneration is the generation the database in memory
+    // is up to date with.
+    std::mutex compatibilityWriteMutex;
+    std::atomic<uint64_t> compatibilityGeneration;
+    // Protects the compatibility database in memory and cached documents
+    std::mutex compatibilityMutex;
+    CompatibilityDatabase compatibility;
+    CompatibilityCache subsetCache;
+    // Directory of the files written by get_compatibility_path, created the
+    // first time it's called and removed with the handler, and the paths of
+    // the last SUBSET_FILES_KEPT files written in it, oldest first.
+    // Protected by mutex.
+    std::string subsetDir;
+    std::list<std::string> subsetPaths;
+    uint64_t compatibilityJournalSize = 0;
+    bool compactionScheduled = false;
+
+    // Only one compaction runs at a time. It's held while the compatibility
+    // file is written, without compatibilityMutex.
+    std::mutex compactionMutex;
+    WorkerPool *compactionPool = NULL;
+
+    unsigned int importThreads = 0;
+    WorkerPool *importPool = NULL;
+
+    // Keeps the image list and compatibility data up to date with files
+    // changed in the image directory, if enabled
+    DirectoryWatcher watcher;
+
+    ImageHandler() : indexGeneration(0), compatibilityGeneration(0) {}
+};
+
+/**
+ * @brief Lock of a part number, in this handler and in the other handlers
+ * using the image directory. Part numbers are grouped, so other part numbers
+ * are locked too.
+ */
+class PartNumberLock
+{
+public:
+    PartNumberLock(ImageHandlerPtr imageHandler, uint32_t partNumber)
+        : handler(imageHandler),
+          group(partNumber % SHARED_INDEX_PART_NUMBER_LOCKS)
+    {
+        handler->partNumberLocks[group].lock();
+        handler->sharedIndex.lock_part_number(group);
+    }
+
+    ~PartNumberLock()
+    {
+        handler->sharedIndex.unlock_part_number(group);
+        handler->partNumberLocks[group].unlock();
+    }
+
+private:
+    ImageHandlerPtr handler;
+    size_t group;
 };
 
-static struct ImageHandler singletonHandler;
+/**
+ * Get the part number in an image header.
+ */
+static uint32_t header_part_number(const unsigned char *header)
+{
+    return ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+}
+
+/**
+ * Get a part number as returned to callers. The string is kept until the
+ * handler is destroyed. Must be called with the handler mutex held.
+ */
+static const char *part_number_name(ImageHandlerPtr handler, uint32_t partNumber)
+{
+    const char *&name = handler->partNumberNames[partNumber];
+    if (name == NULL)
+    {
+        char hex[PART_NUMBER_DIGITS + 1];
+        format_part_number(partNumber, hex);
+        name = handler->strings.copy(hex, PART_NUMBER_DIGITS);
+    }
+    return name;
+}
+
+/**
+ * Get the path of an image.
+ */
+static std::string image_path(ImageHandlerPtr handler, const ImageIndexEntry &entry)
+{
+    return handler->imageDir + std::string("/") + handler->images.file_name(entry);
+}
+
+/**
+ * Apply a change of the manifest made by another process to the image list
+ * in memory. Images listed but not verified yet are kept, as they are when
+ * the whole manifest is loaded. Must be called with the handler mutex held.
+ */
+static void apply_manifest_change(ImageHandlerPtr handler, const ManifestChange &change)
+{
+    const ImageIndexEntry *listed = handler->images.find_file(change.fileName);
+    uint32_t partNumber = 0;
+    bool valid = (!change.removed && parse_part_number(change.entry.partNumber.c_str(), partNumber));
+    if (listed != NULL && !(listed->flags & IMAGE_ENTRY_UNVERIFIED) && (!valid || listed->partNumber != partNumber))
+    {
+        handler->images.remove(listed->partNumber);
+    }
+
+    if (change.removed)
+    {
+        handler->manifest.erase(change.fileName);
+    }
+    else
+    {
+        handler->manifest[change.fileName] = change.entry;
+    }
+
+    if (valid)
+    {
+        handler->images.add(partNumber, change.fileName, change.entry.size);
+    }
+}
+
+/**
+ * Load the image list from the manifest, which has the changes saved by
+ * other processes. Usually only the changes appended to the manifest log
+ * since it was last read are applied. Must be called with the index locked,
+ * without the handler mutex held.
+ */
+static void load_image_list(ImageHandlerPtr handler)
+{
+    std::vector<ManifestChange> changes;
+    ManifestPosition position = handler->manifestPosition;
+    if (read_manifest_log(handler->manifestPath, position, [&changes](const ManifestChange &change) {
+            changes.push_back(change);
+        }) == IMAGE_OPERATION_OK)
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        for (std::vector<ManifestChange>::const_iterator it = changes.begin(); it != changes.end(); ++it)
+        {
+            apply_manifest_change(handler, *it);
+        }
+        handler->manifestPosition = position;
+        handler->imageListGeneration++;
+        return;
+    }
+
+    // The manifest was written again
+    ImageManifest manifest;
+    load_manifest(handler->manifestPath, manifest, handler->manifestPosition);
+
+    ImageIndex images;
+    for (ImageManifest::iterator it = manifest.begin(); it != manifest.end(); ++it)
+    {
+        uint32_t partNumber;
+        if (parse_part_number(it->second.partNumber.c_str(), partNumber))
+        {
+            images.add(partNumber, it->first, it->second.size);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(handler->mutex);
+
+    // Images listed but not verified yet are not in the manifest
+    for (size_t i = 0; i < handler->images.capacity(); i++)
+    {
+        const ImageIndexEntry &entry = handler->images.slot(i);
+        if ((entry.flags & IMAGE_ENTRY_UNVERIFIED) && images.find(entry.partNumber) == NULL)
+        {
+            images.add(entry.partNumber, handler->images.file_name(entry), entry.size)->flags |= IMAGE_ENTRY_UNVERIFIED;
+        }
+    }
+
+    handler->images.swap(images);
+    handler->manifest.swap(manifest);
+    handler->imageListGeneration++;
+}
+
+/**
+ * Pick up the changes made to the image list by other processes. If there
+ * is none, it only costs reading the generation of the index. Must be called
+ * without the handler mutex held.
+ */
+static void refresh_image_list(ImageHandlerPtr handler)
+{
+    if (handler->sharedIndex.generation() == handler->indexGeneration)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> indexLock(handler->indexMutex);
+    handler->sharedIndex.lock(false);
+    uint64_t generation = handler->sharedIndex.generation();
+    if (generation != handler->indexGeneration)
+    {
+        load_image_list(handler);
+        handler->indexGeneration = generation;
+    }
+    handler->sharedIndex.unlock();
+}
+
+/**
+ * Start changing the image list. It's locked in this process and in the
+ * others, and loaded again if another process changed it. Must be called
+ * without the handler mutex held, and followed by end_image_list_update.
+ */
+static void begin_image_list_update(ImageHandlerPtr handler)
+{
+    handler->indexMutex.lock();
+    handler->sharedIndex.lock(true);
+    uint64_t generation = handler->sharedIndex.generation();
+    if (generation != handler->indexGeneration)
+    {
+        load_image_list(handler);
+        handler->indexGeneration = generation;
+    }
+}
+
+/**
+ * Set the manifest entry of a file, which is added to the manifest on disk
+ * by end_image_list_update. Must be called with the handler mutex held.
+ */
+static ManifestEntry &set_manifest_entry(ImageHandlerPtr handler, const std::string &fileName)
+{
+    handler->manifestChanges.push_back(fileName);
+    return handler->manifest[fileName];
+}
+
+/**
+ * Remove the manifest entry of a file, see set_manifest_entry. Must be called
+ * with the handler mutex held.
+ */
+static void erase_manifest_entry(ImageHandlerPtr handler, const std::string &fileName)
+{
+    handler->manifestChanges.push_back(fileName);
+    handler->manifest.erase(fileName);
+}
+
+/**
+ * Finish changing the image list. If the manifest changed, the changes are
+ * appended to its log, and the other processes are told to load them. The
+ * log is merged into the manifest when it grew larger than the manifest.
+ */
+static void end_image_list_update(ImageHandlerPtr handler)
+{
+    // Changes are copied so they are written without the handler mutex
+    std::vector<ManifestChange> changes;
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        std::unordered_set<std::string> seen;
+        for (std::vector<std::string>::iterator it = handler->manifestChanges.begin(); it != handler->manifestChanges.end(); ++it)
+        {
+            if (!seen.insert(*it).second)
+            {
+                continue;
+            }
+
+            ManifestChange change;
+            change.fileName = *it;
+            ImageManifest::iterator entry = handler->manifest.find(*it);
+            change.removed = (entry == handler->manifest.end());
+            if (!change.removed)
+            {
+                change.entry = entry->second;
+            }
+            changes.push_back(change);
+        }
+        handler->manifestChanges.clear();
+    }
+
+    if (!changes.empty())
+    {
+        ManifestPosition &position = handler->manifestPosition;
+        ImageOperationResult result = append_manifest_log(handler->manifestPath, changes, position);
+        if (result != IMAGE_OPERATION_OK ||
+            (position.logSize > MANIFEST_LOG_MIN_SIZE && position.logSize > position.baseSize))
+        {
+            ImageManifest manifest;
+            {
+                std::lock_guard<std::mutex> lock(handler->mutex);
+                manifest = handler->manifest;
+            }
+
+            // If the log could not be written, the manifest has the changes
+            if (save_manifest(handler->manifestPath, manifest, position) == IMAGE_OPERATION_OK)
+            {
+                result = IMAGE_OPERATION_OK;
+            }
+        }
+
+        if (result == IMAGE_OPERATION_OK)
+        {
+            handler->indexGeneration = handler->sharedIndex.increment();
+        }
+    }
+
+    handler->sharedIndex.unlock();
+    handler->indexMutex.unlock();
+}
+
+/**
+ * Lock the compatibility data against other processes and load the changes
+ * they made. Must be called with compatibilityWriteMutex held, and followed
+ * by end_compatibility_update.
+ */
+static void begin_compatibility_update(ImageHandlerPtr handler)
+{
+    handler->sharedIndex.lock_compatibility();
+
+    uint64_t generation = handler->sharedIndex.compatibility_generation();
+    if (generation != handler->compatibilityGeneration)
+    {
+        std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
+        refresh_compatibility_database(handler->compatibility);
+        handler->subsetCache.clear();
+        handler->compatibilityGeneration = generation;
+    }
+}
+
+/**
+ * Unlock the compatibility data, telling other processes if it was changed.
+ */
+static void end_compatibility_update(ImageHandlerPtr handler, bool changed)
+{
+    if (changed)
+    {
+        handler->compatibilityGeneration = handler->sharedIndex.increment_compatibility();
+    }
+    handler->sharedIndex.unlock_compatibility();
+}
+
+/**
+ * Load the compatibility data again if another process changed it.
+ * Must be called without compatibilityMutex held.
+ */
+static void refresh_compatibility(ImageHandlerPtr handler)
+{
+    if (handler->sharedIndex.compatibility_generation() == handler->compatibilityGeneration)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> writeLock(handler->compatibilityWriteMutex);
+    begin_compatibility_update(handler);
+    end_compatibility_update(handler, false);
+}
+
+/**
+ * Cheap check on the first bytes of a file. An XML document may only have
+ * an UTF-8 BOM and whitespace before its first '<'. Binary images start with
+ * their PN and SHA256, which will almost never match this.
+ */
+static bool looks_like_xml(const unsigned char *data, size_t size)
+{
+    size_t i = 0;
+    if (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF)
+    {
+        i = 3;
+    }
+
+    for (; i < size; i++)
+    {
+        if (data[i] == '<')
+        {
+            return true;
+        }
+
+        if (data[i] != ' ' && data[i] != '\t' && data[i] != '\r' && data[i] != '\n')
+        {
+            return false;
+        }
+    }
+
+    // Empty or whitespace only, let the parser decide
+    return true;
+}
 
 ImageOperationResult check_xml_file(const char *path, bool *isXMLFile)
 {
@@ -38,563 +579,2205 @@ ImageOperationResult check_xml_file(const char *path, bool *isXMLFile)
         return IMAGE_OPERATION_ERROR;
     }
 
-    tinyxml2::XMLDocument doc;
-    *isXMLFile = (doc.LoadFile(path) == tinyxml2::XML_SUCCESS);
+    *isXMLFile = false;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return IMAGE_OPERATION_OK;
+    }
+
+    unsigned char data[XML_SNIFF_SIZE];
+    size_t dataSize = fread(data, 1, XML_SNIFF_SIZE, fp);
+    fclose(fp);
+
+    // Only parse files that may be XML. The file is streamed, so a binary
+    // image is rejected at its first bytes and is never loaded.
+    if (dataSize > 0 && looks_like_xml(data, dataSize))
+    {
+        CompatibilityFileInfo info;
+        *isXMLFile = (read_compatibility_file(path, info, CompatibilitySoftwareCallback()) == IMAGE_OPERATION_OK);
+    }
 
     return IMAGE_OPERATION_OK;
 }
 
-ImageOperationResult check_checksum(const char *path, bool *isValidChecksum)
+static std::string file_name(const std::string &path)
 {
-    if (path == NULL || isValidChecksum == NULL)
+    return path.substr(path.find_last_of("/") + 1);
+}
+
+static ssize_t read_block(int fd, unsigned char *buffer, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t bytesRead = read(fd, buffer + total, size - total);
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead < 0)
+        {
+            return -1;
+        }
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        total += bytesRead;
+    }
+    return total;
+}
+
+/**
+ * Account for bytes processed by an import. Returns false if the import
+ * was cancelled.
+ */
+static bool update_progress(ImportProgress *progress, size_t bytes)
+{
+    if (progress == NULL)
+    {
+        return true;
+    }
+
+    progress->bytesDone += bytes;
+    return !progress->cancelled;
+}
+
+/**
+ * Hash data read from fd, from its current position to the end of the file,
+ * and compare the result with the SHA256 in the image header.
+ */
+static ImageOperationResult verify_data(
+    int fd,
+    const unsigned char *header,
+    bool *isValidChecksum,
+    ImportProgress *progress)
+{
+    gcry_md_hd_t hd;
+    if (gcry_md_open(&hd, GCRY_MD_SHA256, 0) != 0)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
+    unsigned char *block = new unsigned char[CHECKSUM_BLOCK_SIZE];
+    ssize_t bytesRead = 0;
+    bool cancelled = false;
+    while ((bytesRead = read_block(fd, block, CHECKSUM_BLOCK_SIZE)) > 0)
+    {
+        gcry_md_write(hd, block, bytesRead);
+        if (!update_progress(progress, bytesRead))
+        {
+            cancelled = true;
+            break;
+        }
+    }
+    delete[] block;
+
+    if (cancelled || bytesRead < 0)
+    {
+        gcry_md_close(hd);
+        return cancelled ? IMAGE_OPERATION_CANCELLED : IMAGE_OPERATION_ERROR;
+    }
+
+    unsigned char *digest = gcry_md_read(hd, GCRY_MD_SHA256);
+    *isValidChecksum = (memcmp(header + PN_SIZE, digest, SHA256_SIZE) == 0);
+
+    gcry_md_close(hd);
+    return IMAGE_OPERATION_OK;
+}
+
+/**
+ * Verify a binary image file. If the file is a valid image, its header
+ * (PN and SHA256) and the file status before it was hashed are returned.
+ * XML files are not images, so they are ignored.
+ */
+static ImageOperationResult check_image(
+    const char *path,
+    struct stat *st,
+    unsigned char *header,
+    bool *isValidChecksum)
+{
     bool isXMLFile = false;
     if (check_xml_file(path, &isXMLFile) == IMAGE_OPERATION_OK && !isXMLFile)
     {
-        FILE *fp = fopen(path, "rb");
-        if (fp == NULL)
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        if (fstat(fd, st) != 0 || st->st_size <= (PN_SIZE + SHA256_SIZE))
         {
+            close(fd);
             return IMAGE_OPERATION_ERROR;
         }
 
-        fseek(fp, 0, SEEK_END);
-        if (ftell(fp) <= (PN_SIZE + SHA256_SIZE))
+        // Data is read sequentially, so let the kernel read ahead while we hash
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // Read PN and SHA256
+        if (read_block(fd, header, PN_SIZE + SHA256_SIZE) != PN_SIZE + SHA256_SIZE)
         {
-            fclose(fp);
+            close(fd);
             return IMAGE_OPERATION_ERROR;
         }
 
-        fseek(fp, PN_SIZE, SEEK_SET);
+        ImageOperationResult result = verify_data(fd, header, isValidChecksum, NULL);
+        close(fd);
+        return result;
+    }
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult check_checksum(const char *path, bool *isValidChecksum)
+{
+    if (path == NULL || isValidChecksum == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    struct stat st;
+    unsigned char header[PN_SIZE + SHA256_SIZE];
+    return check_image(path, &st, header, isValidChecksum);
+}
+
+static ssize_t write_block(int fd, const unsigned char *buffer, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t bytesWritten = write(fd, buffer + total, size - total);
+        if (bytesWritten < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesWritten <= 0)
+        {
+            return -1;
+        }
+        total += bytesWritten;
+    }
+    return total;
+}
+
+/**
+ * Copy an image from fdOrig to fdDest, hashing the data while it is copied.
+ * The header (PN and SHA256) must have already been read from fdOrig.
+ */
+static ImageOperationResult copy_and_hash(
+    int fdOrig,
+    int fdDest,
+    const unsigned char *header,
+    bool *isValidChecksum,
+    ImportProgress *progress)
+{
+    if (write_block(fdDest, header, PN_SIZE + SHA256_SIZE) < 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    gcry_md_hd_t hd;
+    if (gcry_md_open(&hd, GCRY_MD_SHA256, 0) != 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    unsigned char *block = new unsigned char[COPY_BLOCK_SIZE];
+    ssize_t bytesRead = 0;
+    bool error = false;
+    bool cancelled = false;
+    while ((bytesRead = read_block(fdOrig, block, COPY_BLOCK_SIZE)) > 0)
+    {
+        gcry_md_write(hd, block, bytesRead);
+        if (write_block(fdDest, block, bytesRead) < 0)
+        {
+            error = true;
+            break;
+        }
+
+        if (!update_progress(progress, bytesRead))
+        {
+            cancelled = true;
+            break;
+        }
+    }
+    delete[] block;
+
+    if (cancelled)
+    {
+        gcry_md_close(hd);
+        return IMAGE_OPERATION_CANCELLED;
+    }
+
+    if (error || bytesRead < 0 || fdatasync(fdDest) != 0)
+    {
+        gcry_md_close(hd);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    unsigned char *digest = gcry_md_read(hd, GCRY_MD_SHA256);
+    *isValidChecksum = (memcmp(header + PN_SIZE, digest, SHA256_SIZE) == 0);
+
+    gcry_md_close(hd);
+    return IMAGE_OPERATION_OK;
+}
 
-        // Read SHA256
-        char filesha256[SHA256_SIZE + 1];
-        fread(filesha256, 1, SHA256_SIZE, fp);
-        filesha256[SHA256_SIZE] = '\0';
+/**
+ * Copy size bytes from the start of fdOrig to fdDest without moving data
+ * through user space: the file extents are shared (reflink) if the
+ * filesystem supports it, otherwise copy_file_range is used.
+ * Returns false, leaving fdDest empty, if the kernel can't copy the file or
+ * if the import was cancelled.
+ */
+static bool kernel_copy(int fdOrig, int fdDest, off_t size, ImportProgress *progress)
+{
+#ifdef FICLONE
+    if (ioctl(fdDest, FICLONE, fdOrig) == 0)
+    {
+        return true;
+    }
+#endif
+
+    loff_t offOrig = 0;
+    loff_t offDest = 0;
+    while (offOrig < size)
+    {
+        if (progress != NULL && progress->cancelled)
+        {
+            ftruncate(fdDest, 0);
+            return false;
+        }
+
+        size_t chunkSize = (size - offOrig < KERNEL_COPY_CHUNK_SIZE) ? size - offOrig : KERNEL_COPY_CHUNK_SIZE;
+        ssize_t bytesCopied = copy_file_range(fdOrig, &offOrig, fdDest, &offDest, chunkSize, 0);
+        if (bytesCopied < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesCopied <= 0)
+        {
+            ftruncate(fdDest, 0);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Verify an image that was copied (or linked) to fdDest without going
+ * through copy_and_hash. The copy must be the same image we read the header
+ * from, and its data must match its checksum.
+ */
+static ImageOperationResult verify_copy(
+    int fdDest,
+    const unsigned char *header,
+    off_t size,
+    bool *isValidChecksum,
+    ImportProgress *progress)
+{
+    struct stat st;
+    unsigned char destHeader[PN_SIZE + SHA256_SIZE];
+    if (fstat(fdDest, &st) != 0 || lseek(fdDest, 0, SEEK_SET) != 0 ||
+        read_block(fdDest, destHeader, sizeof(destHeader)) != sizeof(destHeader))
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (st.st_size != size || memcmp(destHeader, header, sizeof(destHeader)) != 0)
+    {
+        *isValidChecksum = false;
+        return IMAGE_OPERATION_OK;
+    }
+
+    posix_fadvise(fdDest, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return verify_data(fdDest, destHeader, isValidChecksum, progress);
+}
+
+/**
+ * Verify images using up to threadCount threads (0 for one per CPU core).
+ */
+static void verify_images(std::vector<PendingImage> &images, unsigned int threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    if (threadCount > images.size())
+    {
+        threadCount = images.size();
+    }
+
+    std::atomic<size_t> nextImage(0);
+    auto worker = [&images, &nextImage]()
+    {
+        size_t i;
+        while ((i = nextImage++) < images.size())
+        {
+            PendingImage &image = images[i];
+            if (check_image(image.filePath.c_str(), &image.st, image.header, &image.isValidChecksum) != IMAGE_OPERATION_OK)
+            {
+                image.isValidChecksum = false;
+            }
+        }
+    };
+
+    if (threadCount <= 1)
+    {
+        worker();
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < threadCount; i++)
+    {
+        workers.push_back(std::thread(worker));
+    }
+
+    for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+        it->join();
+    }
+}
+
+/**
+ * Check if a file name is the one given by import_image to an image with
+ * the given size: <PN>_<size>.bin
+ */
+static bool is_image_file_name(const std::string &fileName, off_t size)
+{
+    std::string suffix = std::string("_") + std::to_string(size) + std::string(".bin");
+    if (fileName.size() != 2 * PN_SIZE + suffix.size())
+    {
+        return false;
+    }
+
+    for (int i = 0; i < 2 * PN_SIZE; i++)
+    {
+        if (!isxdigit((unsigned char)fileName[i]))
+        {
+            return false;
+        }
+    }
+
+    return fileName.compare(2 * PN_SIZE, std::string::npos, suffix) == 0;
+}
+
+/**
+ * Add images verified after they were listed to the manifest, and drop
+ * invalid ones from the image list. Images replaced while they were being
+ * verified are ignored. Must be called with the handler mutex held.
+ */
+static void apply_verified_images(ImageHandlerPtr handler, const std::vector<PendingImage> &images)
+{
+    for (std::vector<PendingImage>::const_iterator it = images.begin(); it != images.end(); ++it)
+    {
+        ImageIndexEntry *entry = handler->images.find(it->partNumber);
+        if (entry == NULL || !(entry->flags & IMAGE_ENTRY_UNVERIFIED) || handler->images.file_name(*entry) != it->fileName)
+        {
+            continue;
+        }
+
+        // The part number in the file name must be the image's
+        if (it->isValidChecksum == true && header_part_number(it->header) == it->partNumber)
+        {
+            entry->flags &= ~IMAGE_ENTRY_UNVERIFIED;
+            fill_manifest_entry(it->st, it->header, set_manifest_entry(handler, it->fileName));
+        }
+        else
+        {
+            handler->images.remove(it->partNumber);
+            handler->imageListGeneration++;
+        }
+    }
+}
+
+/**
+ * Update the image list with a file of the image directory that was added,
+ * changed or removed by someone else. Added files are verified before they
+ * are listed, and listed ones that are gone or no longer valid are dropped.
+ */
+static void update_watched_image(ImageHandlerPtr handler, const std::string &fileName)
+{
+    PendingImage image;
+    image.fileName = fileName;
+    image.filePath = handler->imageDir + std::string("/") + fileName;
+
+    // Imports and removals hold the lock of their part number until the
+    // image list is updated, so changes made by handlers are already listed.
+    // Only they name images <PN>_<size>.bin.
+    std::unique_ptr<PartNumberLock> partNumberLock;
+    bool named = (fileName.size() > PART_NUMBER_DIGITS && fileName[PART_NUMBER_DIGITS] == '_' &&
+                  parse_part_number(fileName.substr(0, PART_NUMBER_DIGITS).c_str(), image.partNumber));
+    if (named)
+    {
+        partNumberLock.reset(new PartNumberLock(handler, image.partNumber));
+    }
+    refresh_image_list(handler);
+
+    bool exists = (stat(image.filePath.c_str(), &image.st) == 0 && S_ISREG(image.st.st_mode));
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        bool listed = (handler->images.find_file(fileName) != NULL);
+        if (!exists && !listed)
+        {
+            return;
+        }
+
+        ImageManifest::iterator verified = handler->manifest.find(fileName);
+        if (exists && listed && verified != handler->manifest.end() && manifest_entry_matches(verified->second, image.st))
+        {
+            return;
+        }
+    }
+
+    if (exists && check_image(image.filePath.c_str(), &image.st, image.header, &image.isValidChecksum) != IMAGE_OPERATION_OK)
+    {
+        image.isValidChecksum = false;
+    }
+
+    uint32_t partNumber = header_part_number(image.header);
+    if (image.isValidChecksum == true && named && partNumber != image.partNumber)
+    {
+        image.isValidChecksum = false;
+    }
+    else if (image.isValidChecksum == true && !named)
+    {
+        partNumberLock.reset(new PartNumberLock(handler, partNumber));
+    }
+
+    begin_image_list_update(handler);
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        const ImageIndexEntry *listed = handler->images.find_file(fileName);
+        if (listed != NULL && (image.isValidChecksum == false || listed->partNumber != partNumber))
+        {
+            handler->images.remove(listed->partNumber);
+            erase_manifest_entry(handler, fileName);
+            handler->imageListGeneration++;
+        }
+
+        if (image.isValidChecksum == true)
+        {
+            const ImageIndexEntry *entry = handler->images.find(partNumber);
+            if (entry != NULL && handler->images.file_name(*entry) != fileName)
+            {
+                erase_manifest_entry(handler, handler->images.file_name(*entry));
+            }
+            handler->images.add(partNumber, fileName, image.st.st_size);
+            fill_manifest_entry(image.st, image.header, set_manifest_entry(handler, fileName));
+            handler->imageListGeneration++;
+        }
+    }
+    end_image_list_update(handler);
+}
+
+/**
+ * Load the compatibility file again if it was replaced by someone else.
+ * Compactions are locked, since they read the store being replaced.
+ */
+static void reload_watched_compatibility(ImageHandlerPtr handler)
+{
+    std::lock_guard<std::mutex> compactionLock(handler->compactionMutex);
+    handler->sharedIndex.lock_compaction();
+    {
+        std::lock_guard<std::mutex> writeLock(handler->compatibilityWriteMutex);
+        begin_compatibility_update(handler);
+        bool changed;
+        {
+            std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
+            changed = compatibility_file_changed(handler->compatibility);
+            if (changed)
+            {
+                refresh_compatibility_database(handler->compatibility);
+                handler->subsetCache.clear();
+            }
+        }
+        end_compatibility_update(handler, changed);
+    }
+    handler->sharedIndex.unlock_compaction();
+}
+
+/**
+ * Check every file of the image directory and of the image list, after
+ * changes were missed.
+ */
+static void rescan_watched_directory(ImageHandlerPtr handler)
+{
+    std::unordered_set<std::string> fileNames;
+    DIR *dr = opendir(handler->imageDir.c_str());
+    if (dr != NULL)
+    {
+        struct dirent *de;
+        while ((de = readdir(dr)) != NULL)
+        {
+            if (de->d_type == DT_REG && de->d_name[0] != '.' && strcmp(de->d_name, COMPATIBILITY_FILE) != 0)
+            {
+                fileNames.insert(de->d_name);
+            }
+        }
+        closedir(dr);
+    }
+
+    refresh_image_list(handler);
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        for (size_t i = 0; i < handler->images.capacity(); i++)
+        {
+            const ImageIndexEntry &entry = handler->images.slot(i);
+            if (entry.flags & IMAGE_ENTRY_USED)
+            {
+                fileNames.insert(handler->images.file_name(entry));
+            }
+        }
+    }
+
+    for (std::unordered_set<std::string>::iterator it = fileNames.begin(); it != fileNames.end(); ++it)
+    {
+        update_watched_image(handler, *it);
+    }
+    reload_watched_compatibility(handler);
+}
+
+/**
+ * Handle a change reported by the watcher of the image directory.
+ */
+static void handle_watched_file(ImageHandlerPtr handler, const std::string &fileName)
+{
+    if (fileName.empty())
+    {
+        rescan_watched_directory(handler);
+    }
+    else if (fileName == COMPATIBILITY_FILE)
+    {
+        reload_watched_compatibility(handler);
+    }
+    else if (fileName[0] != '.')
+    {
+        // Hidden files are internal (e.g. unfinished imports)
+        update_watched_image(handler, fileName);
+    }
+}
+
+ImageOperationResult init_handler_config(ImageHandlerConfig *config)
+{
+    if (config == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    config->root_dir = NULL;
+    config->allow_hardlink = 0;
+    config->scan_threads = 0;
+    config->lazy_verification = 0;
+    config->import_threads = 0;
+    config->subset_cache_size = DEFAULT_SUBSET_CACHE_SIZE;
+    config->compatibility_journal_size = DEFAULT_COMPATIBILITY_JOURNAL_SIZE;
+    config->watch_directory = 0;
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult create_handler(ImageHandlerPtr *handler)
+{
+    return create_handler_with_config(handler, NULL);
+}
+
+/**
+ * Load the image list and compatibility data of a new handler.
+ */
+static ImageOperationResult init_handler(ImageHandlerPtr handler, const ImageHandlerConfig *config)
+{
+    handler->allowHardlink = (config->allow_hardlink != 0);
+    handler->scanThreads = config->scan_threads;
+    handler->lazyVerification = (config->lazy_verification != 0);
+    handler->importThreads = config->import_threads;
+
+    // gcrypt must be initialized before it is used by several threads, and
+    // handlers may be created by several threads
+    static std::once_flag gcryptInitialized;
+    std::call_once(gcryptInitialized, []() {
+        if (!gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P))
+        {
+            gcry_check_version(NULL);
+            gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+            gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+        }
+    });
+
+    if (config->root_dir != NULL)
+    {
+        handler->imageDir = std::string(config->root_dir);
+    }
+    else
+    {
+        const char *home = getenv("HOME");
+        if (home == NULL)
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+        handler->imageDir = std::string(home) + std::string(RELATIVE_IMAGE_DIR);
+    }
+
+    // Create image directory if it does not exist
+    struct stat buffer;
+    if (stat(handler->imageDir.c_str(), &buffer) != 0)
+    {
+        if (mkdir(handler->imageDir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) != 0)
+        {
+            printf("[ERROR] Could create %s directory", handler->imageDir.c_str());
+            return IMAGE_OPERATION_ERROR;
+        }
+    }
+
+    // TODO: Make sure directory has correct permissions
+
+    // The index is returned locked, so other processes don't change the
+    // image list while it's loaded
+    bool first = false;
+    handler->manifestPath = handler->imageDir + std::string("/") + std::string(MANIFEST_FILE);
+    std::string indexPath = handler->imageDir + std::string("/") + std::string(SHARED_INDEX_FILE);
+    if (handler->sharedIndex.open(indexPath, first) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // Compatibility queries are answered from the compatibility store
+    {
+        std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
+        handler->sharedIndex.lock_compatibility();
+        std::string compatibilityPath = handler->imageDir + std::string("/") + std::string(COMPATIBILITY_FILE);
+        std::string storePath = handler->imageDir + std::string("/") + std::string(COMPATIBILITY_STORE_FILE);
+        std::string journalPath = handler->imageDir + std::string("/") + std::string(COMPATIBILITY_JOURNAL_FILE);
+        load_compatibility_database(compatibilityPath, storePath, journalPath, handler->compatibility);
+        handler->subsetCache.clear();
+        handler->subsetCache.set_capacity(config->subset_cache_size);
+        handler->compatibilityJournalSize = config->compatibility_journal_size;
+        handler->compactionScheduled = false;
+        handler->compatibilityGeneration = handler->sharedIndex.compatibility_generation();
+        handler->sharedIndex.unlock_compatibility();
+    }
+
+    // Another process keeps the image list on disk up to date
+    if (!first)
+    {
+        load_image_list(handler);
+        handler->indexGeneration = handler->sharedIndex.generation();
+        handler->sharedIndex.unlock();
+        return IMAGE_OPERATION_OK;
+    }
+
+    // Images that did not change since they were last verified don't need
+    // to be hashed again
+    ImageManifest verifiedImages;
+    load_manifest(handler->manifestPath, verifiedImages, handler->manifestPosition);
+    handler->manifest.clear();
+    handler->manifestChanges.clear();
+    handler->images.clear();
+    bool manifestChanged = false;
+
+    // Load image list from disk. Images that need to be verified are
+    // collected and verified in parallel once the whole directory is read.
+    std::vector<PendingImage> pendingImages;
+    struct dirent *de;
+    DIR *dr = opendir(handler->imageDir.c_str());
+
+    if (dr == NULL)
+    {
+        printf("[ERROR] Could not open %s directory", handler->imageDir.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    while ((de = readdir(dr)) != NULL)
+    {
+        // Hidden files are internal (e.g. unfinished imports), and the
+        // compatibility file is not an image
+        if (de->d_type == DT_REG && de->d_name[0] != '.' && strcmp(de->d_name, COMPATIBILITY_FILE) != 0)
+        {
+            std::string fileName = de->d_name;
+            std::string filePath = handler->imageDir + "/" + fileName;
+
+            struct stat st;
+            if (stat(filePath.c_str(), &st) != 0)
+            {
+                continue;
+            }
+
+            uint32_t partNumber;
+            ImageManifest::iterator it = verifiedImages.find(fileName);
+            if (it != verifiedImages.end() && manifest_entry_matches(it->second, st) &&
+                parse_part_number(it->second.partNumber.c_str(), partNumber))
+            {
+                handler->images.add(partNumber, fileName, st.st_size);
+                handler->manifest[fileName] = it->second;
+                continue;
+            }
+
+            // Images imported by us are listed now and verified when used
+            if (handler->lazyVerification && is_image_file_name(fileName, st.st_size) &&
+                parse_part_number(fileName.substr(0, PART_NUMBER_DIGITS).c_str(), partNumber))
+            {
+                handler->images.add(partNumber, fileName, st.st_size)->flags |= IMAGE_ENTRY_UNVERIFIED;
+                continue;
+            }
+
+            PendingImage image;
+            image.fileName = fileName;
+            image.filePath = filePath;
+            pendingImages.push_back(image);
+        }
+    }
+
+    closedir(dr);
+
+    verify_images(pendingImages, handler->scanThreads);
+
+    for (std::vector<PendingImage>::iterator it = pendingImages.begin(); it != pendingImages.end(); ++it)
+    {
+        if (it->isValidChecksum == true)
+        {
+            handler->images.add(header_part_number(it->header), it->fileName, it->st.st_size);
+            fill_manifest_entry(it->st, it->header, handler->manifest[it->fileName]);
+            manifestChanged = true;
+        }
+    }
+
+    // Processes that open the directory later load the image list built here
+    if (manifestChanged || handler->manifest.size() != verifiedImages.size())
+    {
+        save_manifest(handler->manifestPath, handler->manifest, handler->manifestPosition);
+    }
+    handler->indexGeneration = handler->sharedIndex.increment();
+    handler->sharedIndex.unlock();
+
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult create_handler_with_config(ImageHandlerPtr *handler, const ImageHandlerConfig *config)
+{
+    if (handler == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    ImageHandlerConfig defaultConfig;
+    if (config == NULL)
+    {
+        init_handler_config(&defaultConfig);
+        config = &defaultConfig;
+    }
+
+    if (config->scan_threads < 0 || config->import_threads < 0 || config->subset_cache_size < 0 ||
+        config->compatibility_journal_size < 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // Each handler has its own image directory, image list and caches, so
+    // handlers of different directories never wait for each other
+    ImageHandlerPtr newHandler = new ImageHandler();
+    if (init_handler(newHandler, config) != IMAGE_OPERATION_OK)
+    {
+        delete newHandler;
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (config->watch_directory != 0 &&
+        newHandler->watcher.start(newHandler->imageDir, std::bind(handle_watched_file, newHandler, std::placeholders::_1)) != IMAGE_OPERATION_OK)
+    {
+        delete newHandler;
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    *handler = newHandler;
+    return IMAGE_OPERATION_OK;
+}
+
+/**
+ * Remove the subset directory of a handler and the files in it.
+ */
+static void remove_subset_directory(const std::string &subsetDir)
+{
+    DIR *dr = opendir(subsetDir.c_str());
+    if (dr == NULL)
+    {
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dr)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+        {
+            unlink((subsetDir + "/" + de->d_name).c_str());
+        }
+    }
+    closedir(dr);
+    rmdir(subsetDir.c_str());
+}
+
+/**
+ * Create a temporary file in the image directory. Its name starts with a
+ * dot, so it's never listed as an image.
+ */
+static int create_temp_file(ImageHandlerPtr handler, const char *nameTemplate, std::string &tmpPath)
+{
+    tmpPath = handler->imageDir + std::string("/") + std::string(nameTemplate);
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd >= 0)
+    {
+        fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    return fd;
+}
+
+/**
+ * Write the compatibility journal to the compatibility file. Queries and
+ * imports only wait while the compaction starts and is installed, not while
+ * the new compatibility file is written.
+ * Must be called with the compaction locked in this process and in the
+ * shared index.
+ */
+static ImageOperationResult compact_journal(ImageHandlerPtr handler)
+{
+    CompatibilityCompaction compaction;
+    {
+        std::lock_guard<std::mutex> writeLock(handler->compatibilityWriteMutex);
+        begin_compatibility_update(handler);
+
+        ImageOperationResult result = IMAGE_OPERATION_OK;
+        bool started = false;
+        bool changed;
+        {
+            std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
+            handler->compactionScheduled = false;
+
+            // The compatibility file is copied, so it must be the one the
+            // database has, even if the watcher did not see it replaced yet
+            changed = compatibility_file_changed(handler->compatibility);
+            if (changed)
+            {
+                refresh_compatibility_database(handler->compatibility);
+                handler->subsetCache.clear();
+            }
+
+            if (!handler->compatibility.journalIndex.empty())
+            {
+                result = start_compatibility_compaction(handler->compatibility, compaction);
+                started = (result == IMAGE_OPERATION_OK);
+            }
+        }
+
+        end_compatibility_update(handler, changed);
+        if (!started)
+        {
+            return result;
+        }
+    }
+
+    // Other processes may append to the journal meanwhile, but the
+    // compatibility file is not replaced since they can't compact it
+    if (write_compatibility_compaction(compaction) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    std::lock_guard<std::mutex> writeLock(handler->compatibilityWriteMutex);
+    begin_compatibility_update(handler);
+    ImageOperationResult result;
+    {
+        std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
+        result = finish_compatibility_compaction(handler->compatibility, compaction);
+    }
+    end_compatibility_update(handler, true);
+    return result;
+}
+
+static ImageOperationResult run_compaction(ImageHandlerPtr handler)
+{
+    std::lock_guard<std::mutex> compactionLock(handler->compactionMutex);
+    handler->sharedIndex.lock_compaction();
+    ImageOperationResult result = compact_journal(handler);
+    handler->sharedIndex.unlock_compaction();
+    return result;
+}
+
+ImageOperationResult destroy_handler(ImageHandlerPtr *handler)
+{
+    if (handler == NULL || *handler == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // Finish background imports before the handler goes away, and then the
+    // compaction they may have started
+    ImageHandlerPtr oldHandler = *handler;
+    oldHandler->watcher.stop();
+    delete oldHandler->importPool;
+    oldHandler->importPool = NULL;
+    delete oldHandler->compactionPool;
+    oldHandler->compactionPool = NULL;
+
+    // The last handler of the directory writes the changes still in the
+    // compatibility journal to the compatibility file, so the file is up to
+    // date while the directory is not used
+    if (oldHandler->sharedIndex.is_last())
+    {
+        run_compaction(oldHandler);
+    }
+
+    if (!oldHandler->subsetDir.empty())
+    {
+        remove_subset_directory(oldHandler->subsetDir);
+    }
+
+    delete oldHandler;
+    *handler = NULL;
+    return IMAGE_OPERATION_OK;
+}
+
+/**
+ * Compact the compatibility journal in the background once it's too big.
+ * Must be called with compatibilityMutex held.
+ */
+static void schedule_compaction(ImageHandlerPtr handler)
+{
+    if (handler->compactionScheduled || handler->compatibility.journalIndex.empty() ||
+        handler->compatibility.journalSize <= handler->compatibilityJournalSize)
+    {
+        return;
+    }
+
+    if (handler->compactionPool == NULL)
+    {
+        handler->compactionPool = new WorkerPool(1);
+    }
+
+    handler->compactionScheduled = true;
+    handler->compactionPool->submit(std::bind(run_compaction, handler));
+}
+
+/**
+ * Merge compatibility files into the local compatibility file.
+ * The result of each file is returned in results, the function fails only if
+ * the local compatibility file can't be updated.
+ */
+static ImageOperationResult import_compatibility_files(
+    ImageHandlerPtr handler,
+    const std::vector<std::string> &paths,
+    std::vector<ImageOperationResult> &results)
+{
+    // Only the imported files are parsed. The local entries come from the
+    // compatibility store, which is only read, so queries are answered
+    // while the files are merged.
+    std::lock_guard<std::mutex> writeLock(handler->compatibilityWriteMutex);
+    begin_compatibility_update(handler);
+    CompatibilityMerge merge;
+    if (write_compatibility_merge(handler->compatibility, paths, results, merge) != IMAGE_OPERATION_OK)
+    {
+        end_compatibility_update(handler, false);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    ImageOperationResult result;
+    {
+        std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
+        result = apply_compatibility_merge(handler->compatibility, merge);
+        handler->subsetCache.clear();
+        schedule_compaction(handler);
+    }
+    end_compatibility_update(handler, true);
+    return result;
+}
+
+/**
+ * Move a verified image to its final name and add it to the image list,
+ * replacing any other image with the same part number. Images with other
+ * part numbers are published in parallel, in this process and in the others
+ * using the image directory.
+ */
+static ImageOperationResult publish_image(
+    ImageHandlerPtr handler,
+    const std::string &importedPath,
+    const unsigned char *header,
+    off_t size,
+    uint32_t &partNumber)
+{
+    uint32_t imagePartNumber = header_part_number(header);
+    std::string destName = image_file_name(imagePartNumber, size);
+    std::string destPath = handler->imageDir + std::string("/") + destName;
+
+    PartNumberLock partNumberLock(handler, imagePartNumber);
+    if (rename(importedPath.c_str(), destPath.c_str()) != 0)
+    {
+        unlink(importedPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    struct stat destSt;
+    bool hasStat = (stat(destPath.c_str(), &destSt) == 0);
+
+    std::string oldPath;
+    begin_image_list_update(handler);
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        const ImageIndexEntry *entry = handler->images.find(imagePartNumber);
+        if (entry != NULL && handler->images.file_name(*entry) != destName)
+        {
+            // There is already an image with the same part number and a different path name, so we need to delete it.
+            oldPath = image_path(handler, *entry);
+            erase_manifest_entry(handler, handler->images.file_name(*entry));
+        }
+
+        handler->images.add(imagePartNumber, destName, size);
+        handler->imageListGeneration++;
+        if (hasStat)
+        {
+            fill_manifest_entry(destSt, header, set_manifest_entry(handler, destName));
+        }
+    }
+    end_image_list_update(handler);
+
+    if (!oldPath.empty())
+    {
+        unlink(oldPath.c_str());
+    }
+
+    partNumber = imagePartNumber;
+    return IMAGE_OPERATION_OK;
+}
+
+/**
+ * Import an image or a compatibility file. This is the work done by both
+ * import_image and import_image_async.
+ */
+static ImageOperationResult import_image_file(
+    ImageHandlerPtr handler,
+    const char *path,
+    uint32_t &partNumber,
+    ImportProgress *progress)
+{
+    bool isXMLFile = false;
+    if (check_xml_file(path, &isXMLFile) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (isXMLFile == true)
+    {
+        std::vector<std::string> paths(1, std::string(path));
+        std::vector<ImageOperationResult> results;
+        if (import_compatibility_files(handler, paths, results) != IMAGE_OPERATION_OK ||
+            results[0] != IMAGE_OPERATION_OK)
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        partNumber = COMPATIBILITY_PART_NUMBER;
+    }
+    else
+    {
+        int fdOrig = open(path, O_RDONLY);
+        if (fdOrig < 0)
+        {
+            printf("[ERROR] Could not open %s file", path);
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        struct stat st;
+        if (fstat(fdOrig, &st) != 0 || st.st_size <= (PN_SIZE + SHA256_SIZE))
+        {
+            close(fdOrig);
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        posix_fadvise(fdOrig, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (progress != NULL)
+        {
+            progress->bytesTotal = st.st_size - PN_SIZE - SHA256_SIZE;
+        }
+
+        unsigned char header[PN_SIZE + SHA256_SIZE];
+        if (read_block(fdOrig, header, sizeof(header)) != sizeof(header))
+        {
+            close(fdOrig);
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        // The copy goes to a temporary file that is only renamed to its
+        // final name if the checksum matches.
+        std::string tmpPath;
+        int fdDest = create_temp_file(handler, TMP_IMAGE_TEMPLATE, tmpPath);
+        if (fdDest < 0)
+        {
+            close(fdOrig);
+            return IMAGE_OPERATION_ERROR;
+        }
+
+        // Use the cheapest transport available. Images linked or copied by
+        // the kernel are verified afterwards, otherwise data is hashed while
+        // it is copied.
+        bool isValidChecksum = false;
+        ImageOperationResult result = IMAGE_OPERATION_ERROR;
+        std::string importedPath = tmpPath;
+        std::string linkPath = tmpPath + std::string(".link");
+        if (handler->allowHardlink && link(path, linkPath.c_str()) == 0)
+        {
+            importedPath = linkPath;
+            int fdLink = open(linkPath.c_str(), O_RDONLY);
+            if (fdLink >= 0)
+            {
+                result = verify_copy(fdLink, header, st.st_size, &isValidChecksum, progress);
+                close(fdLink);
+            }
+        }
+        else if (kernel_copy(fdOrig, fdDest, st.st_size, progress))
+        {
+            result = verify_copy(fdDest, header, st.st_size, &isValidChecksum, progress);
+            if (result == IMAGE_OPERATION_OK && fdatasync(fdDest) != 0)
+            {
+                result = IMAGE_OPERATION_ERROR;
+            }
+        }
+        else
+        {
+            result = copy_and_hash(fdOrig, fdDest, header, &isValidChecksum, progress);
+        }
+
+        close(fdOrig);
+        if (close(fdDest) != 0)
+        {
+            result = IMAGE_OPERATION_ERROR;
+        }
+
+        if (importedPath != tmpPath)
+        {
+            unlink(tmpPath.c_str());
+        }
+
+        if (result != IMAGE_OPERATION_OK || isValidChecksum == false)
+        {
+            unlink(importedPath.c_str());
+            return (result == IMAGE_OPERATION_CANCELLED) ? IMAGE_OPERATION_CANCELLED : IMAGE_OPERATION_ERROR;
+        }
+
+        if (publish_image(handler, importedPath, header, st.st_size, partNumber) != IMAGE_OPERATION_OK)
+        {
+            return IMAGE_OPERATION_ERROR;
+        }
+    }
+
+    if (progress != NULL)
+    {
+        progress->bytesDone = progress->bytesTotal.load();
+    }
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult import_image(ImageHandlerPtr handler, const char *path, char **part_number)
+{
+    if (handler == NULL || path == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    uint32_t partNumber;
+    if (import_image_file(handler, path, partNumber, NULL) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (part_number != NULL)
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        *part_number = NULL;
+        if (partNumber == COMPATIBILITY_PART_NUMBER || handler->images.find(partNumber) != NULL)
+        {
+            *part_number = (char *)part_number_name(handler, partNumber);
+            if (*part_number == NULL)
+            {
+                return IMAGE_OPERATION_ERROR;
+            }
+        }
+    }
+
+    return IMAGE_OPERATION_OK;
+}
+
+/**
+ * Block of data passed between the stages of a batch import.
+ */
+struct ImportBlock
+{
+    enum Type
+    {
+        BEGIN, // Header of an image was read
+        DATA,  // Data of an image
+        END,   // Image was read (or failed to be read)
+        STOP   // No more images
+    };
+
+    Type type;
+    size_t index;
+    unsigned char *data;
+    ssize_t size;
+    bool failed;
+    bool isValidChecksum;
+};
+
+/**
+ * Image imported by import_images.
+ */
+struct BatchImage
+{
+    size_t index;
+    std::string path;
+    off_t size;
+    unsigned char header[PN_SIZE + SHA256_SIZE];
+};
+
+static ImportBlock import_block(ImportBlock::Type type, size_t index)
+{
+    ImportBlock block;
+    block.type = type;
+    block.index = index;
+    block.data = NULL;
+    block.size = 0;
+    block.failed = false;
+    block.isValidChecksum = false;
+    return block;
+}
+
+/**
+ * First stage of a batch import: read images, one after the other, into
+ * free buffers.
+ */
+static void read_batch_images(
+    std::vector<BatchImage> &images,
+    BlockingQueue<unsigned char *> &freeBuffers,
+    BlockingQueue<ImportBlock> &readBlocks)
+{
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        BatchImage &image = images[i];
+        ImportBlock end = import_block(ImportBlock::END, i);
+
+        int fd = open(image.path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            printf("[ERROR] Could not open %s file", image.path.c_str());
+            end.failed = true;
+            readBlocks.push(end);
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= (PN_SIZE + SHA256_SIZE) ||
+            read_block(fd, image.header, sizeof(image.header)) != sizeof(image.header))
+        {
+            close(fd);
+            end.failed = true;
+            readBlocks.push(end);
+            continue;
+        }
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        image.size = st.st_size;
+        readBlocks.push(import_block(ImportBlock::BEGIN, i));
+
+        ssize_t bytesRead = 0;
+        do
+        {
+            unsigned char *buffer = freeBuffers.pop();
+            bytesRead = read_block(fd, buffer, COPY_BLOCK_SIZE);
+            if (bytesRead <= 0)
+            {
+                freeBuffers.push(buffer);
+                break;
+            }
+
+            ImportBlock data = import_block(ImportBlock::DATA, i);
+            data.data = buffer;
+            data.size = bytesRead;
+            readBlocks.push(data);
+        } while (bytesRead == COPY_BLOCK_SIZE);
+
+        close(fd);
+        end.failed = (bytesRead < 0);
+        readBlocks.push(end);
+    }
+
+    readBlocks.push(import_block(ImportBlock::STOP, 0));
+}
+
+/**
+ * Second stage of a batch import: hash the data read and pass it on to be
+ * written. The checksum result goes with the END block of each image.
+ */
+static void hash_batch_images(
+    std::vector<BatchImage> &images,
+    BlockingQueue<ImportBlock> &readBlocks,
+    BlockingQueue<ImportBlock> &hashedBlocks)
+{
+    gcry_md_hd_t hd = NULL;
+    while (true)
+    {
+        ImportBlock block = readBlocks.pop();
+        if (block.type == ImportBlock::BEGIN)
+        {
+            if (gcry_md_open(&hd, GCRY_MD_SHA256, 0) != 0)
+            {
+                hd = NULL;
+            }
+        }
+        else if (block.type == ImportBlock::DATA)
+        {
+            if (hd != NULL)
+            {
+                gcry_md_write(hd, block.data, block.size);
+            }
+        }
+        else if (block.type == ImportBlock::END)
+        {
+            if (hd != NULL)
+            {
+                unsigned char *digest = gcry_md_read(hd, GCRY_MD_SHA256);
+                block.isValidChecksum = (memcmp(images[block.index].header + PN_SIZE, digest, SHA256_SIZE) == 0);
+                gcry_md_close(hd);
+                hd = NULL;
+            }
+        }
+
+        hashedBlocks.push(block);
+        if (block.type == ImportBlock::STOP)
+        {
+            break;
+        }
+    }
+}
+
+ImageOperationResult import_images(
+    ImageHandlerPtr handler,
+    const char **paths,
+    int count,
+    ImageImportResult *results)
+{
+    if (handler == NULL || count < 0 || (count > 0 && (paths == NULL || results == NULL)))
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    std::vector<BatchImage> images;
+    std::vector<std::string> xmlPaths;
+    std::vector<size_t> xmlIndexes;
+    for (int i = 0; i < count; i++)
+    {
+        results[i].result = IMAGE_OPERATION_ERROR;
+        results[i].part_number = NULL;
+
+        bool isXMLFile = false;
+        if (paths[i] == NULL || check_xml_file(paths[i], &isXMLFile) != IMAGE_OPERATION_OK)
+        {
+            continue;
+        }
+
+        if (isXMLFile)
+        {
+            xmlPaths.push_back(paths[i]);
+            xmlIndexes.push_back(i);
+        }
+        else
+        {
+            BatchImage image;
+            image.index = i;
+            image.path = paths[i];
+            image.size = 0;
+            images.push_back(image);
+        }
+    }
+
+    // Images go through three stages running at the same time: reading,
+    // hashing and writing. The number of buffers bounds the memory used and
+    // stalls the reader when the writer falls behind.
+    std::vector<std::vector<unsigned char>> buffers(IMPORT_PIPELINE_BUFFERS, std::vector<unsigned char>(COPY_BLOCK_SIZE));
+    BlockingQueue<unsigned char *> freeBuffers;
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        freeBuffers.push(buffers[i].data());
+    }
+
+    BlockingQueue<ImportBlock> readBlocks;
+    BlockingQueue<ImportBlock> hashedBlocks;
+    std::thread reader(read_batch_images, std::ref(images), std::ref(freeBuffers), std::ref(readBlocks));
+    std::thread hasher(hash_batch_images, std::ref(images), std::ref(readBlocks), std::ref(hashedBlocks));
+
+    std::vector<uint32_t> partNumbers(count, COMPATIBILITY_PART_NUMBER);
+    int fdDest = -1;
+    bool writeError = false;
+    std::string tmpPath;
+    while (true)
+    {
+        ImportBlock block = hashedBlocks.pop();
+        if (block.type == ImportBlock::STOP)
+        {
+            break;
+        }
+
+        BatchImage &image = images[block.index];
+        if (block.type == ImportBlock::BEGIN)
+        {
+            fdDest = create_temp_file(handler, TMP_IMAGE_TEMPLATE, tmpPath);
+            writeError = (fdDest < 0 || write_block(fdDest, image.header, sizeof(image.header)) < 0);
+        }
+        else if (block.type == ImportBlock::DATA)
+        {
+            if (!writeError && write_block(fdDest, block.data, block.size) < 0)
+            {
+                writeError = true;
+            }
+            freeBuffers.push(block.data);
+        }
+        else if (fdDest >= 0)
+        {
+            if (fdatasync(fdDest) != 0 || close(fdDest) != 0)
+            {
+                writeError = true;
+            }
+            fdDest = -1;
+
+            if (writeError || block.failed || !block.isValidChecksum)
+            {
+                unlink(tmpPath.c_str());
+            }
+            else if (publish_image(handler, tmpPath, image.header, image.size, partNumbers[image.index]) == IMAGE_OPERATION_OK)
+            {
+                results[image.index].result = IMAGE_OPERATION_OK;
+            }
+        }
+    }
+
+    reader.join();
+    hasher.join();
+
+    std::vector<ImageOperationResult> xmlResults;
+    import_compatibility_files(handler, xmlPaths, xmlResults);
+
+    std::lock_guard<std::mutex> lock(handler->mutex);
+
+    for (size_t i = 0; i < xmlIndexes.size(); i++)
+    {
+        results[xmlIndexes[i]].result = xmlResults[i];
+    }
+
+    ImageOperationResult result = IMAGE_OPERATION_OK;
+    for (int i = 0; i < count; i++)
+    {
+        results[i].part_number = NULL;
+        if (results[i].result == IMAGE_OPERATION_OK &&
+            (partNumbers[i] == COMPATIBILITY_PART_NUMBER || handler->images.find(partNumbers[i]) != NULL))
+        {
+            results[i].part_number = part_number_name(handler, partNumbers[i]);
+            if (results[i].part_number == NULL)
+            {
+                results[i].result = IMAGE_OPERATION_ERROR;
+            }
+        }
+
+        if (results[i].result != IMAGE_OPERATION_OK)
+        {
+            result = IMAGE_OPERATION_ERROR;
+        }
+    }
+
+    return result;
+}
+
+static void release_import_operation(ImageImportOperationPtr operation)
+{
+    if (--operation->references == 0)
+    {
+        delete operation;
+    }
+}
+
+static void run_import_operation(ImageHandlerPtr handler, ImageImportOperationPtr operation)
+{
+    uint32_t partNumber = COMPATIBILITY_PART_NUMBER;
+    ImageOperationResult result = IMAGE_OPERATION_CANCELLED;
+    if (!operation->progress.cancelled)
+    {
+        result = import_image_file(handler, operation->path.c_str(), partNumber, &operation->progress);
+    }
+
+    const char *partNumberName = NULL;
+    if (result == IMAGE_OPERATION_OK)
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        partNumberName = part_number_name(handler, partNumber);
+        if (partNumberName == NULL)
+        {
+            result = IMAGE_OPERATION_ERROR;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(operation->mutex);
+        operation->result = result;
+        operation->partNumber = partNumberName;
+        operation->done = true;
+    }
+    operation->finished.notify_all();
+
+    if (operation->callback != NULL)
+    {
+        operation->callback(operation, result, partNumberName, operation->userData);
+    }
+
+    release_import_operation(operation);
+}
+
+ImageOperationResult import_image_async(
+    ImageHandlerPtr handler,
+    const char *path,
+    ImageImportCallback callback,
+    void *user_data,
+    ImageImportOperationPtr *operation)
+{
+    if (handler == NULL || path == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    ImageImportOperationPtr newOperation = new ImageImportOperation();
+    newOperation->path = path;
+    newOperation->callback = callback;
+    newOperation->userData = user_data;
+    newOperation->references = (operation != NULL) ? 2 : 1;
+
+    {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        if (handler->importPool == NULL)
+        {
+            handler->importPool = new WorkerPool(handler->importThreads);
+        }
+        handler->importPool->submit(std::bind(run_import_operation, handler, newOperation));
+    }
+
+    if (operation != NULL)
+    {
+        *operation = newOperation;
+    }
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult get_import_progress(
+    ImageImportOperationPtr operation,
+    unsigned long long *bytes_done,
+    unsigned long long *bytes_total,
+    int *done)
+{
+    if (operation == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (bytes_done != NULL)
+    {
+        *bytes_done = operation->progress.bytesDone;
+    }
+
+    if (bytes_total != NULL)
+    {
+        *bytes_total = operation->progress.bytesTotal;
+    }
+
+    if (done != NULL)
+    {
+        std::lock_guard<std::mutex> lock(operation->mutex);
+        *done = operation->done ? 1 : 0;
+    }
+
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult wait_import(
+    ImageImportOperationPtr operation,
+    ImageOperationResult *result,
+    const char **part_number)
+{
+    if (operation == NULL || result == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
 
-        // Read data
-        fseek(fp, 0, SEEK_END);
-        size_t dataSize = ftell(fp) - PN_SIZE - SHA256_SIZE;
-        fseek(fp, PN_SIZE + SHA256_SIZE, SEEK_SET);
-        char *data = new char[dataSize];
-        fread(data, 1, dataSize, fp);
+    std::unique_lock<std::mutex> lock(operation->mutex);
+    while (!operation->done)
+    {
+        operation->finished.wait(lock);
+    }
 
-        gcry_md_hd_t hd;
-        gcry_md_open(&hd, GCRY_MD_SHA256, 0);
-        gcry_md_write(hd, data, dataSize);
-        unsigned char *digest = gcry_md_read(hd, GCRY_MD_SHA256);
+    *result = operation->result;
+    if (part_number != NULL)
+    {
+        *part_number = operation->partNumber;
+    }
 
-        *isValidChecksum = (memcmp(filesha256, digest, SHA256_SIZE) == 0);
+    return IMAGE_OPERATION_OK;
+}
 
-        delete[] data;
-        fclose(fp);
+ImageOperationResult cancel_import(ImageImportOperationPtr operation)
+{
+    if (operation == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
     }
+
+    operation->progress.cancelled = true;
     return IMAGE_OPERATION_OK;
 }
 
-ImageOperationResult create_handler(ImageHandlerPtr *handler)
+ImageOperationResult release_import(ImageImportOperationPtr *operation)
 {
-    if (handler == NULL)
+    if (operation == NULL || *operation == NULL)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
-    *handler = &singletonHandler;
-
-    singletonHandler.imageDir = std::string(getenv("HOME")) + std::string(RELATIVE_IMAGE_DIR);
+    release_import_operation(*operation);
+    *operation = NULL;
+    return IMAGE_OPERATION_OK;
+}
 
-    // Create image directory if it does not exist
-    struct stat buffer;
-    if (stat(singletonHandler.imageDir.c_str(), &buffer) != 0)
+ImageOperationResult remove_image(ImageHandlerPtr handler, const char *part_number)
+{
+    if (handler == NULL || part_number == NULL)
     {
-        if (mkdir(singletonHandler.imageDir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) != 0)
-        {
-            printf("[ERROR] Could create %s directory", singletonHandler.imageDir.c_str());
-            return IMAGE_OPERATION_ERROR;
-        }
+        return IMAGE_OPERATION_ERROR;
     }
 
-    // TODO: Make sure directory has correct permissions
-
-    // Load image list from disk
-    struct dirent *de;
-    DIR *dr = opendir(singletonHandler.imageDir.c_str());
+    // Nice try, but I won't let you remove the compatibility file for now.
+    if (strcmp(part_number, COMPATIBILITY_FILE_PN) == 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
 
-    if (dr == NULL)
+    uint32_t partNumber;
+    if (!parse_part_number(part_number, partNumber))
     {
-        printf("[ERROR] Could not open %s directory", singletonHandler.imageDir.c_str());
         return IMAGE_OPERATION_ERROR;
     }
 
-    while ((de = readdir(dr)) != NULL)
+    // Imports of the same part number wait, others go on
+    PartNumberLock partNumberLock(handler, partNumber);
+
+    begin_image_list_update(handler);
+    std::string path;
     {
-        if (de->d_type == DT_REG)
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        const ImageIndexEntry *entry = handler->images.find(partNumber);
+        if (entry != NULL)
         {
-            std::string fileName = de->d_name;
-            std::string baseName = fileName.substr(0, fileName.find_last_of("."));
-            baseName = fileName.substr(0, fileName.find_first_of("_"));
-            std::string filePath = singletonHandler.imageDir + "/" + fileName;
-
-            bool isValidChecksum = false;
-            if (check_checksum(filePath.c_str(), &isValidChecksum) == IMAGE_OPERATION_OK && isValidChecksum == true)
-            {
-                singletonHandler.image_map[baseName] = filePath;
-            }
+            path = image_path(handler, *entry);
         }
     }
 
-    closedir(dr);
-    return IMAGE_OPERATION_OK;
-}
-
-ImageOperationResult destroy_handler(ImageHandlerPtr *handler)
-{
-    if (handler == NULL)
+    if (path.empty() || unlink(path.c_str()) != 0)
     {
+        end_image_list_update(handler);
         return IMAGE_OPERATION_ERROR;
     }
 
-    if (singletonHandler.images != NULL)
     {
-        for (int i = 0; i < singletonHandler.get_list_size; i++)
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        erase_manifest_entry(handler, file_name(path));
+        handler->images.remove(partNumber);
+        handler->imageListGeneration++;
+    }
+    end_image_list_update(handler);
+
+    // The PN is removed from the compatibility file too. It only costs a
+    // journal record, and a failure does not bring the image back.
+    char hex[PART_NUMBER_DIGITS + 1];
+    format_part_number(partNumber, hex);
+    std::lock_guard<std::mutex> writeLock(handler->compatibilityWriteMutex);
+    begin_compatibility_update(handler);
+    bool removed;
+    {
+        std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
+        removed = (remove_compatibility_software(handler->compatibility, hex) == IMAGE_OPERATION_OK);
+        if (removed)
         {
-            free(singletonHandler.images[i]);
+            handler->subsetCache.clear();
+            schedule_compaction(handler);
         }
-
-        free(singletonHandler.images);
-        singletonHandler.images = NULL;
     }
+    end_compatibility_update(handler, removed);
 
-    *handler = NULL;
     return IMAGE_OPERATION_OK;
 }
 
-ImageOperationResult import_image(ImageHandlerPtr handler, const char *path, char **part_number)
+ImageOperationResult get_images(
+    ImageHandlerPtr handler,
+    char **part_numbers[],
+    int *list_size)
 {
-    if (handler == NULL || path == NULL)
+    if (handler == NULL || part_numbers == NULL || list_size == NULL)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
-    bool isXMLFile = false;
-    if (check_xml_file(path, &isXMLFile) != IMAGE_OPERATION_OK)
-    {
-        return IMAGE_OPERATION_ERROR;
-    }
+    refresh_image_list(handler);
 
-    if (isXMLFile == true)
+    std::lock_guard<std::mutex> lock(handler->mutex);
+    if (!handler->imageList || handler->imageList->generation != handler->imageListGeneration)
     {
-        FILE *fpOrig = fopen(path, "r");
-        std::string destFile = singletonHandler.imageDir + std::string("/") + std::string(COMPATIBILITY_FILE);
-        FILE *fpDest = fopen(destFile.c_str(), "a+");
-        fseek(fpDest, 0, SEEK_END);
-        bool firstTime = (ftell(fpDest) == 0);
-        fseek(fpDest, 0, SEEK_SET);
-        if (fpOrig == NULL || fpDest == NULL)
-        {
-            return IMAGE_OPERATION_ERROR;
-        }
-
-        if (firstTime)
+        std::unique_ptr<ImageListSnapshot> imageList(new ImageListSnapshot());
+        imageList->generation = handler->imageListGeneration;
+        imageList->partNumbers.reserve(handler->images.size());
+        for (size_t i = 0; i < handler->images.capacity(); i++)
         {
-            // TODO: Copy file needs to be a function
-            fseek(fpOrig, 0, SEEK_SET);
-            char buffer[1024];
-            size_t bytesRead = 0;
-            while ((bytesRead = fread(buffer, 1, 1024, fpOrig)) > 0)
+            const ImageIndexEntry &entry = handler->images.slot(i);
+            if (!(entry.flags & IMAGE_ENTRY_USED) || entry.partNumber == COMPATIBILITY_PART_NUMBER)
             {
-                fwrite(buffer, 1, bytesRead, fpDest);
+                continue;
             }
-        }
-        else
-        {
-            // If it's not the first time, we need to update the existing file
 
-            tinyxml2::XMLDocument docOrig;
-            tinyxml2::XMLDocument docDest;
-            if (docOrig.LoadFile(fpOrig) != tinyxml2::XML_SUCCESS || docDest.LoadFile(fpDest) != tinyxml2::XML_SUCCESS)
+            const char *name = part_number_name(handler, entry.partNumber);
+            if (name == NULL)
             {
-                fclose(fpOrig);
-                fclose(fpDest);
                 return IMAGE_OPERATION_ERROR;
             }
+            imageList->partNumbers.push_back((char *)name);
+        }
+        handler->previousImageList = std::move(handler->imageList);
+        handler->imageList = std::move(imageList);
+    }
 
-            tinyxml2::XMLElement *rootOrig = docOrig.RootElement();
-            tinyxml2::XMLElement *rootDest = docDest.RootElement();
-            if (rootOrig == NULL || rootDest == NULL)
-            {
-                fclose(fpOrig);
-                fclose(fpDest);
-                return IMAGE_OPERATION_ERROR;
-            }
+    *list_size = handler->imageList->partNumbers.size();
+    *part_numbers = (*list_size > 0) ? handler->imageList->partNumbers.data() : NULL;
+    return IMAGE_OPERATION_OK;
+}
 
-            tinyxml2::XMLElement *softElemOrig = rootOrig->FirstChildElement("SOFTWARE");
+ImageOperationResult get_images_generation(ImageHandlerPtr handler, unsigned long long *generation)
+{
+    if (handler == NULL || generation == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
 
-            if (softElemOrig == NULL)
-            {
-                fclose(fpOrig);
-                fclose(fpDest);
-                return IMAGE_OPERATION_ERROR;
-            }
+    refresh_image_list(handler);
 
-            bool error = false;
-            for (; softElemOrig; softElemOrig = softElemOrig->NextSiblingElement())
-            {
-                const char *pnOrig = softElemOrig->Attribute("PN");
-                if (pnOrig == NULL)
-                {
-                    error = true;
-                    break;
-                }
-
-                tinyxml2::XMLElement *softElemDest = rootDest->FirstChildElement("SOFTWARE");
-                if (softElemDest == NULL)
-                {
-                    error = true;
-                    break;
-                }
-
-                // Check if part number already exists and replace it if it does
-                for (; softElemDest; softElemDest = softElemDest->NextSiblingElement())
-                {
-                    const char *pnDest = softElemDest->Attribute("PN");
-                    if (pnDest == NULL)
-                    {
-                        error = true;
-                        break;
-                    }
-
-                    if (strcmp(pnOrig, pnDest) == 0)
-                    {
-                        // Delete current element to add a new one
-                        rootDest->DeleteChild(softElemDest);
-                        break;
-                    }
-                }
-
-                // Add new element
-                tinyxml2::XMLNode *newNode = softElemOrig->DeepClone(&docDest);
-                rootDest->InsertEndChild(newNode);
-                // tinyxml2::XMLPrinter printer(stdout);
-                // docDest.Print(&printer);
-            }
+    std::lock_guard<std::mutex> lock(handler->mutex);
+    *generation = handler->imageListGeneration;
+    return IMAGE_OPERATION_OK;
+}
 
-            if (error)
+/**
+ * Get an image path as returned to callers. The string is kept until the
+ * image is replaced by a file with another name or is no longer listed.
+ * Must be called with the handler mutex held.
+ */
+static const char *image_path_name(ImageHandlerPtr handler, uint32_t partNumber, const std::string &path)
+{
+    // Paths of images removed since they were returned are dropped once
+    // there are too many, so they take memory in proportion to the image
+    // list and not to every image ever returned
+    size_t limit = IMAGE_PATHS_SWEEP_FACTOR * (handler->images.size() + 1);
+    if (handler->imagePaths.size() >= limit)
+    {
+        std::unordered_map<uint32_t, std::string>::iterator it = handler->imagePaths.begin();
+        while (it != handler->imagePaths.end())
+        {
+            if (it->first != partNumber && handler->images.find(it->first) == NULL)
             {
-                fclose(fpOrig);
-                fclose(fpDest);
-                return IMAGE_OPERATION_ERROR;
+                it = handler->imagePaths.erase(it);
             }
-
-            // If we save directly to the file, we'll duplicate the XML content.
-            // Instead, we'll save to a temporary file and then copy it over the original file.
-            //
-            // TODO: There's probably a better way to do this
-            std::string tmpDest = std::string("/tmp/") + std::string(COMPATIBILITY_FILE);
-            docDest.SaveFile(tmpDest.c_str());
-
-            // Now copy the temporary file over the original file - TODO: this needs to be a function !
-            fclose(fpDest);
-            fpDest = fopen(destFile.c_str(), "w");
-            if (fpDest == NULL)
+            else
             {
-                fclose(fpOrig);
-                return IMAGE_OPERATION_ERROR;
+                ++it;
             }
+        }
+    }
 
-            FILE *fpTmp = fopen(tmpDest.c_str(), "r");
-            if (fpTmp == NULL)
-            {
-                fclose(fpOrig);
-                fclose(fpDest);
-                return IMAGE_OPERATION_ERROR;
-            }
+    std::string &name = handler->imagePaths[partNumber];
+    if (name != path)
+    {
+        name = path;
+    }
+    return name.c_str();
+}
 
-            fseek(fpTmp, 0, SEEK_SET);
-            char buffer[1024];
-            size_t bytesRead = 0;
-            while ((bytesRead = fread(buffer, 1, 1024, fpTmp)) > 0)
-            {
-                fwrite(buffer, 1, bytesRead, fpDest);
-            }
+ImageOperationResult get_image_path(ImageHandlerPtr handler, const char *part_number, char **path)
+{
+    if (handler == NULL || part_number == NULL || path == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
 
-            fclose(fpTmp);
-        }
+    refresh_image_list(handler);
 
-        fclose(fpOrig);
-        fclose(fpDest);
-        // handler->image_map[COMPATIBILITY_FILE_PN] = destFile;
+    uint32_t partNumber;
+    if (!parse_part_number(part_number, partNumber))
+    {
+        *path = NULL;
+        return IMAGE_OPERATION_ERROR;
+    }
 
-        if (part_number != NULL)
-        {
-            *part_number = (char *)(COMPATIBILITY_FILE_PN);
-        }
+    std::unique_lock<std::mutex> lock(handler->mutex);
+    const ImageIndexEntry *entry = handler->images.find(partNumber);
+    if (entry != NULL && (entry->flags & IMAGE_ENTRY_UNVERIFIED))
+    {
+        std::vector<PendingImage> images(1);
+        images[0].fileName = handler->images.file_name(*entry);
+        images[0].filePath = image_path(handler, *entry);
+        images[0].partNumber = partNumber;
+
+        lock.unlock();
+        verify_images(images, 1);
+
+        begin_image_list_update(handler);
+        lock.lock();
+        apply_verified_images(handler, images);
+        lock.unlock();
+        end_image_list_update(handler);
+
+        lock.lock();
+        entry = handler->images.find(partNumber);
     }
-    else
+
+    if (entry == NULL)
     {
-        bool isValidChecksum = false;
-        if (check_checksum(path, &isValidChecksum) != IMAGE_OPERATION_OK ||
-            isValidChecksum == false)
-        {
-            return IMAGE_OPERATION_ERROR;
-        }
+        *path = NULL;
+        return IMAGE_OPERATION_ERROR;
+    }
 
-        FILE *fpOrig = fopen(path, "rb");
-        if (fpOrig == NULL)
-        {
-            printf("[ERROR] Could not open %s file", path);
-            return IMAGE_OPERATION_ERROR;
-        }
+    *path = (char *)image_path_name(handler, partNumber, image_path(handler, *entry));
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult verify_pending_images(ImageHandlerPtr handler)
+{
+    if (handler == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
 
-        fseek(fpOrig, 0, SEEK_SET);
-        unsigned char pn[PN_SIZE];
-        fread(pn, 1, PN_SIZE, fpOrig);
+    refresh_image_list(handler);
 
-        std::string pnStr;
-        for (int i = 0; i < PN_SIZE; i++)
+    std::vector<PendingImage> images;
+    std::unique_lock<std::mutex> lock(handler->mutex);
+    for (size_t i = 0; i < handler->images.capacity(); i++)
+    {
+        const ImageIndexEntry &entry = handler->images.slot(i);
+        if (entry.flags & IMAGE_ENTRY_UNVERIFIED)
         {
-            // TO HEX STRING
-            char hex[3];
-            sprintf(hex, "%02X", pn[i]);
-            pnStr = pnStr + hex;
+            PendingImage image;
+            image.fileName = handler->images.file_name(entry);
+            image.filePath = image_path(handler, entry);
+            image.partNumber = entry.partNumber;
+            images.push_back(image);
         }
+    }
 
-        size_t fileSize = 0;
-        fseek(fpOrig, 0, SEEK_END);
-        fileSize = ftell(fpOrig);
-        fseek(fpOrig, 0, SEEK_SET);
-
-        std::string destPath = singletonHandler.imageDir + std::string("/") + pnStr + std::string("_") + std::to_string(fileSize) + std::string(".bin");
+    // Images are verified without holding the lock
+    lock.unlock();
+    verify_images(images, handler->scanThreads);
 
-        // Copy file
-        fseek(fpOrig, 0, SEEK_SET);
-        char buffer[1024];
-        FILE *fpDest = fopen(destPath.c_str(), "wb");
-        if (fpDest == NULL)
-        {
-            fclose(fpOrig);
-            return IMAGE_OPERATION_ERROR;
-        }
+    begin_image_list_update(handler);
+    lock.lock();
+    apply_verified_images(handler, images);
+    lock.unlock();
+    end_image_list_update(handler);
 
-        size_t bytesRead = 0;
-        while ((bytesRead = fread(buffer, 1, 1024, fpOrig)) > 0)
-        {
-            fwrite(buffer, 1, bytesRead, fpDest);
-        }
+    return IMAGE_OPERATION_OK;
+}
 
-        fclose(fpOrig);
-        fclose(fpDest);
+/**
+ * Build the compatibility document with the entries matching a PN list, or
+ * get it from the cache if it was already built.
+ */
+static ImageOperationResult build_compatibility_subset(
+    ImageHandlerPtr handler,
+    char **part_numbers,
+    int list_size,
+    std::shared_ptr<const std::string> &content)
+{
+    if (handler == NULL || part_numbers == NULL || list_size <= 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
 
-        isValidChecksum = false;
-        if (check_checksum(destPath.c_str(), &isValidChecksum) != IMAGE_OPERATION_OK ||
-            isValidChecksum == false)
-        {
-            unlink(destPath.c_str());
-            return IMAGE_OPERATION_ERROR;
-        }
+    refresh_compatibility(handler);
+    std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
 
-        if (handler->image_map.find(pnStr) != handler->image_map.end() && handler->image_map[pnStr] != destPath)
-        {
-            // There is already an image with the same part number and a different path name, so we need to delete it.
-            unlink(handler->image_map[pnStr].c_str());
-        }
-
-        handler->image_map[pnStr] = destPath;
+    const CompatibilityDatabase &database = handler->compatibility;
+    if (!database.valid || database.softwareCount == 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
 
-        if (part_number != NULL)
-        {
-            std::unordered_map<std::string, std::string>::iterator it = handler->image_map.find(pnStr);
-            *part_number = (char *)(it->first.c_str());
-        }
+    std::string key = CompatibilityCache::make_key(part_numbers, list_size);
+    content = handler->subsetCache.find(key);
+    if (content)
+    {
+        return IMAGE_OPERATION_OK;
     }
 
+    // Keep the entries that match the PN list, in file order
+    std::vector<uint32_t> softwares;
+    select_compatibility_softwares(database, part_numbers, list_size, softwares);
+
+    tinyxml2::XMLPrinter printer;
+    if (print_compatibility_subset(database, softwares, printer) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+    content = std::make_shared<const std::string>(printer.CStr(), printer.CStrSize() - 1);
+    handler->subsetCache.insert(key, content);
     return IMAGE_OPERATION_OK;
 }
 
-ImageOperationResult remove_image(ImageHandlerPtr handler, const char *part_number)
+/**
+ * Write a compatibility subset to the subset directory of the handler. Files
+ * are named by their content, so a subset is only written once and a path
+ * returned before is never overwritten with something else, while the
+ * handler or other handlers of the directory write their own subsets.
+ */
+static ImageOperationResult write_compatibility_subset(
+    ImageHandlerPtr handler,
+    const std::string &content,
+    std::string &path)
 {
-    if (handler == NULL || part_number == NULL)
+    std::string subsetDir;
     {
-        return IMAGE_OPERATION_ERROR;
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        if (handler->subsetDir.empty())
+        {
+            std::string dir = handler->imageDir + "/" SUBSET_DIR_TEMPLATE;
+            if (mkdtemp(&dir[0]) == NULL)
+            {
+                return IMAGE_OPERATION_ERROR;
+            }
+            chmod(dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+            handler->subsetDir = dir;
+        }
+        subsetDir = handler->subsetDir;
     }
 
-    // Nice try, but I won't let you remove the compatibility file for now.
-    if (strcmp(part_number, COMPATIBILITY_FILE_PN) == 0)
+    unsigned char digest[SHA256_SIZE];
+    gcry_md_hash_buffer(GCRY_MD_SHA256, digest, content.data(), content.size());
+    char name[sizeof(SUBSET_FILE_PREFIX) + 2 * SUBSET_NAME_DIGEST_SIZE + sizeof(".xml")];
+    size_t length = snprintf(name, sizeof(name), "%s", SUBSET_FILE_PREFIX);
+    for (size_t i = 0; i < SUBSET_NAME_DIGEST_SIZE; i++)
     {
-        return IMAGE_OPERATION_ERROR;
+        length += snprintf(name + length, sizeof(name) - length, "%02x", digest[i]);
     }
+    snprintf(name + length, sizeof(name) - length, ".xml");
+    path = subsetDir + "/" + name;
 
-    // for (std::unordered_map<std::string, std::string>::iterator it = handler->image_map.begin(); it != handler->image_map.end(); ++it)
-    // {
-    //     std::cout << it->first << " => " << it->second << '\n';
-    // }
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+    {
+        return IMAGE_OPERATION_OK;
+    }
 
-    if (unlink(handler->image_map[part_number].c_str()) != 0)
+    // Written to a temporary file first, so the file is never seen partially
+    // written when the same subset is written by two calls at once
+    std::string tmpPath = subsetDir + "/" TMP_IMAGE_TEMPLATE;
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0)
     {
         return IMAGE_OPERATION_ERROR;
     }
+    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
-    handler->image_map.erase(part_number);
-
-    // TODO: We could remove the PN from the compatibility file if it exists
-    //       but it is not necessary because if this image is re-added it will
-    //       override the existing entry in the compatibility file.
+    bool error = (write_block(fd, (const unsigned char *)content.data(), content.size()) < 0);
+    if (close(fd) != 0 || error || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
 
     return IMAGE_OPERATION_OK;
 }
 
-ImageOperationResult get_images(
-    ImageHandlerPtr handler,
-    char **part_numbers[],
-    int *list_size)
+/**
+ * Get the path of a compatibility file written for a caller, as returned to
+ * callers. Only the last SUBSET_FILES_KEPT files are kept, the oldest one
+ * is removed with its path. Must be called with the handler mutex held.
+ *
+ * @return path, NULL if the file was removed since it was written.
+ */
+static const char *subset_path_name(ImageHandlerPtr handler, const std::string &path)
 {
-    if (handler == NULL || list_size == NULL)
+    // Files are only removed with the mutex held, so it's still there once
+    // it's moved to the end
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
     {
-        return IMAGE_OPERATION_ERROR;
+        return NULL;
     }
 
-    if (handler->images != NULL)
+    std::list<std::string> &paths = handler->subsetPaths;
+    for (std::list<std::string>::iterator it = paths.begin(); it != paths.end(); ++it)
     {
-        for (int i = 0; i < handler->get_list_size; i++)
+        if (*it == path)
         {
-            free(handler->images[i]);
+            paths.splice(paths.end(), paths, it);
+            return paths.back().c_str();
         }
+    }
 
-        free(handler->images);
-        handler->images = NULL;
+    paths.push_back(path);
+    if (paths.size() > SUBSET_FILES_KEPT)
+    {
+        unlink(paths.front().c_str());
+        paths.pop_front();
+    }
+    return paths.back().c_str();
+}
+
+ImageOperationResult get_compatibility_path(
+    ImageHandlerPtr handler,
+    char **part_numbers,
+    int list_size,
+    char **path)
+{
+    std::shared_ptr<const std::string> content;
+    if (path == NULL || build_compatibility_subset(handler, part_numbers, list_size, content) != IMAGE_OPERATION_OK)
+    {
+        return IMAGE_OPERATION_ERROR;
     }
 
-    handler->get_list_size = handler->image_map.size();
-    handler->images = (char **)malloc(sizeof(char *) * handler->get_list_size);
-    int i = 0;
-    for (std::unordered_map<std::string, std::string>::iterator it = handler->image_map.begin();
-         it != handler->image_map.end(); ++it)
+    // The file is written again if other calls removed it in the meantime
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        if (it->first.compare(COMPATIBILITY_FILE_PN) == 0)
+        std::string subsetPath;
+        if (write_compatibility_subset(handler, *content, subsetPath) != IMAGE_OPERATION_OK)
         {
-            continue;
+            return IMAGE_OPERATION_ERROR;
         }
 
-        handler->images[i++] = strdup(it->first.c_str());
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        *path = (char *)subset_path_name(handler, subsetPath);
+        if (*path != NULL)
+        {
+            return IMAGE_OPERATION_OK;
+        }
     }
-
-    *list_size = handler->get_list_size;
-    *part_numbers = handler->images;
-    return IMAGE_OPERATION_OK;
+    return IMAGE_OPERATION_ERROR;
 }
 
-ImageOperationResult get_image_path(ImageHandlerPtr handler, const char *part_number, char **path)
+ImageOperationResult get_compatibility_buffer(
+    ImageHandlerPtr handler,
+    char **part_numbers,
+    int list_size,
+    char **buffer,
+    size_t *size)
 {
-    if (handler == NULL || part_number == NULL || path == NULL)
+    std::shared_ptr<const std::string> content;
+    if (buffer == NULL || size == NULL ||
+        build_compatibility_subset(handler, part_numbers, list_size, content) != IMAGE_OPERATION_OK)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
-    std::string partNumberStr = std::string(part_number);
-    std::unordered_map<std::string, std::string>::iterator it = handler->image_map.find(partNumberStr);
-    if (it == handler->image_map.end())
+    *buffer = (char *)malloc(content->size() + 1);
+    if (*buffer == NULL)
     {
-        *path = NULL;
         return IMAGE_OPERATION_ERROR;
     }
 
-    *path = (char *)(it->second.c_str());
-
+    memcpy(*buffer, content->c_str(), content->size() + 1);
+    *size = content->size();
     return IMAGE_OPERATION_OK;
 }
 
-ImageOperationResult get_compatibility_path(
+ImageOperationResult write_compatibility(
     ImageHandlerPtr handler,
     char **part_numbers,
     int list_size,
-    char **path)
+    int fd)
 {
-    if (handler == NULL || part_numbers == NULL || list_size == 0)
+    std::shared_ptr<const std::string> content;
+    if (fd < 0 || build_compatibility_subset(handler, part_numbers, list_size, content) != IMAGE_OPERATION_OK)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
-    // TODO: We'll copy all and remove the ones that don't match the PN list
-    //       but we could also just copy the ones that match the PN list (and that looks better)
-
-    // Copy compatibility file to temp directory
-    std::string xmlPath = singletonHandler.imageDir + std::string("/") + COMPATIBILITY_FILE;
-    FILE *fpOrig = fopen(xmlPath.c_str(), "rb");
-    FILE *fpDest = fopen(CUSTOM_COMPATIBILITY_FILE, "wb");
-
-    if (fpOrig == NULL || fpDest == NULL)
+    if (write_block(fd, (const unsigned char *)content->data(), content->size()) < 0)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
-    fseek(fpOrig, 0, SEEK_SET);
-    char buffer[1024];
-    size_t bytesRead = 0;
-    while ((bytesRead = fread(buffer, 1, 1024, fpOrig)) > 0)
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult get_compatible_softwares(
+    ImageHandlerPtr handler,
+    const char *lru,
+    char **part_numbers[],
+    int *list_size)
+{
+    if (handler == NULL || lru == NULL || part_numbers == NULL || list_size == NULL)
     {
-        fwrite(buffer, 1, bytesRead, fpDest);
+        return IMAGE_OPERATION_ERROR;
     }
 
-    fclose(fpOrig);
-    fclose(fpDest);
+    refresh_compatibility(handler);
+    std::lock_guard<std::mutex> compatibilityLock(handler->compatibilityMutex);
 
-    // Remove all PN that are not in the list
-    tinyxml2::XMLDocument doc;
-    if (doc.LoadFile(CUSTOM_COMPATIBILITY_FILE) != tinyxml2::XML_SUCCESS)
+    const CompatibilityDatabase &database = handler->compatibility;
+    if (!database.valid)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
-    tinyxml2::XMLElement *root = doc.RootElement();
-    if (root == NULL)
+    std::vector<uint32_t> softwares;
+    select_compatible_softwares(database, lru, softwares);
+    *part_numbers = NULL;
+    *list_size = 0;
+    if (softwares.empty())
     {
-        return IMAGE_OPERATION_ERROR;
+        return IMAGE_OPERATION_OK;
     }
 
-    tinyxml2::XMLElement *softElem = root->FirstChildElement("SOFTWARE");
-    if (softElem == NULL)
+    // The list is given to the caller, it's not kept in the string arena
+    // since it's built for each query. Pointers first, then the part numbers
+    // they point to.
+    size_t size = sizeof(char *) * softwares.size();
+    for (size_t i = 0; i < softwares.size(); i++)
     {
-        return IMAGE_OPERATION_ERROR;
+        size += strlen(compatibility_part_number(database, softwares[i])) + 1;
     }
 
-    bool error = false;
-    while(softElem)
+    char **list = (char **)malloc(size);
+    if (list == NULL)
     {
-        const char *pn = softElem->Attribute("PN");
-        if (pn == NULL)
-        {
-            error = true;
-            break;
-        }
+        return IMAGE_OPERATION_ERROR;
+    }
 
-        bool found = false;
-        for (int i = 0; i < list_size; i++)
-        {
-            if (strcmp(pn, part_numbers[i]) == 0)
-            {
-                found = true;
-                break;
-            }
-        }
-        if (!found)
-        {
-            root->DeleteChild(softElem);
-            softElem = root->FirstChildElement("SOFTWARE");
-        }
-        else
-        {
-            softElem = softElem->NextSiblingElement();
-        }
+    char *next = (char *)(list + softwares.size());
+    for (size_t i = 0; i < softwares.size(); i++)
+    {
+        const char *partNumber = compatibility_part_number(database, softwares[i]);
+        size_t length = strlen(partNumber) + 1;
+        memcpy(next, partNumber, length);
+        list[i] = next;
+        next += length;
     }
 
-    if (error)
+    *part_numbers = list;
+    *list_size = softwares.size();
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult compact_compatibility(ImageHandlerPtr handler)
+{
+    if (handler == NULL)
     {
         return IMAGE_OPERATION_ERROR;
     }
 
-    doc.SaveFile(CUSTOM_COMPATIBILITY_FILE);
-    *path = (char *)(CUSTOM_COMPATIBILITY_FILE);
-    return IMAGE_OPERATION_OK;
-}
\ No newline at end of file
+    return run_compaction(handler);
+}
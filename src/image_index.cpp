@@ -0,0 +1,287 @@
+#include <string.h>
+
+#include <utility>
+
+#include "image_index.h"
+
+#define INITIAL_CAPACITY_BITS 4
+
+// Slots not found
+#define NO_SLOT SIZE_MAX
+
+void format_part_number(uint32_t partNumber, char *hex)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    for (int i = PART_NUMBER_DIGITS - 1; i >= 0; i--)
+    {
+        hex[i] = digits[partNumber & 0x0F];
+        partNumber >>= 4;
+    }
+    hex[PART_NUMBER_DIGITS] = '\0';
+}
+
+bool parse_part_number(const char *hex, uint32_t &partNumber)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < PART_NUMBER_DIGITS; i++)
+    {
+        char c = hex[i];
+        if (c >= '0' && c <= '9')
+        {
+            value = (value << 4) | (uint32_t)(c - '0');
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            value = (value << 4) | (uint32_t)(c - 'A' + 10);
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            value = (value << 4) | (uint32_t)(c - 'a' + 10);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    if (hex[PART_NUMBER_DIGITS] != '\0')
+    {
+        return false;
+    }
+
+    partNumber = value;
+    return true;
+}
+
+std::string image_file_name(uint32_t partNumber, uint64_t size)
+{
+    char hex[PART_NUMBER_DIGITS + 1];
+    format_part_number(partNumber, hex);
+    return std::string(hex) + std::string("_") + std::to_string(size) + std::string(".bin");
+}
+
+/**
+ * Get the part number of a file named as import_image names images.
+ */
+static bool parse_image_file_name(const std::string &fileName, uint32_t &partNumber)
+{
+    if (fileName.size() <= PART_NUMBER_DIGITS || fileName[PART_NUMBER_DIGITS] != '_')
+    {
+        return false;
+    }
+
+    return parse_part_number(fileName.substr(0, PART_NUMBER_DIGITS).c_str(), partNumber);
+}
+
+ImageIndex::ImageIndex() : count(0), shift(64 - INITIAL_CAPACITY_BITS)
+{
+}
+
+size_t ImageIndex::size() const
+{
+    return count;
+}
+
+size_t ImageIndex::home(uint32_t partNumber) const
+{
+    // Fibonacci hashing, part numbers are often consecutive
+    return (size_t)(((uint64_t)partNumber * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+size_t ImageIndex::find_slot(uint32_t partNumber) const
+{
+    if (slots.empty())
+    {
+        return NO_SLOT;
+    }
+
+    size_t mask = slots.size() - 1;
+    for (size_t i = home(partNumber);; i = (i + 1) & mask)
+    {
+        if (!(slots[i].flags & IMAGE_ENTRY_USED))
+        {
+            return NO_SLOT;
+        }
+        if (slots[i].partNumber == partNumber)
+        {
+            return i;
+        }
+    }
+}
+
+ImageIndexEntry *ImageIndex::find(uint32_t partNumber)
+{
+    size_t i = find_slot(partNumber);
+    return (i != NO_SLOT) ? &slots[i] : NULL;
+}
+
+const ImageIndexEntry *ImageIndex::find(uint32_t partNumber) const
+{
+    size_t i = find_slot(partNumber);
+    return (i != NO_SLOT) ? &slots[i] : NULL;
+}
+
+const ImageIndexEntry *ImageIndex::find_file(const std::string &fileName) const
+{
+    uint32_t partNumber;
+    if (parse_image_file_name(fileName, partNumber))
+    {
+        const ImageIndexEntry *entry = find(partNumber);
+        if (entry != NULL && file_name(*entry) == fileName)
+        {
+            return entry;
+        }
+    }
+
+    // Other names are rare
+    for (std::unordered_map<uint32_t, std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+    {
+        if (it->second == fileName)
+        {
+            return find(it->first);
+        }
+    }
+    return NULL;
+}
+
+void ImageIndex::grow()
+{
+    std::vector<ImageIndexEntry> oldSlots;
+    oldSlots.swap(slots);
+
+    size_t capacity = oldSlots.empty() ? ((size_t)1 << INITIAL_CAPACITY_BITS) : 2 * oldSlots.size();
+    shift = 64;
+    for (size_t i = capacity; i > 1; i >>= 1)
+    {
+        shift--;
+    }
+
+    ImageIndexEntry empty;
+    memset(&empty, 0, sizeof(empty));
+    slots.assign(capacity, empty);
+
+    size_t mask = capacity - 1;
+    for (std::vector<ImageIndexEntry>::iterator it = oldSlots.begin(); it != oldSlots.end(); ++it)
+    {
+        if (it->flags & IMAGE_ENTRY_USED)
+        {
+            size_t i = home(it->partNumber);
+            while (slots[i].flags & IMAGE_ENTRY_USED)
+            {
+                i = (i + 1) & mask;
+            }
+            slots[i] = *it;
+        }
+    }
+}
+
+ImageIndexEntry *ImageIndex::add(uint32_t partNumber, const std::string &fileName, uint64_t size)
+{
+    size_t i = find_slot(partNumber);
+    if (i == NO_SLOT)
+    {
+        // Load factor is kept below 3/4
+        if (4 * (count + 1) > 3 * slots.size())
+        {
+            grow();
+        }
+
+        size_t mask = slots.size() - 1;
+        i = home(partNumber);
+        while (slots[i].flags & IMAGE_ENTRY_USED)
+        {
+            i = (i + 1) & mask;
+        }
+        count++;
+    }
+
+    ImageIndexEntry &entry = slots[i];
+    entry.partNumber = partNumber;
+    entry.flags = IMAGE_ENTRY_USED;
+    entry.size = size;
+    if (fileName == image_file_name(partNumber, size))
+    {
+        names.erase(partNumber);
+    }
+    else
+    {
+        entry.flags |= IMAGE_ENTRY_NAMED;
+        names[partNumber] = fileName;
+    }
+    return &entry;
+}
+
+bool ImageIndex::remove(uint32_t partNumber)
+{
+    size_t i = find_slot(partNumber);
+    if (i == NO_SLOT)
+    {
+        return false;
+    }
+
+    if (slots[i].flags & IMAGE_ENTRY_NAMED)
+    {
+        names.erase(partNumber);
+    }
+
+    // Entries after it are moved back, so lookups never need tombstones
+    size_t mask = slots.size() - 1;
+    for (size_t j = (i + 1) & mask; slots[j].flags & IMAGE_ENTRY_USED; j = (j + 1) & mask)
+    {
+        size_t k = home(slots[j].partNumber);
+        bool inPlace = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!inPlace)
+        {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    memset(&slots[i], 0, sizeof(slots[i]));
+    count--;
+    return true;
+}
+
+std::string ImageIndex::file_name(const ImageIndexEntry &entry) const
+{
+    if (entry.flags & IMAGE_ENTRY_NAMED)
+    {
+        std::unordered_map<uint32_t, std::string>::const_iterator it = names.find(entry.partNumber);
+        if (it != names.end())
+        {
+            return it->second;
+        }
+    }
+    return image_file_name(entry.partNumber, entry.size);
+}
+
+void ImageIndex::clear()
+{
+    slots.clear();
+    names.clear();
+    count = 0;
+    shift = 64 - INITIAL_CAPACITY_BITS;
+}
+
+void ImageIndex::swap(ImageIndex &other)
+{
+    slots.swap(other.slots);
+    names.swap(other.names);
+    std::swap(count, other.count);
+    std::swap(shift, other.shift);
+}
+
+size_t ImageIndex::capacity() const
+{
+    return slots.size();
+}
+
+const ImageIndexEntry &ImageIndex::slot(size_t i) const
+{
+    return slots[i];
+}
+
+ImageIndexEntry &ImageIndex::slot(size_t i)
+{
+    return slots[i];
+}
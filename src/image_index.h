@@ -0,0 +1,150 @@
+#ifndef IMAGE_INDEX_H
+#define IMAGE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Number of hex digits of a part number, as the API uses them
+#define PART_NUMBER_DIGITS 8
+
+// Flags of an ImageIndexEntry
+#define IMAGE_ENTRY_USED 0x1
+#define IMAGE_ENTRY_UNVERIFIED 0x2
+#define IMAGE_ENTRY_NAMED 0x4
+
+/**
+ * @brief An image of the image list. Its file name is the one given by
+ * import_image, <PN>_<size>.bin, unless IMAGE_ENTRY_NAMED is set.
+ */
+struct ImageIndexEntry
+{
+    uint32_t partNumber;
+    uint32_t flags;
+    uint64_t size;
+};
+
+/**
+ * Write a part number as the API returns it: 8 upper case hex digits.
+ *
+ * @param[in] partNumber part number.
+ * @param[out] hex PART_NUMBER_DIGITS digits and a terminating '\0'.
+ */
+void format_part_number(uint32_t partNumber, char *hex);
+
+/**
+ * Read a part number given to the API. Digits may be in any case.
+ *
+ * @param[in] hex part number as PART_NUMBER_DIGITS hex digits.
+ * @param[out] partNumber part number.
+ * @return true if hex is a part number.
+ */
+bool parse_part_number(const char *hex, uint32_t &partNumber);
+
+/**
+ * Get the file name import_image gives to an image.
+ *
+ * @param[in] partNumber image part number.
+ * @param[in] size image size.
+ * @return file name, <PN>_<size>.bin.
+ */
+std::string image_file_name(uint32_t partNumber, uint64_t size);
+
+/**
+ * @brief Image list indexed by part number. Entries are kept in a single
+ * array with open addressing, so a lookup usually reads one cache line, and
+ * only the file names that can't be derived from the part number and size
+ * are stored as strings.
+ * Entry pointers are only valid until the next add or remove.
+ */
+class ImageIndex
+{
+public:
+    ImageIndex();
+
+    /**
+     * Get the number of images.
+     */
+    size_t size() const;
+
+    /**
+     * Find the image of a part number.
+     *
+     * @param[in] partNumber part number.
+     * @return image entry, NULL if there is none.
+     */
+    ImageIndexEntry *find(uint32_t partNumber);
+    const ImageIndexEntry *find(uint32_t partNumber) const;
+
+    /**
+     * Find the image of a file.
+     *
+     * @param[in] fileName file name in the image directory.
+     * @return image entry, NULL if the file is not listed.
+     */
+    const ImageIndexEntry *find_file(const std::string &fileName) const;
+
+    /**
+     * Add an image, replacing the image of the same part number if any.
+     *
+     * @param[in] partNumber image part number.
+     * @param[in] fileName file name in the image directory.
+     * @param[in] size image size.
+     * @return the new entry, with only IMAGE_ENTRY_USED and
+     * IMAGE_ENTRY_NAMED set.
+     */
+    ImageIndexEntry *add(uint32_t partNumber, const std::string &fileName, uint64_t size);
+
+    /**
+     * Remove the image of a part number.
+     *
+     * @param[in] partNumber part number.
+     * @return true if there was one.
+     */
+    bool remove(uint32_t partNumber);
+
+    /**
+     * Get the file name of an image.
+     *
+     * @param[in] entry image entry.
+     * @return file name in the image directory.
+     */
+    std::string file_name(const ImageIndexEntry &entry) const;
+
+    /**
+     * Remove every image.
+     */
+    void clear();
+
+    void swap(ImageIndex &other);
+
+    /**
+     * Get the number of slots, to go through every image with slot.
+     */
+    size_t capacity() const;
+
+    /**
+     * Get a slot of the array. It's an image if IMAGE_ENTRY_USED is set.
+     *
+     * @param[in] i slot index, below capacity.
+     */
+    const ImageIndexEntry &slot(size_t i) const;
+    ImageIndexEntry &slot(size_t i);
+
+private:
+    size_t home(uint32_t partNumber) const;
+    size_t find_slot(uint32_t partNumber) const;
+    void grow();
+
+    std::vector<ImageIndexEntry> slots;
+    size_t count;
+    unsigned int shift;
+
+    // File names of the images not named as import_image names them
+    std::unordered_map<uint32_t, std::string> names;
+};
+
+#endif // IMAGE_INDEX_H
@@ -0,0 +1,337 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image_manifest.h"
+
+#define MANIFEST_HEADER "IMAGE_MANIFEST 1"
+#define MANIFEST_LOG_HEADER "IMAGE_MANIFEST_LOG 1"
+
+#define PN_SIZE 4
+#define SHA256_SIZE 32
+
+static std::string to_hex(const unsigned char *data, size_t size)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    std::string hex(size * 2, '0');
+    for (size_t i = 0; i < size; i++)
+    {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0x0F];
+    }
+    return hex;
+}
+
+/**
+ * Parse an entry line: PN SIZE MTIME_SEC MTIME_NSEC INODE SHA256 FILE_NAME
+ */
+static bool parse_entry(const char *line, std::string &fileName, ManifestEntry &entry)
+{
+    char pn[2 * PN_SIZE + 1];
+    char digest[2 * SHA256_SIZE + 1];
+    long long size = 0;
+    long long mtimeSec = 0;
+    long mtimeNsec = 0;
+    unsigned long long inode = 0;
+    int nameOffset = 0;
+    if (sscanf(line, "%8s %lld %lld %ld %llu %64s %n",
+               pn, &size, &mtimeSec, &mtimeNsec, &inode, digest, &nameOffset) != 6 ||
+        nameOffset == 0)
+    {
+        return false;
+    }
+
+    fileName = std::string(line + nameOffset);
+    fileName = fileName.substr(0, fileName.find_last_not_of("\n") + 1);
+    if (fileName.empty())
+    {
+        return false;
+    }
+
+    entry.partNumber = pn;
+    entry.digest = digest;
+    entry.size = size;
+    entry.mtimeSec = mtimeSec;
+    entry.mtimeNsec = mtimeNsec;
+    entry.inode = inode;
+    return true;
+}
+
+static void print_entry(FILE *fp, const std::string &fileName, const ManifestEntry &entry)
+{
+    fprintf(fp, "%s %lld %lld %ld %llu %s %s\n",
+            entry.partNumber.c_str(),
+            (long long)entry.size,
+            (long long)entry.mtimeSec,
+            entry.mtimeNsec,
+            (unsigned long long)entry.inode,
+            entry.digest.c_str(),
+            fileName.c_str());
+}
+
+/**
+ * Read the log of a manifest from an offset, if it was written for the
+ * manifest at the position. Reading stops at the first incomplete line,
+ * which is what a crash while appending leaves.
+ */
+static ImageOperationResult read_log(
+    const std::string &path,
+    ManifestPosition &position,
+    const ManifestLogCallback &callback)
+{
+    std::string logPath = path + std::string(MANIFEST_LOG_SUFFIX);
+    FILE *fp = fopen(logPath.c_str(), "r");
+    if (fp == NULL)
+    {
+        // Nothing was appended yet, unless the log was dropped
+        return (position.logSize == 0) ? IMAGE_OPERATION_OK : IMAGE_OPERATION_ERROR;
+    }
+
+    // The header has the manifest the changes are appended to. A log left
+    // by a crash after the manifest was saved again has the old one.
+    char line[PATH_MAX + 256];
+    unsigned long long baseInode = 0;
+    unsigned long long baseSize = 0;
+    if (fgets(line, sizeof(line), fp) == NULL || strlen(line) == 0 || line[strlen(line) - 1] != '\n' ||
+        sscanf(line, MANIFEST_LOG_HEADER " %llu %llu", &baseInode, &baseSize) != 2 ||
+        baseInode != (unsigned long long)position.baseInode || baseSize != position.baseSize)
+    {
+        fclose(fp);
+        return (position.logSize == 0) ? IMAGE_OPERATION_OK : IMAGE_OPERATION_ERROR;
+    }
+
+    uint64_t size = strlen(line);
+    if (position.logSize > size)
+    {
+        size = position.logSize;
+        if (fseek(fp, size, SEEK_SET) != 0)
+        {
+            fclose(fp);
+            return IMAGE_OPERATION_ERROR;
+        }
+    }
+
+    // Each line is "+ " followed by an entry, or "- " followed by the name
+    // of a removed file
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        // A line starting with a NUL byte is garbage left by a crash, like
+        // an incomplete one
+        size_t length = strlen(line);
+        if (length == 0 || line[length - 1] != '\n')
+        {
+            break;
+        }
+
+        ManifestChange change;
+        if (strncmp(line, "+ ", 2) == 0 && parse_entry(line + 2, change.fileName, change.entry))
+        {
+            change.removed = false;
+        }
+        else if (strncmp(line, "- ", 2) == 0 && length > 3)
+        {
+            change.fileName.assign(line + 2, length - 3);
+            change.removed = true;
+        }
+        else
+        {
+            break;
+        }
+
+        callback(change);
+        size += length;
+    }
+
+    position.logSize = size;
+    fclose(fp);
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult load_manifest(const std::string &path, ImageManifest &manifest, ManifestPosition &position)
+{
+    manifest.clear();
+    position = ManifestPosition();
+
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp != NULL)
+    {
+        struct stat st;
+        char line[PATH_MAX + 256];
+        if (fstat(fileno(fp), &st) == 0 &&
+            fgets(line, sizeof(line), fp) != NULL &&
+            strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) == 0)
+        {
+            position.baseInode = st.st_ino;
+            position.baseSize = st.st_size;
+            while (fgets(line, sizeof(line), fp) != NULL)
+            {
+                std::string fileName;
+                ManifestEntry entry;
+                if (parse_entry(line, fileName, entry))
+                {
+                    manifest[fileName] = entry;
+                }
+            }
+        }
+        // Otherwise it's an unknown format, images will be verified again
+        fclose(fp);
+    }
+
+    read_log(path, position, [&manifest](const ManifestChange &change) {
+        if (change.removed)
+        {
+            manifest.erase(change.fileName);
+        }
+        else
+        {
+            manifest[change.fileName] = change.entry;
+        }
+    });
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult read_manifest_log(
+    const std::string &path,
+    ManifestPosition &position,
+    const ManifestLogCallback &callback)
+{
+    // A manifest saved again is a new file
+    struct stat st;
+    bool exists = (stat(path.c_str(), &st) == 0);
+    ino_t baseInode = exists ? st.st_ino : 0;
+    uint64_t baseSize = exists ? st.st_size : 0;
+    if (baseInode != position.baseInode || baseSize != position.baseSize)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    return read_log(path, position, callback);
+}
+
+/**
+ * Sync the directory of a file, so a rename in it is on disk.
+ */
+static bool sync_directory(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    std::string directory = (slash == std::string::npos) ? std::string(".") : path.substr(0, slash + 1);
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool synced = (fsync(fd) == 0);
+    close(fd);
+    return synced;
+}
+
+ImageOperationResult save_manifest(const std::string &path, const ImageManifest &manifest, ManifestPosition &position)
+{
+    std::string tmpPath = path + std::string(".tmp");
+    FILE *fp = fopen(tmpPath.c_str(), "w");
+    if (fp == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    fprintf(fp, "%s\n", MANIFEST_HEADER);
+    for (ImageManifest::const_iterator it = manifest.begin(); it != manifest.end(); ++it)
+    {
+        print_entry(fp, it->first, it->second);
+    }
+
+    // The manifest is trusted when it's loaded, so it must be complete on
+    // disk before it replaces the previous one
+    struct stat st;
+    bool error = (fflush(fp) != 0 || ferror(fp) != 0 || fsync(fileno(fp)) != 0 || fstat(fileno(fp), &st) != 0);
+    if (fclose(fp) != 0 || error || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    // The changes in the log are in the new manifest. If it's not removed,
+    // it's still ignored, it was written for the previous manifest. It's
+    // kept until the rename is on disk, a crash before that leaves the
+    // previous manifest, which needs it.
+    if (sync_directory(path))
+    {
+        std::string logPath = path + std::string(MANIFEST_LOG_SUFFIX);
+        unlink(logPath.c_str());
+    }
+
+    position.baseInode = st.st_ino;
+    position.baseSize = st.st_size;
+    position.logSize = 0;
+    return IMAGE_OPERATION_OK;
+}
+
+ImageOperationResult append_manifest_log(
+    const std::string &path,
+    const std::vector<ManifestChange> &changes,
+    ManifestPosition &position)
+{
+    std::string logPath = path + std::string(MANIFEST_LOG_SUFFIX);
+    FILE *fp = fopen(logPath.c_str(), (position.logSize > 0) ? "r+" : "w");
+    if (fp == NULL)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (ftruncate(fileno(fp), position.logSize) != 0 || fseek(fp, position.logSize, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    if (position.logSize == 0)
+    {
+        fprintf(fp, MANIFEST_LOG_HEADER " %llu %llu\n",
+                (unsigned long long)position.baseInode,
+                (unsigned long long)position.baseSize);
+    }
+
+    for (std::vector<ManifestChange>::const_iterator it = changes.begin(); it != changes.end(); ++it)
+    {
+        if (it->removed)
+        {
+            fprintf(fp, "- %s\n", it->fileName.c_str());
+        }
+        else
+        {
+            fprintf(fp, "+ ");
+            print_entry(fp, it->fileName, it->entry);
+        }
+    }
+
+    bool error = (fflush(fp) != 0 || ferror(fp) != 0);
+    long size = ftell(fp);
+    if (fclose(fp) != 0 || error || size < 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    position.logSize = size;
+    return IMAGE_OPERATION_OK;
+}
+
+void fill_manifest_entry(const struct stat &st, const unsigned char *header, ManifestEntry &entry)
+{
+    entry.partNumber = to_hex(header, PN_SIZE);
+    entry.digest = to_hex(header + PN_SIZE, SHA256_SIZE);
+    entry.size = st.st_size;
+    entry.mtimeSec = st.st_mtim.tv_sec;
+    entry.mtimeNsec = st.st_mtim.tv_nsec;
+    entry.inode = st.st_ino;
+}
+
+bool manifest_entry_matches(const ManifestEntry &entry, const struct stat &st)
+{
+    return entry.size == st.st_size &&
+           entry.mtimeSec == st.st_mtim.tv_sec &&
+           entry.mtimeNsec == st.st_mtim.tv_nsec &&
+           entry.inode == st.st_ino;
+}
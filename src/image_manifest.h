@@ -0,0 +1,144 @@
+#ifndef IMAGE_MANIFEST_H
+#define IMAGE_MANIFEST_H
+
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "iimagemanager.h"
+
+#define MANIFEST_FILE ".manifest"
+
+// Changes made after the manifest was saved are appended to this file,
+// next to the manifest
+#define MANIFEST_LOG_SUFFIX ".log"
+
+/**
+ * @brief An image that was verified, and the file state when it was verified.
+ */
+struct ManifestEntry
+{
+    std::string partNumber;
+    std::string digest;
+    off_t size = 0;
+    time_t mtimeSec = 0;
+    long mtimeNsec = 0;
+    ino_t inode = 0;
+};
+
+/**
+ * @brief Verified images, indexed by file name.
+ */
+typedef std::unordered_map<std::string, ManifestEntry> ImageManifest;
+
+/**
+ * @brief Change of one file of a manifest. The entry is only set when the
+ * file was not removed.
+ */
+struct ManifestChange
+{
+    std::string fileName;
+    bool removed = false;
+    ManifestEntry entry;
+};
+
+/**
+ * @brief Manifest on disk a manifest in memory is up to date with: the saved
+ * manifest and the size of the log of changes appended to it.
+ */
+struct ManifestPosition
+{
+    ino_t baseInode = 0;
+    uint64_t baseSize = 0;
+    uint64_t logSize = 0;
+};
+
+/**
+ * @brief Called with each change read from the log of a manifest.
+ */
+typedef std::function<void(const ManifestChange &change)> ManifestLogCallback;
+
+/**
+ * Load a manifest from disk, with the changes appended to its log. A missing
+ * or unreadable manifest results in an empty one, so every image will be
+ * verified again.
+ *
+ * @param[in] path manifest path.
+ * @param[out] manifest loaded entries.
+ * @param[out] position manifest and log that were read.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult load_manifest(const std::string &path, ImageManifest &manifest, ManifestPosition &position);
+
+/**
+ * Read the changes appended to the log of a manifest after a position, so a
+ * manifest loaded before is brought up to date without being loaded again.
+ *
+ * @param[in] path manifest path.
+ * @param[in,out] position manifest and log already read, moved past the
+ * changes read.
+ * @param[in] callback function called with each change, in order.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR if the manifest was written again since the
+ * position, so it must be loaded again.
+ */
+ImageOperationResult read_manifest_log(
+    const std::string &path,
+    ManifestPosition &position,
+    const ManifestLogCallback &callback);
+
+/**
+ * Save a manifest to disk and drop its log. The file is replaced atomically.
+ *
+ * @param[in] path manifest path.
+ * @param[in] manifest entries to be saved.
+ * @param[out] position manifest that was written.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult save_manifest(const std::string &path, const ImageManifest &manifest, ManifestPosition &position);
+
+/**
+ * Append changes to the log of a manifest, so the whole manifest is not
+ * written again. Anything in the log after the position, such as a record
+ * left incomplete by a crash, is dropped. Changes are applied in order and
+ * applying one twice has no effect, so the log may be read again on top of
+ * a manifest that already has them.
+ *
+ * @param[in] path manifest path.
+ * @param[in] changes changes to be appended.
+ * @param[in,out] position manifest and log the changes are appended to,
+ * moved past them.
+ * @return IMAGE_OPERATION_OK if success.
+ * @return IMAGE_OPERATION_ERROR otherwise.
+ */
+ImageOperationResult append_manifest_log(
+    const std::string &path,
+    const std::vector<ManifestChange> &changes,
+    ManifestPosition &position);
+
+/**
+ * Fill a manifest entry for an image that has just been verified.
+ *
+ * @param[in] st file status of the image.
+ * @param[in] header image header (PN and SHA256).
+ * @param[out] entry entry to be filled.
+ */
+void fill_manifest_entry(const struct stat &st, const unsigned char *header, ManifestEntry &entry);
+
+/**
+ * Check if a file is still the same one that was verified.
+ *
+ * @param[in] entry manifest entry of the file.
+ * @param[in] st current file status.
+ * @return true if the file did not change since it was verified.
+ */
+bool manifest_entry_matches(const ManifestEntry &entry, const struct stat &st);
+
+#endif // IMAGE_MANIFEST_H
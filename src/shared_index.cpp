@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shared_index.h"
+
+#define SHARED_INDEX_MAGIC "PESINDEX"
+#define SHARED_INDEX_VERSION 1
+
+// Written in native byte order, so an index from another machine is reset
+#define SHARED_INDEX_BYTE_ORDER 0x01020304
+
+// Bytes locked with fcntl. They are past the header, which is never locked.
+// Open file description locks are used, so they belong to the descriptor of
+// each handler and not to the process: handlers of the same process exclude
+// each other, and closing one does not drop the locks of the others.
+#define PRESENCE_LOCK_OFFSET 4096
+#define COMPATIBILITY_LOCK_OFFSET (PRESENCE_LOCK_OFFSET + 1)
+#define COMPACTION_LOCK_OFFSET (PRESENCE_LOCK_OFFSET + 2)
+#define PART_NUMBER_LOCK_OFFSET (PRESENCE_LOCK_OFFSET + 16)
+
+/**
+ * @brief Index file header, the whole file.
+ */
+struct SharedIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t generation;
+    uint64_t compatibilityGeneration;
+};
+
+static bool lock_byte(int fd, off_t offset, short type, bool wait)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = 1;
+
+    int result;
+    do
+    {
+        result = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+    } while (result != 0 && errno == EINTR);
+    return result == 0;
+}
+
+static void lock_file(int fd, int operation)
+{
+    while (flock(fd, operation) != 0 && errno == EINTR)
+    {
+    }
+}
+
+SharedIndex::SharedIndex() : fd(-1), header(NULL)
+{
+}
+
+SharedIndex::~SharedIndex()
+{
+    close();
+}
+
+ImageOperationResult SharedIndex::open(const std::string &path, bool &first)
+{
+    close();
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0)
+    {
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    lock_file(fd, LOCK_EX);
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        (st.st_size >= (off_t)sizeof(SharedIndexHeader) || ftruncate(fd, sizeof(SharedIndexHeader)) == 0))
+    {
+        mapping = mmap(NULL, sizeof(SharedIndexHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (mapping == MAP_FAILED)
+    {
+        ::close(fd);
+        fd = -1;
+        return IMAGE_OPERATION_ERROR;
+    }
+
+    header = (SharedIndexHeader *)mapping;
+    if (memcmp(header->magic, SHARED_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SHARED_INDEX_VERSION ||
+        header->byteOrder != SHARED_INDEX_BYTE_ORDER)
+    {
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, SHARED_INDEX_MAGIC, sizeof(header->magic));
+        header->version = SHARED_INDEX_VERSION;
+        header->byteOrder = SHARED_INDEX_BYTE_ORDER;
+    }
+
+    // Every open handler holds its presence byte shared, so it can only be
+    // locked exclusively if there is no other one. The lock is then changed
+    // to shared, which fcntl does atomically.
+    first = lock_byte(fd, PRESENCE_LOCK_OFFSET, F_WRLCK, false);
+    lock_byte(fd, PRESENCE_LOCK_OFFSET, F_RDLCK, true);
+    return IMAGE_OPERATION_OK;
+}
+
+void SharedIndex::close()
+{
+    if (header != NULL)
+    {
+        munmap(header, sizeof(SharedIndexHeader));
+        header = NULL;
+    }
+
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool SharedIndex::is_last()
+{
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // Same check as when the index is opened
+    bool last = lock_byte(fd, PRESENCE_LOCK_OFFSET, F_WRLCK, false);
+    lock_byte(fd, PRESENCE_LOCK_OFFSET, F_RDLCK, true);
+    return last;
+}
+
+uint64_t SharedIndex::generation() const
+{
+    return (header != NULL) ? __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE) : 0;
+}
+
+uint64_t SharedIndex::compatibility_generation() const
+{
+    return (header != NULL) ? __atomic_load_n(&header->compatibilityGeneration, __ATOMIC_ACQUIRE) : 0;
+}
+
+void SharedIndex::lock(bool exclusive)
+{
+    if (fd >= 0)
+    {
+        lock_file(fd, exclusive ? LOCK_EX : LOCK_SH);
+    }
+}
+
+void SharedIndex::unlock()
+{
+    if (fd >= 0)
+    {
+        lock_file(fd, LOCK_UN);
+    }
+}
+
+uint64_t SharedIndex::increment()
+{
+    return (header != NULL) ? __atomic_add_fetch(&header->generation, 1, __ATOMIC_RELEASE) : 0;
+}
+
+uint64_t SharedIndex::increment_compatibility()
+{
+    return (header != NULL) ? __atomic_add_fetch(&header->compatibilityGeneration, 1, __ATOMIC_RELEASE) : 0;
+}
+
+void SharedIndex::lock_compatibility()
+{
+    if (fd >= 0)
+    {
+        lock_byte(fd, COMPATIBILITY_LOCK_OFFSET, F_WRLCK, true);
+    }
+}
+
+void SharedIndex::unlock_compatibility()
+{
+    if (fd >= 0)
+    {
+        lock_byte(fd, COMPATIBILITY_LOCK_OFFSET, F_UNLCK, true);
+    }
+}
+
+void SharedIndex::lock_compaction()
+{
+    if (fd >= 0)
+    {
+        lock_byte(fd, COMPACTION_LOCK_OFFSET, F_WRLCK, true);
+    }
+}
+
+void SharedIndex::unlock_compaction()
+{
+    if (fd >= 0)
+    {
+        lock_byte(fd, COMPACTION_LOCK_OFFSET, F_UNLCK, true);
+    }
+}
+
+void SharedIndex::lock_part_number(size_t group)
+{
+    if (fd >= 0)
+    {
+        lock_byte(fd, PART_NUMBER_LOCK_OFFSET + group, F_WRLCK, true);
+    }
+}
+
+void SharedIndex::unlock_part_number(size_t group)
+{
+    if (fd >= 0)
+    {
+        lock_byte(fd, PART_NUMBER_LOCK_OFFSET + group, F_UNLCK, true);
+    }
+}
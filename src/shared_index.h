@@ -0,0 +1,151 @@
+#ifndef SHARED_INDEX_H
+#define SHARED_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "iimagemanager.h"
+
+#define SHARED_INDEX_FILE ".index"
+
+// Number of part number locks, see SharedIndex::lock_part_number
+#define SHARED_INDEX_PART_NUMBER_LOCKS 64
+
+/**
+ * @brief Coordinates the handlers of an image directory, in the same process
+ * or in different ones. The image list itself is kept in the manifest, this
+ * file, mapped in memory, only has generation numbers that change every time
+ * the image list or the compatibility data is changed, so a handler knows
+ * it's out of date by reading them.
+ *
+ * The file is also used for locks:
+ * - flock on the whole file protects the image list on disk. It's held
+ *   shared to read it, and exclusively to change it.
+ * - fcntl open file description locks on single bytes, which exclude other
+ *   handlers, in this process or in others: one held shared by each handler
+ *   while it's open, to know if another handler has the directory open, and
+ *   exclusive ones for the compatibility data, for compactions and for each
+ *   group of part numbers.
+ */
+class SharedIndex
+{
+public:
+    SharedIndex();
+
+    /**
+     * Close the index.
+     */
+    ~SharedIndex();
+
+    /**
+     * Open the index of an image directory, creating it if needed. It's
+     * returned locked exclusively, so the image list can be loaded or
+     * built before other handlers change it.
+     *
+     * @param[in] path index path.
+     * @param[out] first true if no other handler has the image directory
+     * open, so the image list on disk may be out of date.
+     * @return IMAGE_OPERATION_OK if success.
+     * @return IMAGE_OPERATION_ERROR otherwise.
+     */
+    ImageOperationResult open(const std::string &path, bool &first);
+
+    /**
+     * Close the index, dropping its locks.
+     */
+    void close();
+
+    /**
+     * Check if no other handler has the image directory open.
+     *
+     * @return true if this is the only handler of the image directory.
+     */
+    bool is_last();
+
+    /**
+     * Get the generation of the image list. It's read without any lock.
+     *
+     * @return generation, 0 if the index is not open.
+     */
+    uint64_t generation() const;
+
+    /**
+     * Get the generation of the compatibility data. It's read without any lock.
+     *
+     * @return generation, 0 if the index is not open.
+     */
+    uint64_t compatibility_generation() const;
+
+    /**
+     * Lock the image list on disk.
+     *
+     * @param[in] exclusive true to change it, false to read it.
+     */
+    void lock(bool exclusive);
+
+    /**
+     * Unlock the image list on disk.
+     */
+    void unlock();
+
+    /**
+     * Increment the generation of the image list. Must be called with the
+     * index locked exclusively, after the image list was saved.
+     *
+     * @return new generation.
+     */
+    uint64_t increment();
+
+    /**
+     * Increment the generation of the compatibility data. Must be called
+     * with the compatibility data locked, after it was changed.
+     *
+     * @return new generation.
+     */
+    uint64_t increment_compatibility();
+
+    /**
+     * Lock the compatibility data against other handlers.
+     */
+    void lock_compatibility();
+
+    /**
+     * Unlock the compatibility data.
+     */
+    void unlock_compatibility();
+
+    /**
+     * Lock compactions against other handlers.
+     */
+    void lock_compaction();
+
+    /**
+     * Unlock compactions.
+     */
+    void unlock_compaction();
+
+    /**
+     * Lock a group of part numbers against other handlers.
+     *
+     * @param[in] group group index, below SHARED_INDEX_PART_NUMBER_LOCKS.
+     */
+    void lock_part_number(size_t group);
+
+    /**
+     * Unlock a group of part numbers.
+     *
+     * @param[in] group group index.
+     */
+    void unlock_part_number(size_t group);
+
+private:
+    SharedIndex(const SharedIndex &);
+    SharedIndex &operator=(const SharedIndex &);
+
+    int fd;
+    struct SharedIndexHeader *header;
+};
+
+#endif // SHARED_INDEX_H
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_arena.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Strings bigger than this get a block of their own, so the end of the
+// current block is not wasted
+#define ARENA_LARGE_STRING (ARENA_BLOCK_SIZE / 4)
+
+StringArena::StringArena() : next(NULL), available(0)
+{
+}
+
+StringArena::~StringArena()
+{
+    for (std::vector<char *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        free(*it);
+    }
+}
+
+const char *StringArena::copy(const char *str, size_t length)
+{
+    size_t size = length + 1;
+    char *result;
+    if (size > ARENA_LARGE_STRING)
+    {
+        result = (char *)malloc(size);
+        if (result == NULL)
+        {
+            return NULL;
+        }
+        blocks.push_back(result);
+    }
+    else
+    {
+        if (size > available)
+        {
+            char *block = (char *)malloc(ARENA_BLOCK_SIZE);
+            if (block == NULL)
+            {
+                return NULL;
+            }
+            blocks.push_back(block);
+            next = block;
+            available = ARENA_BLOCK_SIZE;
+        }
+
+        result = next;
+        next += size;
+        available -= size;
+    }
+
+    memcpy(result, str, length);
+    result[length] = '\0';
+    return result;
+}
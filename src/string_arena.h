@@ -0,0 +1,42 @@
+#ifndef STRING_ARENA_H
+#define STRING_ARENA_H
+
+#include <stddef.h>
+
+#include <vector>
+
+/**
+ * @brief Storage for strings returned to callers. Strings are copied into
+ * large blocks and never moved or freed until the arena is destroyed, so
+ * every pointer handed out stays valid until then. Not thread safe.
+ */
+class StringArena
+{
+public:
+    StringArena();
+
+    /**
+     * Free every string.
+     */
+    ~StringArena();
+
+    /**
+     * Copy a string into the arena.
+     *
+     * @param[in] str string to be copied.
+     * @param[in] length string length, without the terminating '\0'.
+     * @return copy, valid until the arena is destroyed. NULL if there is
+     * not enough memory.
+     */
+    const char *copy(const char *str, size_t length);
+
+private:
+    StringArena(const StringArena &);
+    StringArena &operator=(const StringArena &);
+
+    std::vector<char *> blocks;
+    char *next;
+    size_t available;
+};
+
+#endif // STRING_ARENA_H
@@ -0,0 +1,65 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(unsigned int threadCount) : stopping(false)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    for (unsigned int i = 0; i < threadCount; i++)
+    {
+        workers.push_back(std::thread(&WorkerPool::run, this));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+
+    for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+        it->join();
+    }
+}
+
+void WorkerPool::submit(const std::function<void()> &job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push(job);
+    }
+    jobAvailable.notify_one();
+}
+
+void WorkerPool::run()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && jobs.empty())
+            {
+                jobAvailable.wait(lock);
+            }
+
+            if (jobs.empty())
+            {
+                return;
+            }
+
+            job = jobs.front();
+            jobs.pop();
+        }
+        job();
+    }
+}
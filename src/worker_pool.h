@@ -0,0 +1,46 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A fixed set of threads running jobs in the order they were submitted.
+ */
+class WorkerPool
+{
+public:
+    /**
+     * Start the worker threads.
+     *
+     * @param[in] threadCount number of threads. If 0, one per CPU core.
+     */
+    explicit WorkerPool(unsigned int threadCount);
+
+    /**
+     * Run all jobs already submitted and stop the worker threads.
+     */
+    ~WorkerPool();
+
+    /**
+     * Queue a job to be run by one of the worker threads.
+     *
+     * @param[in] job job to be run.
+     */
+    void submit(const std::function<void()> &job);
+
+private:
+    void run();
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    bool stopping;
+};
+
+#endif // WORKER_POOL_H
@@ -1,16 +1,21 @@
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <fstream>
+#include <future>
+#include <thread>
+#include <vector>
 
 #include "iimagemanager.h"
 
 #define RELATIVE_IMAGE_DIR "/pes/images"
 #define COMPATIBILITY_FILE "compatibility.xml"
 
-#define CUSTOM_COMPATIBILITY_FILE "/tmp/compatibility.xml"
 #define CUSTOM_COMPATIBILITY_CONTENT "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"             \
                                      "<COMPATIBILITY>\n"                                        \
                                      "    <SOFTWARE PN=\"00000001\">\n"                         \
@@ -89,6 +94,107 @@ TEST_F(ImageManagerTest, ImportImageBinaryTest)
     ASSERT_TRUE(found);
 }
 
+TEST_F(ImageManagerTest, ImportImageBinaryHardlinkTest)
+{
+    ASSERT_EQ(IMAGE_OPERATION_OK, destroy_handler(&handler));
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(IMAGE_OPERATION_OK, init_handler_config(&config));
+    config.allow_hardlink = 1;
+    ASSERT_EQ(IMAGE_OPERATION_OK, create_handler_with_config(&handler, &config));
+
+    // Image directory may be on another filesystem, in that case the image is copied
+    char *pn = NULL;
+    ASSERT_EQ(import_image(handler, "origin_images/load2.bin", &pn), IMAGE_OPERATION_OK);
+    ASSERT_NE(pn, nullptr);
+    ASSERT_STREQ(pn, "00000002");
+
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(handler, pn, &path), IMAGE_OPERATION_OK);
+
+    struct stat st;
+    ASSERT_EQ(stat(path, &st), 0);
+    ASSERT_EQ(st.st_size, 56);
+
+    // An image on the same filesystem as the image directory is linked
+    std::string source = imageDir.substr(0, imageDir.find_last_of('/')) + "/hardlink_load1.bin";
+    std::ifstream in("origin_images/load1.bin", std::ios::binary);
+    std::ofstream out(source, std::ios::binary);
+    out << in.rdbuf();
+    out.close();
+
+    ASSERT_EQ(import_image(handler, source.c_str(), &pn), IMAGE_OPERATION_OK);
+    ASSERT_STREQ(pn, "00000001");
+    ASSERT_EQ(get_image_path(handler, pn, &path), IMAGE_OPERATION_OK);
+
+    struct stat sourceSt;
+    ASSERT_EQ(stat(source.c_str(), &sourceSt), 0);
+    ASSERT_EQ(stat(path, &st), 0);
+    ASSERT_EQ(st.st_ino, sourceSt.st_ino);
+    ASSERT_EQ(st.st_nlink, 2u);
+    unlink(source.c_str());
+}
+
+static void import_finished(
+    ImageImportOperationPtr operation,
+    ImageOperationResult result,
+    const char *part_number,
+    void *user_data)
+{
+    (void)operation;
+    (void)part_number;
+    *((ImageOperationResult *)user_data) = result;
+}
+
+TEST_F(ImageManagerTest, ImportImageAsyncTest)
+{
+    ImageOperationResult callbackResult = IMAGE_OPERATION_ERROR;
+    ImageImportOperationPtr operation = NULL;
+    ASSERT_EQ(import_image_async(handler, "origin_images/load1.bin", import_finished, &callbackResult, &operation),
+              IMAGE_OPERATION_OK);
+    ASSERT_NE(operation, nullptr);
+
+    ImageOperationResult result = IMAGE_OPERATION_ERROR;
+    const char *pn = NULL;
+    ASSERT_EQ(wait_import(operation, &result, &pn), IMAGE_OPERATION_OK);
+    ASSERT_EQ(result, IMAGE_OPERATION_OK);
+    ASSERT_STREQ(pn, "00000001");
+
+    unsigned long long bytesDone = 0;
+    unsigned long long bytesTotal = 0;
+    int done = 0;
+    ASSERT_EQ(get_import_progress(operation, &bytesDone, &bytesTotal, &done), IMAGE_OPERATION_OK);
+    ASSERT_EQ(done, 1);
+    ASSERT_EQ(bytesDone, bytesTotal);
+
+    ASSERT_EQ(release_import(&operation), IMAGE_OPERATION_OK);
+    ASSERT_EQ(operation, nullptr);
+
+    // Callback is called after waiters are woken up, destroying the handler
+    // waits for it
+    ASSERT_EQ(IMAGE_OPERATION_OK, destroy_handler(&handler));
+    ASSERT_EQ(callbackResult, IMAGE_OPERATION_OK);
+    ASSERT_EQ(IMAGE_OPERATION_OK, create_handler(&handler));
+
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(handler, "00000001", &path), IMAGE_OPERATION_OK);
+}
+
+TEST_F(ImageManagerTest, ImportCorruptedImageAsyncTest)
+{
+    ImageImportOperationPtr operation = NULL;
+    ASSERT_EQ(import_image_async(handler, "origin_images/corrupted_load1.bin", NULL, NULL, &operation),
+              IMAGE_OPERATION_OK);
+
+    ImageOperationResult result = IMAGE_OPERATION_OK;
+    const char *pn = NULL;
+    ASSERT_EQ(wait_import(operation, &result, &pn), IMAGE_OPERATION_OK);
+    ASSERT_EQ(result, IMAGE_OPERATION_ERROR);
+    ASSERT_EQ(pn, nullptr);
+
+    ASSERT_EQ(release_import(&operation), IMAGE_OPERATION_OK);
+}
+
 TEST_F(ImageManagerTest, ImportMultipleImageBinaryTest)
 {
     // TODO: Make it an array
@@ -176,6 +282,35 @@ TEST_F(ImageManagerTest, ImportMultipleImageBinaryTest)
     ASSERT_TRUE(found3);
 }
 
+TEST_F(ImageManagerTest, ImportImagesBatchTest)
+{
+    const char *paths[] = {
+        "origin_images/load1.bin",
+        "origin_images/corrupted_load1.bin",
+        "origin_images/load2.bin",
+        "origin_images/ARQ_Compatibilidade1.xml",
+        "origin_images/load3.bin"};
+    ImageImportResult results[5];
+
+    ImageOperationResult result = import_images(handler, paths, 5, results);
+    ASSERT_EQ(result, IMAGE_OPERATION_ERROR);
+
+    ASSERT_EQ(results[0].result, IMAGE_OPERATION_OK);
+    ASSERT_STREQ(results[0].part_number, "00000001");
+    ASSERT_EQ(results[1].result, IMAGE_OPERATION_ERROR);
+    ASSERT_EQ(results[1].part_number, nullptr);
+    ASSERT_EQ(results[2].result, IMAGE_OPERATION_OK);
+    ASSERT_STREQ(results[2].part_number, "00000002");
+    ASSERT_EQ(results[3].result, IMAGE_OPERATION_OK);
+    ASSERT_STREQ(results[3].part_number, "00000000");
+    ASSERT_EQ(results[4].result, IMAGE_OPERATION_OK);
+    ASSERT_STREQ(results[4].part_number, "00000003");
+
+    char *path = NULL;
+    ASSERT_EQ(IMAGE_OPERATION_OK, get_image_path(handler, "00000002", &path));
+    ASSERT_NE(path, nullptr);
+}
+
 TEST_F(ImageManagerTest, ImportCorruptedImageBinaryTest)
 {
     char *pn = NULL;
@@ -331,7 +466,10 @@ TEST_F(ImageManagerTest, ImportMultipleCompatibilityFileTest)
     closedir(dr);
     ASSERT_TRUE(found);
 
-    // Check if file was correctly merged
+    // Check if file was correctly merged. The last handler of the directory
+    // writes the changes still in the journal to the file.
+    ASSERT_EQ(destroy_handler(&handler), IMAGE_OPERATION_OK);
+    ASSERT_EQ(create_handler(&handler), IMAGE_OPERATION_OK);
     std::ifstream file(imageDir + "/" + fileName);
     std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
     ASSERT_STREQ(content.c_str(), MERGED_COMPATIBILITY_CONTENT);
@@ -376,6 +514,89 @@ TEST_F(ImageManagerTest, RemovePnTest)
 
     closedir(dr);
     ASSERT_FALSE(found);
+
+    // The PN is removed from the compatibility file too
+    char *pnlist[] = {(char *)pn, (char *)"00000002"};
+    char *buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 2, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(strstr(buffer, pn), nullptr);
+    ASSERT_NE(strstr(buffer, "00000002"), nullptr);
+    free(buffer);
+
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+}
+
+TEST_F(ImageManagerTest, ModifiedImageNotLoadedTest)
+{
+    char *pn = NULL;
+    ASSERT_EQ(import_image(handler, "origin_images/load3.bin", &pn), IMAGE_OPERATION_OK);
+
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(handler, pn, &path), IMAGE_OPERATION_OK);
+    std::string imagePath = path;
+
+    // A verified image is loaded again on the next start
+    ASSERT_EQ(IMAGE_OPERATION_OK, destroy_handler(&handler));
+    ASSERT_EQ(IMAGE_OPERATION_OK, create_handler(&handler));
+    ASSERT_EQ(get_image_path(handler, "00000003", &path), IMAGE_OPERATION_OK);
+
+    // Corrupt the image, it must be verified again and rejected
+    FILE *file = fopen(imagePath.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    fseek(file, -1, SEEK_END);
+    int lastByte = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(lastByte ^ 0xFF, file);
+    fclose(file);
+
+    ASSERT_EQ(IMAGE_OPERATION_OK, destroy_handler(&handler));
+    ASSERT_EQ(IMAGE_OPERATION_OK, create_handler(&handler));
+    ASSERT_EQ(get_image_path(handler, "00000003", &path), IMAGE_OPERATION_ERROR);
+
+    unlink(imagePath.c_str());
+}
+
+TEST_F(ImageManagerTest, LazyVerificationTest)
+{
+    char *pn = NULL;
+    ASSERT_EQ(import_image(handler, "origin_images/load2.bin", &pn), IMAGE_OPERATION_OK);
+
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(handler, pn, &path), IMAGE_OPERATION_OK);
+    std::string imagePath = path;
+
+    // Corrupt the image, it will only be verified when it is used
+    FILE *file = fopen(imagePath.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    fseek(file, -1, SEEK_END);
+    int lastByte = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(lastByte ^ 0xFF, file);
+    fclose(file);
+
+    ASSERT_EQ(IMAGE_OPERATION_OK, destroy_handler(&handler));
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(IMAGE_OPERATION_OK, init_handler_config(&config));
+    config.lazy_verification = 1;
+    ASSERT_EQ(IMAGE_OPERATION_OK, create_handler_with_config(&handler, &config));
+
+    char **images = NULL;
+    int images_size = 0;
+    ASSERT_EQ(get_images(handler, &images, &images_size), IMAGE_OPERATION_OK);
+
+    bool found = false;
+    for (int i = 0; i < images_size; i++)
+    {
+        found = found || (strcmp(images[i], "00000002") == 0);
+    }
+    ASSERT_TRUE(found);
+
+    ASSERT_EQ(get_image_path(handler, "00000002", &path), IMAGE_OPERATION_ERROR);
+    ASSERT_EQ(verify_pending_images(handler), IMAGE_OPERATION_OK);
+
+    unlink(imagePath.c_str());
 }
 
 TEST_F(ImageManagerTest, GetImagesTest)
@@ -452,13 +673,29 @@ TEST_F(ImageManagerTest, GetCompatibilityPathTest)
 
     char *path = NULL;
     ASSERT_EQ(get_compatibility_path(handler, pnlist, 1, &path), IMAGE_OPERATION_OK);
-    ASSERT_STREQ(path, CUSTOM_COMPATIBILITY_FILE);
+    ASSERT_EQ(std::string(path).compare(0, imageDir.size() + 1, imageDir + "/"), 0);
 
     //Assert content
     std::ifstream file(path);
     std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
     ASSERT_STREQ(content.c_str(), CUSTOM_COMPATIBILITY_CONTENT);
 
+    // Another subset is written to another file, the first one is kept
+    // until more files were written or the handler is destroyed
+    char *pnlist2[] = {(char *)"00000002"};
+    char *path2 = NULL;
+    ASSERT_EQ(get_compatibility_path(handler, pnlist2, 1, &path2), IMAGE_OPERATION_OK);
+    ASSERT_STRNE(path, path2);
+    char *again = NULL;
+    ASSERT_EQ(get_compatibility_path(handler, pnlist, 1, &again), IMAGE_OPERATION_OK);
+    ASSERT_STREQ(path, again);
+
+    std::string firstPath = path;
+    ASSERT_EQ(access(firstPath.c_str(), R_OK), 0);
+    ASSERT_EQ(destroy_handler(&handler), IMAGE_OPERATION_OK);
+    ASSERT_NE(access(firstPath.c_str(), F_OK), 0);
+    ASSERT_EQ(create_handler(&handler), IMAGE_OPERATION_OK);
+
     free(pnlist[0]);
     free(pnlist);
 }
@@ -479,7 +716,7 @@ TEST_F(ImageManagerTest, GetCompatibilityPathWithZerosTest)
 
     char *path = NULL;
     ASSERT_EQ(get_compatibility_path(handler, pnlist, 4, &path), IMAGE_OPERATION_OK);
-    ASSERT_STREQ(path, CUSTOM_COMPATIBILITY_FILE);
+    ASSERT_EQ(std::string(path).compare(0, imageDir.size() + 1, imageDir + "/"), 0);
 
     //Assert content
     std::ifstream file(path);
@@ -491,4 +728,986 @@ TEST_F(ImageManagerTest, GetCompatibilityPathWithZerosTest)
     free(pnlist[2]);
     free(pnlist[3]);
     free(pnlist);
-}
\ No newline at end of file
+}
+TEST_F(ImageManagerTest, GetCompatibilityPathAfterImportTest)
+{
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade2.xml", NULL), IMAGE_OPERATION_OK);
+
+    char *pnlist[] = {(char *)"00000005"};
+    char *path = NULL;
+    ASSERT_EQ(get_compatibility_path(handler, pnlist, 1, &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(std::string(path).compare(0, imageDir.size() + 1, imageDir + "/"), 0);
+
+    std::ifstream file(path);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_STREQ(content.c_str(), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                  "<COMPATIBILITY>\n"
+                                  "    <SOFTWARE PN=\"00000005\">\n"
+                                  "        <LRU name=\"LRU_EX2_LEFT\" PN=\"EXEMPLO6\"/>\n"
+                                  "        <LRU name=\"LRU_EX2_CENTER\" PN=\"EXEMPLO7\"/>\n"
+                                  "        <LRU name=\"LRU_EX2_RIGHT\" PN=\"EXEMPLO8\"/>\n"
+                                  "    </SOFTWARE>\n"
+                                  "</COMPATIBILITY>\n");
+}
+
+TEST_F(ImageManagerTest, GetCompatibilityBufferTest)
+{
+    ASSERT_EQ(import_image(handler, "origin_images/load1.bin", NULL), IMAGE_OPERATION_OK);
+
+    char *pnlist[] = {(char *)"00000001"};
+    char *buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 1, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_EQ(size, strlen(CUSTOM_COMPATIBILITY_CONTENT));
+    ASSERT_STREQ(buffer, CUSTOM_COMPATIBILITY_CONTENT);
+    free(buffer);
+
+    FILE *file = tmpfile();
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(write_compatibility(handler, pnlist, 1, fileno(file)), IMAGE_OPERATION_OK);
+
+    std::string content(size + 1, '\0');
+    rewind(file);
+    ASSERT_EQ(fread(&content[0], 1, size + 1, file), size);
+    fclose(file);
+    ASSERT_STREQ(content.c_str(), CUSTOM_COMPATIBILITY_CONTENT);
+}
+
+TEST_F(ImageManagerTest, CachedCompatibilityInvalidatedByImportTest)
+{
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+
+    char *pnlist[] = {(char *)"00000001", (char *)"00000001"};
+    char *buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 2, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_STREQ(buffer, CUSTOM_COMPATIBILITY_CONTENT);
+    free(buffer);
+
+    // Same request again, now served from the cache
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 1, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_STREQ(buffer, CUSTOM_COMPATIBILITY_CONTENT);
+    free(buffer);
+
+    // A new compatibility file replaces PN 00000001
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade3.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 1, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_NE(strstr(buffer, "NEW_LRU_EX1_LEFT"), nullptr);
+    free(buffer);
+
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+}
+
+TEST_F(ImageManagerTest, CompatibilityStoreRebuiltTest)
+{
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+
+    struct stat st;
+    ASSERT_EQ(stat((imageDir + "/.compatibility.bin").c_str(), &st), 0);
+
+    // The store must follow changes made to the compatibility file. Nothing
+    // is left in the journal to be applied to the edited file.
+    ASSERT_EQ(compact_compatibility(handler), IMAGE_OPERATION_OK);
+    std::ofstream xml(imageDir + "/" + COMPATIBILITY_FILE);
+    xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<COMPATIBILITY>\n"
+           "\t<SOFTWARE PN=\"00000009\">\n"
+           "\t\t<LRU name=\"EDITED\" PN=\"EDITED\"/>\n"
+           "\t</SOFTWARE>\n"
+           "</COMPATIBILITY>\n";
+    xml.close();
+
+    ASSERT_EQ(destroy_handler(&handler), IMAGE_OPERATION_OK);
+    ASSERT_EQ(create_handler(&handler), IMAGE_OPERATION_OK);
+
+    char *pnlist[] = {(char *)"00000009", (char *)"00000001"};
+    char *buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 2, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_NE(strstr(buffer, "EDITED"), nullptr);
+    ASSERT_EQ(strstr(buffer, "00000001"), nullptr);
+    free(buffer);
+
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+}
+
+TEST_F(ImageManagerTest, ImportCompatibilityFileStreamedTest)
+{
+    std::ofstream xml("/tmp/streamed_compatibility.xml");
+    xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<!-- Generated file -->\n"
+           "<COMPATIBILITY>\n"
+           "\t<SOFTWARE PN=\"STREAM&amp;1\">\n"
+           "\t\t<LRU name=\"OLD\" PN=\"OLD\"/>\n"
+           "\t</SOFTWARE>\n"
+           "\t<SOFTWARE PN=\"STREAM&amp;1\">\n"
+           "\t\t<LRU name=\"&lt;NEW&gt;\" PN=\"NEW\"></LRU>\n"
+           "\t</SOFTWARE>\n"
+           "</COMPATIBILITY>\n";
+    xml.close();
+
+    ASSERT_EQ(import_image(handler, "/tmp/streamed_compatibility.xml", NULL), IMAGE_OPERATION_OK);
+
+    char *pnlist[] = {(char *)"STREAM&1"};
+    char *buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 1, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_NE(strstr(buffer, "&lt;NEW&gt;"), nullptr);
+    ASSERT_EQ(strstr(buffer, "OLD"), nullptr);
+    free(buffer);
+
+    // A SOFTWARE without part number rejects the whole file
+    xml.open("/tmp/streamed_compatibility.xml");
+    xml << "<COMPATIBILITY><SOFTWARE PN=\"STREAM2\"/><SOFTWARE/></COMPATIBILITY>";
+    xml.close();
+    ASSERT_EQ(import_image(handler, "/tmp/streamed_compatibility.xml", NULL), IMAGE_OPERATION_ERROR);
+
+    unlink("/tmp/streamed_compatibility.xml");
+}
+
+TEST_F(ImageManagerTest, CompatibilityJournalTest)
+{
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(compact_compatibility(handler), IMAGE_OPERATION_OK);
+
+    std::string compatibilityPath = imageDir + "/" + COMPATIBILITY_FILE;
+    struct stat before;
+    ASSERT_EQ(stat(compatibilityPath.c_str(), &before), 0);
+
+    // Changes only go to the journal, and are there when the handler is
+    // created again. Another handler is kept open, so it's not compacted.
+    ImageHandlerPtr other = NULL;
+    ASSERT_EQ(create_handler(&other), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade3.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(destroy_handler(&handler), IMAGE_OPERATION_OK);
+    ASSERT_EQ(create_handler(&handler), IMAGE_OPERATION_OK);
+    ASSERT_EQ(destroy_handler(&other), IMAGE_OPERATION_OK);
+
+    struct stat after;
+    ASSERT_EQ(stat(compatibilityPath.c_str(), &after), 0);
+    ASSERT_EQ(before.st_ino, after.st_ino);
+    ASSERT_EQ(before.st_size, after.st_size);
+
+    char *pnlist[] = {(char *)"00000001"};
+    char *buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(get_compatibility_buffer(handler, pnlist, 1, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_NE(strstr(buffer, "NEW_LRU_EX1_LEFT"), nullptr);
+    free(buffer);
+
+    // Compacting writes the same content to the compatibility file
+    ASSERT_EQ(compact_compatibility(handler), IMAGE_OPERATION_OK);
+    std::ifstream file(compatibilityPath);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_NE(content.find("NEW_LRU_EX1_LEFT"), std::string::npos);
+    ASSERT_NE(content.find("00000002"), std::string::npos);
+
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+}
+
+TEST_F(ImageManagerTest, GetCompatibleSoftwaresTest)
+{
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade2.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(compact_compatibility(handler), IMAGE_OPERATION_OK);
+
+    // Found by LRU part number or name, in compatibility file order
+    char **part_numbers = NULL;
+    int list_size = 0;
+    ASSERT_EQ(get_compatible_softwares(handler, "EXEMPLO3", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 2);
+    ASSERT_STREQ(part_numbers[0], "00000001");
+    ASSERT_STREQ(part_numbers[1], "00000004");
+    free(part_numbers);
+
+    ASSERT_EQ(get_compatible_softwares(handler, "LRU_EX3_CENTER", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 2);
+    ASSERT_STREQ(part_numbers[0], "00000003");
+    ASSERT_STREQ(part_numbers[1], "00000006");
+    free(part_numbers);
+
+    // Replaced entries are found by their new LRUs only
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade3.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_compatible_softwares(handler, "EXEMPLO3", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 0);
+    ASSERT_EQ(part_numbers, nullptr);
+
+    ASSERT_EQ(get_compatible_softwares(handler, "NEW_EXEMPLO3", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 1);
+    ASSERT_STREQ(part_numbers[0], "00000001");
+    free(part_numbers);
+
+    ASSERT_EQ(get_compatible_softwares(handler, NULL, &part_numbers, &list_size), IMAGE_OPERATION_ERROR);
+
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade2.xml", NULL), IMAGE_OPERATION_OK);
+}
+
+static void remove_directory(const std::string &path)
+{
+    DIR *dr = opendir(path.c_str());
+    if (dr != NULL)
+    {
+        struct dirent *de;
+        while ((de = readdir(dr)) != NULL)
+        {
+            if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            {
+                unlink((path + "/" + de->d_name).c_str());
+            }
+        }
+        closedir(dr);
+    }
+    rmdir(path.c_str());
+}
+
+TEST_F(ImageManagerTest, MultipleHandlersTest)
+{
+    char rootA[] = "/tmp/image_root_XXXXXX";
+    char rootB[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(rootA), nullptr);
+    ASSERT_NE(mkdtemp(rootB), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    ImageHandlerPtr handlerA = NULL;
+    ImageHandlerPtr handlerB = NULL;
+    config.root_dir = rootA;
+    ASSERT_EQ(create_handler_with_config(&handlerA, &config), IMAGE_OPERATION_OK);
+    config.root_dir = rootB;
+    ASSERT_EQ(create_handler_with_config(&handlerB, &config), IMAGE_OPERATION_OK);
+    ASSERT_NE(handlerA, handlerB);
+    ASSERT_NE(handlerA, handler);
+
+    // Each handler only has the images imported into its own directory
+    ASSERT_EQ(import_image(handlerA, "origin_images/load1.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(handlerB, "origin_images/load2.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(handlerB, "origin_images/ARQ_Compatibilidade2.xml", NULL), IMAGE_OPERATION_OK);
+
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(handlerA, "00000001", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(strncmp(path, rootA, strlen(rootA)), 0);
+    ASSERT_EQ(get_image_path(handlerA, "00000002", &path), IMAGE_OPERATION_ERROR);
+    ASSERT_EQ(get_image_path(handlerB, "00000002", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(strncmp(path, rootB, strlen(rootB)), 0);
+
+    char **part_numbers = NULL;
+    int list_size = 0;
+    ASSERT_EQ(get_compatible_softwares(handlerA, "EXEMPLO3", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 0);
+    ASSERT_EQ(get_compatible_softwares(handlerB, "EXEMPLO3", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 1);
+    ASSERT_STREQ(part_numbers[0], "00000004");
+    free(part_numbers);
+
+    ASSERT_EQ(destroy_handler(&handlerA), IMAGE_OPERATION_OK);
+    ASSERT_EQ(destroy_handler(&handlerB), IMAGE_OPERATION_OK);
+    ASSERT_EQ(handlerA, nullptr);
+    remove_directory(rootA);
+    remove_directory(rootB);
+}
+
+TEST_F(ImageManagerTest, ConcurrentImportTest)
+{
+    // Images with different part numbers and compatibility files imported
+    // from several threads, while their paths are read
+    const char *files[] = {"origin_images/load1.bin", "origin_images/load2.bin", "origin_images/load3.bin",
+                           "origin_images/ARQ_Compatibilidade1.xml", "origin_images/ARQ_Compatibilidade2.xml"};
+    std::atomic<int> failures(0);
+    std::atomic<bool> importing(true);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 5; i++)
+    {
+        threads.push_back(std::thread([this, &files, &failures, i]() {
+            for (int j = 0; j < 4; j++)
+            {
+                if (import_image(handler, files[i], NULL) != IMAGE_OPERATION_OK)
+                {
+                    failures++;
+                }
+            }
+        }));
+    }
+
+    std::thread reader([this, &importing, &failures]() {
+        while (importing)
+        {
+            char *path = NULL;
+            if (get_image_path(handler, "00000001", &path) == IMAGE_OPERATION_OK && path == NULL)
+            {
+                failures++;
+            }
+        }
+    });
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    importing = false;
+    reader.join();
+    ASSERT_EQ(failures, 0);
+
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(handler, "00000001", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(handler, "00000002", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(handler, "00000003", &path), IMAGE_OPERATION_OK);
+
+    char **part_numbers = NULL;
+    int list_size = 0;
+    ASSERT_EQ(get_compatible_softwares(handler, "EXEMPLO3", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 2);
+    free(part_numbers);
+}
+
+TEST_F(ImageManagerTest, GetImagesGenerationTest)
+{
+    ASSERT_EQ(import_image(handler, "origin_images/load1.bin", NULL), IMAGE_OPERATION_OK);
+
+    unsigned long long generation = 0;
+    ASSERT_EQ(get_images_generation(handler, &generation), IMAGE_OPERATION_OK);
+
+    // The same list is returned while nothing changes
+    char **images = NULL;
+    int images_size = 0;
+    char **again = NULL;
+    int again_size = 0;
+    ASSERT_EQ(get_images(handler, &images, &images_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_images(handler, &again, &again_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(images, again);
+    ASSERT_EQ(images_size, again_size);
+
+    unsigned long long current = 0;
+    ASSERT_EQ(get_images_generation(handler, &current), IMAGE_OPERATION_OK);
+    ASSERT_EQ(current, generation);
+
+    // Compatibility files are not images
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_images_generation(handler, &current), IMAGE_OPERATION_OK);
+    ASSERT_EQ(current, generation);
+
+    ASSERT_EQ(remove_image(handler, "00000001"), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_images_generation(handler, &current), IMAGE_OPERATION_OK);
+    ASSERT_NE(current, generation);
+    ASSERT_EQ(get_images(handler, &again, &again_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(again_size, images_size - 1);
+    for (int i = 0; i < again_size; i++)
+    {
+        ASSERT_STRNE(again[i], "00000001");
+    }
+
+    // The list returned before is kept until another one replaces this one
+    bool found = false;
+    for (int i = 0; i < images_size; i++)
+    {
+        found = found || strcmp(images[i], "00000001") == 0;
+    }
+    ASSERT_TRUE(found);
+
+    ASSERT_EQ(import_image(handler, "origin_images/load1.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+}
+
+TEST_F(ImageManagerTest, SharedIndexTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    ImageHandlerPtr parent = NULL;
+    ASSERT_EQ(create_handler_with_config(&parent, &config), IMAGE_OPERATION_OK);
+
+    // Another process imports into the same directory
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0)
+    {
+        ImageHandlerPtr child = NULL;
+        bool ok = create_handler_with_config(&child, &config) == IMAGE_OPERATION_OK &&
+                  import_image(child, "origin_images/load2.bin", NULL) == IMAGE_OPERATION_OK &&
+                  import_image(child, "origin_images/ARQ_Compatibilidade2.xml", NULL) == IMAGE_OPERATION_OK &&
+                  destroy_handler(&child) == IMAGE_OPERATION_OK;
+        _exit(ok ? 0 : 1);
+    }
+
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    // The changes are seen without creating the handler again
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(parent, "00000002", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(strncmp(path, root, strlen(root)), 0);
+
+    char **part_numbers = NULL;
+    int list_size = 0;
+    ASSERT_EQ(get_compatible_softwares(parent, "EXEMPLO3", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 1);
+    ASSERT_STREQ(part_numbers[0], "00000004");
+    free(part_numbers);
+
+    ASSERT_EQ(destroy_handler(&parent), IMAGE_OPERATION_OK);
+    remove_directory(root);
+}
+
+TEST_F(ImageManagerTest, ManifestLogTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    ImageHandlerPtr first = NULL;
+    ASSERT_EQ(create_handler_with_config(&first, &config), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(first, "origin_images/load1.bin", NULL), IMAGE_OPERATION_OK);
+
+    // Changes are appended to the log, the manifest is not written again
+    std::string manifestPath = std::string(root) + "/.manifest";
+    std::string logPath = manifestPath + ".log";
+    struct stat before;
+    struct stat after;
+    bool hasManifest = (stat(manifestPath.c_str(), &before) == 0);
+    ASSERT_EQ(import_image(first, "origin_images/load2.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(remove_image(first, "00000001"), IMAGE_OPERATION_OK);
+    ASSERT_EQ(stat(manifestPath.c_str(), &after) == 0, hasManifest);
+    if (hasManifest)
+    {
+        ASSERT_EQ(before.st_ino, after.st_ino);
+    }
+    ASSERT_EQ(stat(logPath.c_str(), &after), 0);
+    ASSERT_GT(after.st_size, 0);
+
+    // Other handlers read the manifest with its log
+    ImageHandlerPtr second = NULL;
+    ASSERT_EQ(create_handler_with_config(&second, &config), IMAGE_OPERATION_OK);
+    char **images = NULL;
+    int images_size = 0;
+    ASSERT_EQ(get_images(second, &images, &images_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(images_size, 1);
+    ASSERT_STREQ(images[0], "00000002");
+
+    // and then only the changes appended to the log
+    ASSERT_EQ(import_image(first, "origin_images/load3.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(remove_image(first, "00000002"), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_images(second, &images, &images_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(images_size, 1);
+    ASSERT_STREQ(images[0], "00000003");
+    ASSERT_EQ(import_image(second, "origin_images/load2.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(remove_image(second, "00000003"), IMAGE_OPERATION_OK);
+    ASSERT_EQ(destroy_handler(&second), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_images(first, &images, &images_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(images_size, 1);
+    ASSERT_STREQ(images[0], "00000002");
+    ASSERT_EQ(destroy_handler(&first), IMAGE_OPERATION_OK);
+
+    // A record left incomplete by a crash is ignored
+    FILE *fp = fopen(logPath.c_str(), "a");
+    ASSERT_NE(fp, nullptr);
+    fputs("- 00000002_", fp);
+    fclose(fp);
+
+    // The first handler of the directory starts from them too
+    ASSERT_EQ(create_handler_with_config(&first, &config), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_images(first, &images, &images_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(images_size, 1);
+    ASSERT_STREQ(images[0], "00000002");
+    ASSERT_EQ(import_image(first, "origin_images/load1.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(create_handler_with_config(&second, &config), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_images(second, &images, &images_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(images_size, 2);
+
+    ASSERT_EQ(destroy_handler(&second), IMAGE_OPERATION_OK);
+    ASSERT_EQ(destroy_handler(&first), IMAGE_OPERATION_OK);
+    remove_directory(root);
+}
+
+TEST_F(ImageManagerTest, WatchDirectoryTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    config.watch_directory = 1;
+    ImageHandlerPtr watched = NULL;
+    ASSERT_EQ(create_handler_with_config(&watched, &config), IMAGE_OPERATION_OK);
+
+    // Files copied into the directory are listed without any import
+    struct stat st;
+    ASSERT_EQ(stat("origin_images/load2.bin", &st), 0);
+    std::string imagePath = std::string(root) + "/00000002_" + std::to_string(st.st_size) + ".bin";
+    {
+        std::ifstream in("origin_images/load2.bin", std::ios::binary);
+        std::ofstream out(imagePath, std::ios::binary);
+        out << in.rdbuf();
+    }
+    {
+        std::ifstream in("origin_images/ARQ_Compatibilidade2.xml", std::ios::binary);
+        std::ofstream out(std::string(root) + "/" + COMPATIBILITY_FILE, std::ios::binary);
+        out << in.rdbuf();
+    }
+
+    char *path = NULL;
+    char **part_numbers = NULL;
+    int list_size = 0;
+    for (int i = 0; i < 500; i++)
+    {
+        list_size = 0;
+        if (get_image_path(watched, "00000002", &path) == IMAGE_OPERATION_OK &&
+            get_compatible_softwares(watched, "EXEMPLO3", &part_numbers, &list_size) == IMAGE_OPERATION_OK &&
+            list_size == 1)
+        {
+            break;
+        }
+        usleep(10000);
+    }
+    ASSERT_EQ(get_image_path(watched, "00000002", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(imagePath, path);
+    ASSERT_EQ(list_size, 1);
+    ASSERT_STREQ(part_numbers[0], "00000004");
+    free(part_numbers);
+
+    // And dropped once they are removed
+    ASSERT_EQ(unlink(imagePath.c_str()), 0);
+    for (int i = 0; i < 500 && get_image_path(watched, "00000002", &path) == IMAGE_OPERATION_OK; i++)
+    {
+        usleep(10000);
+    }
+    ASSERT_EQ(get_image_path(watched, "00000002", &path), IMAGE_OPERATION_ERROR);
+
+    ASSERT_EQ(destroy_handler(&watched), IMAGE_OPERATION_OK);
+    remove_directory(root);
+}
+
+TEST_F(ImageManagerTest, ImageIndexPartNumbersTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    // An image copied with another name is listed by the part number it has
+    std::string customPath = std::string(root) + "/custom_load.bin";
+    {
+        std::ifstream in("origin_images/load1.bin", std::ios::binary);
+        std::ofstream out(customPath, std::ios::binary);
+        out << in.rdbuf();
+    }
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    ImageHandlerPtr indexed = NULL;
+    ASSERT_EQ(create_handler_with_config(&indexed, &config), IMAGE_OPERATION_OK);
+
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(indexed, "00000001", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(customPath, path);
+
+    // Part numbers are hex in any case, anything else is not found
+    char *pn = NULL;
+    ASSERT_EQ(import_image(indexed, "origin_images/load2.bin", &pn), IMAGE_OPERATION_OK);
+    ASSERT_STREQ(pn, "00000002");
+    ASSERT_EQ(get_image_path(indexed, "0000000a", &path), IMAGE_OPERATION_ERROR);
+    ASSERT_EQ(get_image_path(indexed, "00000002", &path), IMAGE_OPERATION_OK);
+    std::string importedPath = path;
+    ASSERT_EQ(get_image_path(indexed, "00000002", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(importedPath, path);
+    ASSERT_EQ(get_image_path(indexed, "0000002", &path), IMAGE_OPERATION_ERROR);
+    ASSERT_EQ(get_image_path(indexed, "000000002", &path), IMAGE_OPERATION_ERROR);
+    ASSERT_EQ(get_image_path(indexed, "custom", &path), IMAGE_OPERATION_ERROR);
+
+    // Both are still listed once the handler is created again
+    ASSERT_EQ(destroy_handler(&indexed), IMAGE_OPERATION_OK);
+    ASSERT_EQ(create_handler_with_config(&indexed, &config), IMAGE_OPERATION_OK);
+    char **images = NULL;
+    int images_size = 0;
+    ASSERT_EQ(get_images(indexed, &images, &images_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(images_size, 2);
+    ASSERT_EQ(get_image_path(indexed, "00000001", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(customPath, path);
+
+    ASSERT_EQ(remove_image(indexed, "00000001"), IMAGE_OPERATION_OK);
+    ASSERT_NE(access(customPath.c_str(), F_OK), 0);
+    ASSERT_EQ(get_image_path(indexed, "00000001", &path), IMAGE_OPERATION_ERROR);
+
+    ASSERT_EQ(destroy_handler(&indexed), IMAGE_OPERATION_OK);
+    remove_directory(root);
+}
+
+TEST_F(ImageManagerTest, ReturnedStringsLifetimeTest)
+{
+    char *pn = NULL;
+    char *firstPath = NULL;
+    ASSERT_EQ(import_image(handler, "origin_images/load1.bin", &pn), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(handler, pn, &firstPath), IMAGE_OPERATION_OK);
+    std::string expectedPath = firstPath;
+
+    ImageImportOperationPtr operation = NULL;
+    ASSERT_EQ(import_image_async(handler, "origin_images/load2.bin", NULL, NULL, &operation), IMAGE_OPERATION_OK);
+    ImageOperationResult result = IMAGE_OPERATION_ERROR;
+    const char *asyncPn = NULL;
+    ASSERT_EQ(wait_import(operation, &result, &asyncPn), IMAGE_OPERATION_OK);
+    ASSERT_EQ(release_import(&operation), IMAGE_OPERATION_OK);
+
+    char *xmlPn = NULL;
+    ASSERT_EQ(import_image(handler, "origin_images/ARQ_Compatibilidade1.xml", &xmlPn), IMAGE_OPERATION_OK);
+
+    // The same path is returned as the same string while the image is kept
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(handler, pn, &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(firstPath, path);
+    ASSERT_EQ(expectedPath, firstPath);
+
+    // Part numbers returned by the handler stay valid after the image is
+    // removed, and after the operation is released
+    ASSERT_EQ(remove_image(handler, "00000001"), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(handler, "00000001", &path), IMAGE_OPERATION_ERROR);
+    ASSERT_STREQ(pn, "00000001");
+    ASSERT_STREQ(asyncPn, "00000002");
+    ASSERT_STREQ(xmlPn, "00000000");
+
+    ASSERT_EQ(import_image(handler, "origin_images/load1.bin", &pn), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(handler, pn, &path), IMAGE_OPERATION_OK);
+    ASSERT_STREQ(path, expectedPath.c_str());
+}
+
+TEST_F(ImageManagerTest, SharedIndexSameProcessTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    ImageHandlerPtr first = NULL;
+    ImageHandlerPtr second = NULL;
+    ASSERT_EQ(create_handler_with_config(&first, &config), IMAGE_OPERATION_OK);
+    ASSERT_EQ(create_handler_with_config(&second, &config), IMAGE_OPERATION_OK);
+
+    // Each handler sees the images imported by the other one
+    char *path = NULL;
+    ASSERT_EQ(import_image(first, "origin_images/load1.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(second, "00000001", &path), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(second, "origin_images/load2.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(first, "00000002", &path), IMAGE_OPERATION_OK);
+
+    // Compatibility changes made by both at the same time are all kept
+    std::atomic<int> failures(0);
+    std::thread other([&second, &failures]() {
+        for (int i = 0; i < 10; i++)
+        {
+            if (import_image(second, "origin_images/ARQ_Compatibilidade2.xml", NULL) != IMAGE_OPERATION_OK)
+            {
+                failures++;
+            }
+        }
+    });
+    for (int i = 0; i < 10; i++)
+    {
+        ASSERT_EQ(import_image(first, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+    }
+    other.join();
+    ASSERT_EQ(failures, 0);
+
+    char **first_list = NULL;
+    char **second_list = NULL;
+    int first_size = 0;
+    int second_size = 0;
+    ASSERT_EQ(get_compatible_softwares(first, "EXEMPLO3", &first_list, &first_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_compatible_softwares(second, "EXEMPLO3", &second_list, &second_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(first_size, 2);
+    ASSERT_EQ(second_size, first_size);
+    for (int i = 0; i < first_size; i++)
+    {
+        ASSERT_STREQ(first_list[i], second_list[i]);
+    }
+    free(first_list);
+    free(second_list);
+
+    // Destroying one handler leaves the locks of the other one in place,
+    // starting with the shared presence byte of the index
+    ASSERT_EQ(destroy_handler(&second), IMAGE_OPERATION_OK);
+    int fd = open((std::string(root) + "/.index").c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 4096;
+    fl.l_len = 1;
+    ASSERT_EQ(fcntl(fd, F_OFD_GETLK, &fl), 0);
+    ASSERT_EQ(fl.l_type, F_RDLCK);
+    close(fd);
+
+    ASSERT_EQ(import_image(first, "origin_images/load3.bin", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(create_handler_with_config(&second, &config), IMAGE_OPERATION_OK);
+    ASSERT_EQ(get_image_path(second, "00000003", &path), IMAGE_OPERATION_OK);
+
+    ASSERT_EQ(destroy_handler(&first), IMAGE_OPERATION_OK);
+    ASSERT_EQ(destroy_handler(&second), IMAGE_OPERATION_OK);
+    remove_directory(root);
+}
+
+TEST_F(ImageManagerTest, CompatibilityJournalReplacedFileTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    ImageHandlerPtr first = NULL;
+    ASSERT_EQ(create_handler_with_config(&first, &config), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(first, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(first, "origin_images/ARQ_Compatibilidade2.xml", NULL), IMAGE_OPERATION_OK);
+
+    // The compatibility file is replaced by someone else while the second
+    // import is only in the journal
+    std::string compatibilityPath = std::string(root) + "/" + COMPATIBILITY_FILE;
+    std::string tmpPath = compatibilityPath + ".new";
+    std::ifstream in("origin_images/ARQ_Compatibilidade1.xml");
+    std::ofstream out(tmpPath);
+    out << in.rdbuf();
+    out.close();
+    ASSERT_EQ(rename(tmpPath.c_str(), compatibilityPath.c_str()), 0);
+
+    // Its changes are applied to the new file
+    ImageHandlerPtr second = NULL;
+    ASSERT_EQ(create_handler_with_config(&second, &config), IMAGE_OPERATION_OK);
+    char **part_numbers = NULL;
+    int list_size = 0;
+    ASSERT_EQ(get_compatible_softwares(second, "EXEMPLO6", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 2);
+    ASSERT_STREQ(part_numbers[0], "00000002");
+    ASSERT_STREQ(part_numbers[1], "00000005");
+    free(part_numbers);
+
+    // and written to it when the last handler is destroyed
+    ASSERT_EQ(destroy_handler(&second), IMAGE_OPERATION_OK);
+    ASSERT_EQ(destroy_handler(&first), IMAGE_OPERATION_OK);
+    std::ifstream file(compatibilityPath);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_NE(content.find("00000005"), std::string::npos);
+
+    remove_directory(root);
+}
+
+static void import_blocked(
+    ImageImportOperationPtr operation,
+    ImageOperationResult result,
+    const char *part_number,
+    void *user_data)
+{
+    (void)operation;
+    (void)result;
+    (void)part_number;
+    ((std::shared_future<void> *)user_data)->wait();
+}
+
+TEST_F(ImageManagerTest, CancelImportAsyncTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    config.import_threads = 1;
+    ImageHandlerPtr cancelled = NULL;
+    ASSERT_EQ(create_handler_with_config(&cancelled, &config), IMAGE_OPERATION_OK);
+
+    // The only worker is kept busy by the callback of the first import, so
+    // the second one is cancelled before it starts
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    ImageImportOperationPtr first = NULL;
+    ImageImportOperationPtr second = NULL;
+    ASSERT_EQ(import_image_async(cancelled, "origin_images/load1.bin", import_blocked, &released, &first), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image_async(cancelled, "origin_images/load2.bin", NULL, NULL, &second), IMAGE_OPERATION_OK);
+
+    ImageOperationResult result = IMAGE_OPERATION_ERROR;
+    const char *pn = NULL;
+    ASSERT_EQ(wait_import(first, &result, &pn), IMAGE_OPERATION_OK);
+    ASSERT_EQ(result, IMAGE_OPERATION_OK);
+
+    unsigned long long bytesDone = 0;
+    unsigned long long bytesTotal = 0;
+    int done = 1;
+    ASSERT_EQ(get_import_progress(second, &bytesDone, &bytesTotal, &done), IMAGE_OPERATION_OK);
+    ASSERT_EQ(done, 0);
+    ASSERT_EQ(bytesDone, 0u);
+    ASSERT_EQ(cancel_import(second), IMAGE_OPERATION_OK);
+    release.set_value();
+
+    ASSERT_EQ(wait_import(second, &result, &pn), IMAGE_OPERATION_OK);
+    ASSERT_EQ(result, IMAGE_OPERATION_CANCELLED);
+    ASSERT_EQ(pn, nullptr);
+    ASSERT_EQ(release_import(&first), IMAGE_OPERATION_OK);
+    ASSERT_EQ(release_import(&second), IMAGE_OPERATION_OK);
+
+    // Nothing is left behind
+    char *path = NULL;
+    ASSERT_EQ(get_image_path(cancelled, "00000002", &path), IMAGE_OPERATION_ERROR);
+    DIR *dr = opendir(root);
+    ASSERT_NE(dr, nullptr);
+    struct dirent *de;
+    while ((de = readdir(dr)) != NULL)
+    {
+        EXPECT_NE(strncmp(de->d_name, ".import_", strlen(".import_")), 0) << de->d_name;
+    }
+    closedir(dr);
+
+    ASSERT_EQ(destroy_handler(&cancelled), IMAGE_OPERATION_OK);
+    remove_directory(root);
+}
+
+TEST_F(ImageManagerTest, CompatibilityPathsKeptTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    ImageHandlerPtr rooted = NULL;
+    ASSERT_EQ(create_handler_with_config(&rooted, &config), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(rooted, "origin_images/ARQ_Compatibilidade1.xml", NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(import_image(rooted, "origin_images/ARQ_Compatibilidade2.xml", NULL), IMAGE_OPERATION_OK);
+
+    // Each set of part numbers is a different file
+    const char *pns[] = {"00000001", "00000002", "00000003", "00000004", "00000005", "00000006"};
+    std::vector<std::string> paths;
+    for (int mask = 1; mask <= 17; mask++)
+    {
+        char *pnlist[6];
+        int size = 0;
+        for (int i = 0; i < 6; i++)
+        {
+            if (mask & (1 << i))
+            {
+                pnlist[size++] = (char *)pns[i];
+            }
+        }
+
+        char *path = NULL;
+        ASSERT_EQ(get_compatibility_path(rooted, pnlist, size, &path), IMAGE_OPERATION_OK);
+        paths.push_back(path);
+
+        // Asking for the first one again keeps it
+        if (mask == 8)
+        {
+            char *first[] = {(char *)pns[0]};
+            ASSERT_EQ(get_compatibility_path(rooted, first, 1, &path), IMAGE_OPERATION_OK);
+            ASSERT_EQ(paths[0], path);
+        }
+    }
+
+    // Only the last 16 files are kept
+    ASSERT_EQ(access(paths[0].c_str(), F_OK), 0);
+    ASSERT_NE(access(paths[1].c_str(), F_OK), 0);
+    for (size_t i = 2; i < paths.size(); i++)
+    {
+        ASSERT_EQ(access(paths[i].c_str(), F_OK), 0);
+    }
+
+    ASSERT_EQ(destroy_handler(&rooted), IMAGE_OPERATION_OK);
+    remove_directory(root);
+}
+
+TEST_F(ImageManagerTest, CompatibilityExtraContentKeptTest)
+{
+    char root[] = "/tmp/image_root_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+    char source[] = "/tmp/image_source_XXXXXX";
+    ASSERT_NE(mkdtemp(source), nullptr);
+
+    // Content the compatibility data does not define
+    std::string firstPath = std::string(source) + "/first.xml";
+    std::string first =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<!-- Compatibility of the test loads -->\n"
+        "<COMPATIBILITY revision=\"7\">\n"
+        "\t<SOFTWARE PN=\"00000001\" date=\"2020-01-01\">\n"
+        "\t\t<LRU name=\"LRU_A\" PN=\"EXEMPLO1\" slot=\"2\"/>\n"
+        "\t\t<NOTE>Keep me</NOTE>\n"
+        "\t</SOFTWARE>\n"
+        "\t<SOFTWARE PN=\"00000002\">\n"
+        "\t\t<!-- replaced below -->\n"
+        "\t\t<LRU name=\"LRU_B\" PN=\"EXEMPLO2\"/>\n"
+        "\t</SOFTWARE>\n"
+        "\t<INFO owner=\"tests\"/>\n"
+        "</COMPATIBILITY>\n";
+    std::ofstream(firstPath, std::ios::binary) << first;
+
+    std::string secondPath = std::string(source) + "/second.xml";
+    std::ofstream(secondPath, std::ios::binary)
+        << "<COMPATIBILITY>\n"
+           "    <SOFTWARE PN=\"00000002\" date=\"2021-02-02\">\n"
+           "        <LRU name=\"LRU_C\" PN=\"EXEMPLO3\"/>\n"
+           "        <!-- new entry -->\n"
+           "    </SOFTWARE>\n"
+           "</COMPATIBILITY>\n";
+
+    ImageHandlerConfig config;
+    ASSERT_EQ(init_handler_config(&config), IMAGE_OPERATION_OK);
+    config.root_dir = root;
+    ImageHandlerPtr rooted = NULL;
+    ASSERT_EQ(create_handler_with_config(&rooted, &config), IMAGE_OPERATION_OK);
+
+    // The first file imported is copied as it is
+    std::string compatibilityPath = std::string(root) + "/" + COMPATIBILITY_FILE;
+    ASSERT_EQ(import_image(rooted, firstPath.c_str(), NULL), IMAGE_OPERATION_OK);
+    {
+        std::ifstream file(compatibilityPath, std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(content, first);
+    }
+
+    // Entries are written with everything they have
+    char *pnlist[] = {(char *)"00000001"};
+    char *buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(get_compatibility_buffer(rooted, pnlist, 1, &buffer, &size), IMAGE_OPERATION_OK);
+    ASSERT_NE(strstr(buffer, "date=\"2020-01-01\""), nullptr);
+    ASSERT_NE(strstr(buffer, "slot=\"2\""), nullptr);
+    ASSERT_NE(strstr(buffer, "<NOTE>Keep me</NOTE>"), nullptr);
+    free(buffer);
+
+    // A compaction only replaces the changed entry
+    ASSERT_EQ(import_image(rooted, secondPath.c_str(), NULL), IMAGE_OPERATION_OK);
+    ASSERT_EQ(compact_compatibility(rooted), IMAGE_OPERATION_OK);
+    {
+        std::ifstream file(compatibilityPath, std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(content,
+                  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                  "<!-- Compatibility of the test loads -->\n"
+                  "<COMPATIBILITY revision=\"7\">\n"
+                  "\t<SOFTWARE PN=\"00000001\" date=\"2020-01-01\">\n"
+                  "\t\t<LRU name=\"LRU_A\" PN=\"EXEMPLO1\" slot=\"2\"/>\n"
+                  "\t\t<NOTE>Keep me</NOTE>\n"
+                  "\t</SOFTWARE>\n"
+                  "\t<INFO owner=\"tests\"/>\n"
+                  "    <SOFTWARE PN=\"00000002\" date=\"2021-02-02\">\n"
+                  "        <LRU name=\"LRU_C\" PN=\"EXEMPLO3\"/>\n"
+                  "        <!-- new entry -->\n"
+                  "    </SOFTWARE>\n"
+                  "</COMPATIBILITY>\n");
+    }
+
+    char **part_numbers = NULL;
+    int list_size = 0;
+    ASSERT_EQ(get_compatible_softwares(rooted, "LRU_C", &part_numbers, &list_size), IMAGE_OPERATION_OK);
+    ASSERT_EQ(list_size, 1);
+    ASSERT_STREQ(part_numbers[0], "00000002");
+    free(part_numbers);
+
+    ASSERT_EQ(destroy_handler(&rooted), IMAGE_OPERATION_OK);
+    remove_directory(root);
+    remove_directory(source);
+}